@@ -5,8 +5,12 @@
 #include "runtime_common.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,26 +21,39 @@
 static const size_t INIT_HEAP_SIZE = MINIMUM_HEAP_CAPACITY;
 
 #ifdef DEBUG_VERSION
-size_t cur_id = 0;
+THREAD_LOCAL size_t cur_id = 0;
 #endif
 
-static extra_roots_pool extra_roots;
+THREAD_LOCAL handle_region gc_handles;
 
-size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
+static THREAD_LOCAL large_object_space large_objects;
+static THREAD_LOCAL immortal_chunk    *immortal_chunks;
+static THREAD_LOCAL scoped_region      scoped;
+static THREAD_LOCAL root_card_table    root_cards;
+static THREAD_LOCAL gc_stack_scanner   stack_scanner;
+static THREAD_LOCAL size_t             gc_cycles;
+static THREAD_LOCAL const char        *snapshot_prefix;
+#ifdef DEBUG_VERSION
+static THREAD_LOCAL size_t immortal_objects;
+#endif
+
+THREAD_LOCAL size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
 #ifdef LAMA_ENV
 extern const size_t __start_custom_data, __stop_custom_data;
 #endif
 
 #ifdef DEBUG_VERSION
-memory_chunk heap;
+THREAD_LOCAL memory_chunk heap;
 #else
-static memory_chunk heap;
+static THREAD_LOCAL memory_chunk heap;
 #endif
 
 #ifdef DEBUG_VERSION
 void dump_heap ();
 #endif
 
+static void write_requested_snapshot (void);
+
 void handler (int sig) {
   void *array[10];
   int   size;
@@ -151,8 +168,8 @@ FILE *print_objects_traversal (char *filename, bool marked) {
   fflush(f);
 
   // print extra roots
-  for (int i = 0; i < extra_roots.current_free; i++) {
-    fprintf(f, "extra root %p %p: ", extra_roots.roots[i], *(size_t **)extra_roots.roots[i]);
+  for (void ***h = gc_handles.begin; h < gc_handles.current; h++) {
+    fprintf(f, "handle %p %p: ", *h, *(size_t **)*h);
   }
   fflush(f);
   return f;
@@ -183,6 +200,9 @@ void *gc_alloc_on_existing_heap (size_t size) {
 }
 
 void *gc_alloc (size_t size) {
+  ++gc_cycles;
+  // all roots are in place here, so this is a safe point to take a requested snapshot
+  write_requested_snapshot();
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has started\n");
 #endif
@@ -197,6 +217,7 @@ void *gc_alloc (size_t size) {
 #endif
 
   compact_phase(size);
+  sweep_large_objects();
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_after           = print_stack_content("stack-dump-after-compaction");
   FILE *heap_after_compaction = print_objects_traversal("after-compaction", 0);
@@ -222,10 +243,51 @@ void *gc_alloc (size_t size) {
   return gc_alloc_on_existing_heap(size);
 }
 
+static void gc_root_scan_slots (size_t *begin, size_t *end) {
+  for (size_t *p = begin; p < end; ++p) { gc_test_and_mark_root((size_t **)p); }
+}
+
+static inline size_t root_cards_number (void) {
+  return (root_cards.end - root_cards.begin + ROOT_CARD_WORDS - 1) >> ROOT_CARD_SHIFT;
+}
+
+// slots of the card are [*begin, *end)
+static inline void root_card_bounds (size_t card, size_t **begin, size_t **end) {
+  *begin = root_cards.begin + (card << ROOT_CARD_SHIFT);
+  *end   = MIN(*begin + ROOT_CARD_WORDS, root_cards.end);
+}
+
+// marks from dirty cards, cards without pointers to movable or large objects are cleaned
+static void gc_root_scan_cards (void) {
+  for (size_t card = 0; card < root_cards_number(); ++card) {
+    if (!root_cards.cards[card]) { continue; }
+    size_t *begin, *end;
+    root_card_bounds(card, &begin, &end);
+    bool pointers = false;
+    for (size_t *p = begin; p < end; ++p) {
+      pointers |= is_valid_heap_pointer((size_t *)*p) || is_large_object_pointer((size_t *)*p);
+      gc_test_and_mark_root((size_t **)p);
+    }
+    root_cards.cards[card] = pointers;
+  }
+}
+
+static void gc_mark_slot (size_t *slot, void *context) { gc_test_and_mark_root((size_t **)slot); }
+
 static void gc_root_scan_stack () {
-  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
-    gc_test_and_mark_root((size_t **)p);
+  if (stack_scanner != NULL) {
+    stack_scanner(gc_mark_slot, NULL);
+    if (root_cards.cards != NULL) { gc_root_scan_cards(); }
+    return;
   }
+  size_t *begin = (size_t *)(__gc_stack_top + 4), *end = (size_t *)__gc_stack_bottom;
+  if (root_cards.cards == NULL) {
+    gc_root_scan_slots(begin, end);
+    return;
+  }
+  gc_root_scan_slots(begin, MIN(end, root_cards.begin));
+  gc_root_scan_slots(MAX(begin, root_cards.end), end);
+  gc_root_scan_cards();
 }
 
 void mark_phase (void) {
@@ -239,11 +301,12 @@ void mark_phase (void) {
   gc_root_scan_stack();
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "gc_root_scan_stack has finished\n");
-  fprintf(stderr, "scan_extra_roots has started\n");
+  fprintf(stderr, "scan_handles has started\n");
 #endif
-  scan_extra_roots();
+  scan_handles();
+  scan_scoped_region();
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "scan_extra_roots has finished\n");
+  fprintf(stderr, "scan_handles has finished\n");
   fprintf(stderr, "scan_global_area has started\n");
 #endif
 #ifdef LAMA_ENV
@@ -251,6 +314,9 @@ void mark_phase (void) {
 #endif
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "scan_global_area has finished\n");
+#endif
+  trace_large_objects();
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has finished\n");
 #endif
 }
@@ -329,18 +395,18 @@ void scan_and_fix_region (memory_chunk *old_heap, void *start, void *end) {
 
 void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
-  fprintf(stderr, "extra roots started: number of extra roots %i\n", extra_roots.current_free);
+  fprintf(stderr, "handles started: number of handles %i\n", (int)(gc_handles.current - gc_handles.begin));
 #endif
-  for (int i = 0; i < extra_roots.current_free; i++) {
-    size_t *ptr       = (size_t *)extra_roots.roots[i];
+  for (void ***h = gc_handles.begin; h < gc_handles.current; h++) {
+    size_t *ptr       = (size_t *)*h;
     size_t  ptr_value = *ptr;
     if (!is_valid_pointer((size_t *)ptr_value)) { continue; }
     // skip this one since it was already fixed from scanning the stack
-    if ((extra_roots.roots[i] >= (void **)__gc_stack_top
-         && extra_roots.roots[i] < (void **)__gc_stack_bottom)
+    if ((*h >= (void **)__gc_stack_top
+         && *h < (void **)__gc_stack_bottom)
 #ifdef LAMA_ENV
-        || (extra_roots.roots[i] <= (void **)&__stop_custom_data
-            && extra_roots.roots[i] >= (void **)&__start_custom_data)
+        || (*h <= (void **)&__stop_custom_data
+            && *h >= (void **)&__start_custom_data)
 #endif
     ) {
 #ifdef DEBUG_VERSION
@@ -348,19 +414,19 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #  ifdef DEBUG_PRINT
         fprintf(stderr,
                 "|\tskip extra root: %p (%p), since it points to Lama's stack top=%p bot=%p\n",
-                extra_roots.roots[i],
+                *h,
                 (void *)ptr_value,
                 (void *)__gc_stack_top,
                 (void *)__gc_stack_bottom);
 #  endif
       }
 #  ifdef LAMA_ENV
-      else if ((extra_roots.roots[i] <= (void *)&__stop_custom_data
-                && extra_roots.roots[i] >= (void *)&__start_custom_data)) {
+      else if ((*h <= (void *)&__stop_custom_data
+                && *h >= (void *)&__start_custom_data)) {
         fprintf(
             stderr,
             "|\tskip extra root: %p (%p), since it points to Lama's static area stop=%p start=%p\n",
-            extra_roots.roots[i],
+            *h,
             (void *)ptr_value,
             (void *)&__stop_custom_data,
             (void *)&__start_custom_data);
@@ -371,7 +437,7 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #  ifdef DEBUG_PRINT
         fprintf(stderr,
                 "|\tskip extra root: %p (%p): not a valid Lama pointer \n",
-                extra_roots.roots[i],
+                *h,
                 (void *)ptr_value);
 #  endif
       }
@@ -387,7 +453,7 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
       fprintf(stderr,
               "|\textra root (%p) %p -> %p\n",
-              extra_roots.roots[i],
+              *h,
               (void *)ptr_value,
               (void *)*ptr);
 #endif
@@ -398,6 +464,8 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
 }
 
+static void gc_fix_slot (size_t *slot, void *old_heap) { scan_and_fix_region(old_heap, slot, slot + 1); }
+
 void update_references (memory_chunk *old_heap) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC update_references started\n");
@@ -437,12 +505,34 @@ void update_references (memory_chunk *old_heap) {
     }
     heap_next_obj_iterator(&it);
   }
-  // fix pointers from stack
-  scan_and_fix_region(old_heap, (void *)__gc_stack_top + 4, (void *)__gc_stack_bottom + 4);
+  // fix pointers from stack, carded slots are fixed only in cards left dirty by marking
+  if (stack_scanner != NULL) {
+    stack_scanner(gc_fix_slot, old_heap);
+  } else if (root_cards.cards == NULL) {
+    scan_and_fix_region(old_heap, (void *)__gc_stack_top + 4, (void *)__gc_stack_bottom + 4);
+  } else {
+    void *begin = (void *)__gc_stack_top + 4, *end = (void *)__gc_stack_bottom + 4;
+    scan_and_fix_region(old_heap, begin, MIN(end, (void *)root_cards.begin));
+    scan_and_fix_region(old_heap, MAX(begin, (void *)root_cards.end), end);
+  }
+  if (root_cards.cards != NULL) {
+    for (size_t card = 0; card < root_cards_number(); ++card) {
+      if (!root_cards.cards[card]) { continue; }
+      size_t *card_begin, *card_end;
+      root_card_bounds(card, &card_begin, &card_end);
+      scan_and_fix_region(old_heap, card_begin, card_end);
+    }
+  }
 
-  // fix pointers from extra_roots
+  // fix pointers from handles
   scan_and_fix_region_roots(old_heap);
 
+  // fix pointers from large objects
+  update_large_object_references(old_heap);
+
+  // fix pointers from the scoped region
+  update_scoped_region_references(old_heap);
+
 #ifdef LAMA_ENV
   //assert((void *)&__stop_custom_data >= (void *)&__start_custom_data);
   //scan_and_fix_region(old_heap, (void *)&__start_custom_data, (void *)&__stop_custom_data);
@@ -480,6 +570,11 @@ inline bool is_valid_heap_pointer (const size_t *p) {
   return !UNBOXED(p) && (size_t)heap.begin <= (size_t)p && (size_t)p <= (size_t)heap.current;
 }
 
+bool is_valid_lama_pointer (const size_t *p) {
+  return is_valid_heap_pointer(p) || is_large_object_pointer(p) || is_immortal_pointer(p)
+         || is_scoped_pointer(p);
+}
+
 static inline bool is_valid_pointer (const size_t *p) { return !UNBOXED(p); }
 
 static inline void queue_enqueue (heap_iterator *tail_iter, void *obj) {
@@ -499,8 +594,23 @@ static inline void *queue_dequeue (heap_iterator *head_iter) {
   return value;
 }
 
+// large objects are never enqueued: they are marked in place and traced later if they have fields
+static inline void mark_large_object (void *obj) {
+  if (!is_large_object_pointer(obj) || is_marked(obj)) { return; }
+  mark_object(obj);
+  if (get_type_row_ptr(obj) != STRING) {
+    large_object *lo   = (large_object *)TO_DATA(obj) - 1;
+    lo->next_gray      = large_objects.gray;
+    large_objects.gray = lo;
+  }
+}
+
 void mark (void *obj) {
-  if (!is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
+  if (!is_valid_heap_pointer(obj)) {
+    mark_large_object(obj);
+    return;
+  }
+  if (is_marked(obj)) { return; }
 
   // TL;DR: [q_head_iter, q_tail_iter) q_head_iter -- current dequeue's victim, q_tail_iter -- place for next enqueue
   // in forward_address of corresponding element we store address of element to be removed after dequeue operation
@@ -520,10 +630,11 @@ void mark (void *obj) {
          !field_is_done_iterator(&ptr_field_it);
          obj_next_ptr_field_iterator(&ptr_field_it)) {
       void *field_value = *(void **)ptr_field_it.cur_field;
-      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)
-          || is_enqueued(field_value)) {
+      if (!is_valid_heap_pointer(field_value)) {
+        mark_large_object(field_value);
         continue;
       }
+      if (is_marked(field_value) || is_enqueued(field_value)) { continue; }
       // if we came to this point it must be true that field_value is unmarked and not currently in queue
       // thus, we maintain the invariant
       queue_enqueue(&q_tail_iter, field_value);
@@ -531,10 +642,10 @@ void mark (void *obj) {
   }
 }
 
-void scan_extra_roots (void) {
-  for (int i = 0; i < extra_roots.current_free; ++i) {
-    // this dereferencing is safe since runtime is pushing correct pointers into extra_roots
-    mark(*extra_roots.roots[i]);
+void scan_handles (void) {
+  for (void ***h = gc_handles.begin; h < gc_handles.current; ++h) {
+    // this dereferencing is safe since runtime is pushing correct pointers as handles
+    mark(**h);
   }
 }
 
@@ -564,8 +675,22 @@ void __gc_init (void) {
   __init();
 }
 
+// signal dispositions are process-wide: the handler is installed by the first `__init` only,
+// so that it does not replace handlers installed afterwards (e.g. by an embedder) when other
+// threads start their programs; later callers wait until it is installed
+static void install_segv_handler_once (void) {
+  static int state;   // 0: not installed, 1: being installed, 2: installed
+  int        expected = 0;
+  if (__atomic_compare_exchange_n(&state, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    signal(SIGSEGV, handler);
+    __atomic_store_n(&state, 2, __ATOMIC_RELEASE);
+    return;
+  }
+  while (__atomic_load_n(&state, __ATOMIC_ACQUIRE) != 2) { }
+}
+
 void __init (void) {
-  signal(SIGSEGV, handler);
+  install_segv_handler_once();
   size_t space_size = INIT_HEAP_SIZE * sizeof(size_t);
 
   srandom(time(NULL));
@@ -579,13 +704,31 @@ void __init (void) {
   heap.end     = heap.begin + INIT_HEAP_SIZE;
   heap.size    = INIT_HEAP_SIZE;
   heap.current = heap.begin;
-  clear_extra_roots();
+  clear_handles();
 }
 
 extern void __shutdown (void) {
   munmap(heap.begin, heap.size);
+  for (size_t i = 0; i < large_objects.count; ++i) {
+    munmap(large_objects.index[i]->mapping, large_objects.index[i]->size);
+  }
+  free(large_objects.index);
+  memset(&large_objects, 0, sizeof(large_objects));
+  while (immortal_chunks) {
+    immortal_chunk *next = immortal_chunks->next;
+    munmap(immortal_chunks, immortal_chunks->size);
+    immortal_chunks = next;
+  }
+  if (scoped.begin) { munmap(scoped.begin, SCOPED_REGION_SIZE); }
+  memset(&scoped, 0, sizeof(scoped));
+  memset(&root_cards, 0, sizeof(root_cards));
+  stack_scanner = NULL;
+  free(gc_handles.begin);
+  memset(&gc_handles, 0, sizeof(gc_handles));
+  gc_cycles = 0;
 #ifdef DEBUG_VERSION
-  cur_id = 0;
+  cur_id           = 0;
+  immortal_objects = 0;
 #endif
   heap.begin        = NULL;
   heap.end          = NULL;
@@ -595,30 +738,495 @@ extern void __shutdown (void) {
   __gc_stack_bottom = 0;
 }
 
-void clear_extra_roots (void) { extra_roots.current_free = 0; }
+/* Handle scopes */
 
-void push_extra_root (void **p) {
-  if (extra_roots.current_free >= MAX_EXTRA_ROOTS_NUMBER) {
-    perror("ERROR: push_extra_roots: extra_roots_pool overflow\n");
+void clear_handles (void) { gc_handles.current = gc_handles.begin; }
+
+void grow_handles (void) {
+  size_t count    = gc_handles.current - gc_handles.begin;
+  size_t capacity = gc_handles.end - gc_handles.begin;
+  capacity        = capacity ? capacity * 2 : HANDLE_REGION_INIT_SIZE;
+  void ***begin   = realloc(gc_handles.begin, capacity * sizeof(void **));
+  if (begin == NULL) {
+    perror("ERROR: grow_handles: realloc failed\n");
     exit(1);
   }
+  gc_handles.begin   = begin;
+  gc_handles.current = begin + count;
+  gc_handles.end     = begin + capacity;
+}
+
+void push_extra_root (void **p) {
   assert(p >= (void **)__gc_stack_top || p < (void **)__gc_stack_bottom);
-  extra_roots.roots[extra_roots.current_free] = p;
-  extra_roots.current_free++;
+  push_handle(p);
 }
 
 void pop_extra_root (void **p) {
-  if (extra_roots.current_free == 0) {
+  if (gc_handles.current == gc_handles.begin) {
     perror("ERROR: pop_extra_root: extra_roots are empty\n");
     exit(1);
   }
-  extra_roots.current_free--;
-  if (extra_roots.roots[extra_roots.current_free] != p) {
+  gc_handles.current--;
+  if (*gc_handles.current != p) {
     perror("ERROR: pop_extra_root: stack invariant violation\n");
     exit(1);
   }
 }
 
+/* Large objects */
+
+static inline size_t round_up_to_page (size_t bytes) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return (bytes + page - 1) / page * page;
+}
+
+static inline void *large_object_content (large_object *lo) {
+  return (char *)(lo + 1) + DATA_HEADER_SZ;
+}
+
+// returns position of the first descriptor whose content is not lower than p
+static size_t large_object_lower_bound (const size_t *p) {
+  size_t lo = 0, hi = large_objects.count;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if ((size_t)large_object_content(large_objects.index[mid]) < (size_t)p) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static void update_large_object_bounds (void) {
+  if (large_objects.count == 0) {
+    large_objects.lowest  = 0;
+    large_objects.highest = 0;
+    return;
+  }
+  large_objects.lowest  = (size_t)large_object_content(large_objects.index[0]);
+  large_objects.highest = (size_t)large_object_content(large_objects.index[large_objects.count - 1]);
+}
+
+// a GC cycle is forced when mapped large objects outgrow survivors of the previous cycle
+static void collect_large_objects_if_needed (size_t bytes) {
+  if (large_objects.allocated + bytes > MAX(large_objects.live, LARGE_OBJECTS_GC_THRESHOLD)) {
+    gc_alloc(0);
+  }
+}
+
+static void register_large_object (large_object *lo) {
+  if (large_objects.count == large_objects.capacity) {
+    large_objects.capacity = MAX(2 * large_objects.capacity, 16);
+    large_objects.index =
+        realloc(large_objects.index, large_objects.capacity * sizeof(large_object *));
+    if (large_objects.index == NULL) {
+      perror("ERROR: register_large_object: realloc failed\n");
+      exit(1);
+    }
+  }
+  size_t pos = large_object_lower_bound(large_object_content(lo));
+  memmove(&large_objects.index[pos + 1],
+          &large_objects.index[pos],
+          (large_objects.count - pos) * sizeof(large_object *));
+  large_objects.index[pos] = lo;
+  large_objects.count++;
+  large_objects.allocated += lo->size;
+  update_large_object_bounds();
+}
+
+bool is_large_object_pointer (const size_t *p) {
+  if (UNBOXED(p) || (size_t)p < large_objects.lowest || (size_t)p > large_objects.highest) {
+    return false;
+  }
+  size_t pos = large_object_lower_bound(p);
+  return pos < large_objects.count && large_object_content(large_objects.index[pos]) == p;
+}
+
+void *alloc_large_object (size_t bytes) {
+  size_t size = round_up_to_page(sizeof(large_object) + bytes);
+
+  collect_large_objects_if_needed(size);
+
+  large_object *lo = mmap(
+      NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (lo == MAP_FAILED) {
+    perror("ERROR: alloc_large_object: mmap failed\n");
+    exit(1);
+  }
+#ifdef DEBUG_VERSION
+  ++cur_id;
+#endif
+  lo->mapping = lo;
+  lo->size    = size;
+  register_large_object(lo);
+  return lo + 1;
+}
+
+void *alloc_file_string (int fd, size_t len) {
+  if (len > (INT_MAX >> 3)) { return NULL; }
+
+  // the header occupies the end of the first page, so that the contents start on a page boundary
+  // and can be mapped from the file directly; the rest of the last page (or the extra page if the
+  // file fills the last one completely) is zero-filled and serves as the terminating '\0'
+  size_t prefix = round_up_to_page(sizeof(large_object) + DATA_HEADER_SZ);
+  size_t size   = prefix + round_up_to_page(len + 1);
+
+  collect_large_objects_if_needed(size);
+
+  char *mapping = mmap(
+      NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (mapping == MAP_FAILED) { return NULL; }
+  // private mapping makes string updates copy-on-write, the file itself is never modified
+  if (len > 0
+      && mmap(mapping + prefix, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0)
+             == MAP_FAILED) {
+    munmap(mapping, size);
+    return NULL;
+  }
+
+  data         *obj = (data *)(mapping + prefix - DATA_HEADER_SZ);
+  large_object *lo  = (large_object *)obj - 1;
+  lo->mapping       = mapping;
+  lo->size          = size;
+  obj->data_header  = STRING_TAG | (len << 3);
+#ifdef DEBUG_VERSION
+  obj->id = ++cur_id;
+#endif
+  obj->forward_address = 0;
+  register_large_object(lo);
+  return obj;
+}
+
+void trace_large_objects (void) {
+  while (large_objects.gray) {
+    large_object *lo   = large_objects.gray;
+    large_objects.gray = lo->next_gray;
+    for (obj_field_iterator it = ptr_field_begin_iterator(lo + 1); !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      // heap marking is not in progress here, so it is safe to start it over
+      mark(*(void **)it.cur_field);
+    }
+  }
+}
+
+void update_large_object_references (memory_chunk *old_heap) {
+  for (size_t i = 0; i < large_objects.count; ++i) {
+    large_object *lo = large_objects.index[i];
+    if (!is_marked(large_object_content(lo)) || get_type_header_ptr(lo + 1) == STRING) {
+      continue;
+    }
+    obj_field_iterator it = field_begin_iterator(lo + 1);
+    scan_and_fix_region(old_heap, it.cur_field, get_end_of_obj(lo + 1));
+  }
+}
+
+void sweep_large_objects (void) {
+  size_t alive       = 0;
+  large_objects.live = 0;
+  for (size_t i = 0; i < large_objects.count; ++i) {
+    large_object *lo      = large_objects.index[i];
+    void         *content = large_object_content(lo);
+    if (is_marked(content)) {
+      unmark_object(content);
+      large_objects.index[alive++] = lo;
+      large_objects.live += lo->size;
+    } else {
+      munmap(lo->mapping, lo->size);
+    }
+  }
+  large_objects.count     = alive;
+  large_objects.allocated = 0;
+  update_large_object_bounds();
+}
+
+/* Immortal objects */
+
+void *alloc_immortal_string (int len) {
+  size_t bytes = (string_size(len) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+  if (immortal_chunks == NULL || immortal_chunks->current + bytes > immortal_chunks->end) {
+    size_t          size  = MAX(IMMORTAL_CHUNK_SIZE, round_up_to_page(sizeof(immortal_chunk) + bytes));
+    immortal_chunk *chunk = mmap(
+        NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (chunk == MAP_FAILED) {
+      perror("ERROR: alloc_immortal_string: mmap failed\n");
+      exit(1);
+    }
+    chunk->next     = immortal_chunks;
+    chunk->size     = size;
+    chunk->current  = (char *)(chunk + 1);
+    chunk->end      = (char *)chunk + size;
+    immortal_chunks = chunk;
+  }
+  data *obj = (data *)immortal_chunks->current;
+  immortal_chunks->current += bytes;
+  obj->data_header = STRING_TAG | (len << 3);
+#ifdef DEBUG_VERSION
+  obj->id = ++cur_id;
+  ++immortal_objects;
+#endif
+  return obj;
+}
+
+bool is_immortal_pointer (const size_t *p) {
+  if (UNBOXED(p)) { return false; }
+  for (immortal_chunk *chunk = immortal_chunks; chunk; chunk = chunk->next) {
+    if ((char *)(chunk + 1) < (char *)p && (char *)p < chunk->current) { return true; }
+  }
+  return false;
+}
+
+/* Scoped region */
+
+void *alloc_scoped_sexp (int members) {
+  if (scoped.begin == NULL) {
+    scoped.begin = mmap(NULL,
+                        SCOPED_REGION_SIZE,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT,
+                        -1,
+                        0);
+    if (scoped.begin == MAP_FAILED) {
+      perror("ERROR: alloc_scoped_sexp: mmap failed\n");
+      exit(1);
+    }
+    scoped.current = scoped.begin;
+    scoped.end     = scoped.begin + SCOPED_REGION_SIZE;
+  }
+  size_t bytes = sexp_size(members);
+  if (scoped.current + bytes > scoped.end) { return NULL; }
+  sexp *obj = (sexp *)scoped.current;
+  scoped.current += bytes;
+  memset(obj, 0, bytes);
+  obj->data_header = SEXP_TAG | (members << 3);
+#ifdef DEBUG_VERSION
+  obj->id = ++cur_id;
+#endif
+  return obj;
+}
+
+// marks are offsets since the region is mapped lazily
+size_t scoped_region_mark (void) { return scoped.current - scoped.begin; }
+
+void scoped_region_release (size_t mark) { scoped.current = scoped.begin + mark; }
+
+bool is_scoped_pointer (const size_t *p) {
+  return !UNBOXED(p) && (size_t)scoped.begin < (size_t)p && (size_t)p < (size_t)scoped.current;
+}
+
+void scan_scoped_region (void) {
+  for (char *header = scoped.begin; header < scoped.current; header = get_end_of_obj(header)) {
+    for (obj_field_iterator it = ptr_field_begin_iterator(header); !field_is_done_iterator(&it);
+         obj_next_ptr_field_iterator(&it)) {
+      mark(*(void **)it.cur_field);
+    }
+  }
+}
+
+void update_scoped_region_references (memory_chunk *old_heap) {
+  for (char *header = scoped.begin; header < scoped.current; header = get_end_of_obj(header)) {
+    obj_field_iterator it = field_begin_iterator(header);
+    scan_and_fix_region(old_heap, it.cur_field, get_end_of_obj(header));
+  }
+}
+
+void gc_set_root_cards (size_t *begin, size_t *end, unsigned char *cards) {
+  root_cards.begin = begin;
+  root_cards.end   = end;
+  root_cards.cards = cards;
+}
+
+void gc_set_stack_scanner (gc_stack_scanner scanner) { stack_scanner = scanner; }
+
+/* Context switching */
+
+void gc_context_save (gc_context *ctx) {
+  ctx->heap            = heap;
+  ctx->handles         = gc_handles;
+  ctx->large_objects   = large_objects;
+  ctx->immortal_chunks = immortal_chunks;
+  ctx->scoped          = scoped;
+  ctx->root_cards      = root_cards;
+  ctx->stack_scanner   = stack_scanner;
+  ctx->gc_cycles       = gc_cycles;
+  ctx->gc_stack_top    = __gc_stack_top;
+  ctx->gc_stack_bottom = __gc_stack_bottom;
+  ctx->snapshot_prefix = snapshot_prefix;
+#ifdef DEBUG_VERSION
+  ctx->cur_id           = cur_id;
+  ctx->immortal_objects = immortal_objects;
+#endif
+}
+
+void gc_context_restore (const gc_context *ctx) {
+  heap              = ctx->heap;
+  gc_handles        = ctx->handles;
+  large_objects     = ctx->large_objects;
+  immortal_chunks   = ctx->immortal_chunks;
+  scoped            = ctx->scoped;
+  root_cards        = ctx->root_cards;
+  stack_scanner     = ctx->stack_scanner;
+  gc_cycles         = ctx->gc_cycles;
+  __gc_stack_top    = ctx->gc_stack_top;
+  __gc_stack_bottom = ctx->gc_stack_bottom;
+  snapshot_prefix   = ctx->snapshot_prefix;
+#ifdef DEBUG_VERSION
+  cur_id           = ctx->cur_id;
+  immortal_objects = ctx->immortal_objects;
+#endif
+}
+
+size_t gc_cycles_number (void) { return gc_cycles; }
+
+/* Heap snapshots */
+
+// requests are shared by all threads, the first one to run a GC cycle takes it
+static int    snapshot_requested;
+static size_t snapshots_written;
+
+typedef struct {
+  int    fd;
+  size_t used;
+  bool   failed;
+  char  *buffer;
+} snapshot_writer;
+
+static void snapshot_flush (snapshot_writer *w) {
+  for (size_t done = 0; done < w->used && !w->failed;) {
+    ssize_t n = write(w->fd, w->buffer + done, w->used - done);
+    if (n >= 0) {
+      done += n;
+    } else if (errno != EINTR) {
+      w->failed = true;
+    }
+  }
+  w->used = 0;
+}
+
+// records are written by small pieces, each one fits into the buffer
+static void snapshot_put (snapshot_writer *w, const void *bytes, size_t n) {
+  if (w->used + n > HEAP_SNAPSHOT_BUFFER_SIZE) { snapshot_flush(w); }
+  memcpy(w->buffer + w->used, bytes, n);
+  w->used += n;
+}
+
+static inline void snapshot_put_byte (snapshot_writer *w, unsigned char value) {
+  snapshot_put(w, &value, sizeof(value));
+}
+
+static inline void snapshot_put_u32 (snapshot_writer *w, uint32_t value) {
+  snapshot_put(w, &value, sizeof(value));
+}
+
+static inline void snapshot_put_word (snapshot_writer *w, size_t value) {
+  snapshot_put(w, &value, sizeof(value));
+}
+
+static inline bool is_snapshot_object (const size_t *p) {
+  return is_valid_heap_pointer(p) || is_large_object_pointer(p) || is_scoped_pointer(p);
+}
+
+static void snapshot_object (snapshot_writer *w, void *header_ptr, heap_snapshot_space space) {
+  void     *content = get_object_content_ptr(header_ptr);
+  lama_type type    = get_type_header_ptr(header_ptr);
+  uint32_t  refs    = 0;
+  for (obj_field_iterator it = ptr_field_begin_iterator(header_ptr); !field_is_done_iterator(&it);
+       obj_next_ptr_field_iterator(&it)) {
+    refs += is_snapshot_object(*(size_t **)it.cur_field);
+  }
+
+  snapshot_put_byte(w, SNAPSHOT_OBJECT);
+  snapshot_put_byte(w, type);
+  snapshot_put_byte(w, space);
+  snapshot_put_word(w, (size_t)content);
+  snapshot_put_u32(w, obj_size_header_ptr(header_ptr));
+  snapshot_put_u32(w, type == SEXP ? TO_SEXP(content)->tag : 0);
+  snapshot_put_u32(w, refs);
+  for (obj_field_iterator it = ptr_field_begin_iterator(header_ptr); !field_is_done_iterator(&it);
+       obj_next_ptr_field_iterator(&it)) {
+    size_t *field_value = *(size_t **)it.cur_field;
+    if (is_snapshot_object(field_value)) { snapshot_put_word(w, (size_t)field_value); }
+  }
+}
+
+static void snapshot_root (snapshot_writer *w, heap_snapshot_root kind, size_t slot, size_t value) {
+  if (!is_snapshot_object((size_t *)value)) { return; }
+  snapshot_put_byte(w, SNAPSHOT_ROOT);
+  snapshot_put_byte(w, kind);
+  snapshot_put_u32(w, slot);
+  snapshot_put_word(w, value);
+}
+
+// slots are numbered from the stack bottom
+static void snapshot_stack_slot (size_t *slot, void *w) {
+  snapshot_root(w, ROOT_STACK, (size_t *)__gc_stack_bottom - slot - 1, *slot);
+}
+
+int gc_heap_snapshot (int fd) {
+  snapshot_writer w = {.fd = fd, .used = 0, .failed = false, .buffer = malloc(HEAP_SNAPSHOT_BUFFER_SIZE)};
+  if (w.buffer == NULL) { return -1; }
+
+  snapshot_put(&w, HEAP_SNAPSHOT_MAGIC, strlen(HEAP_SNAPSHOT_MAGIC));
+  snapshot_put_u32(&w, HEAP_SNAPSHOT_VERSION);
+  snapshot_put_u32(&w, sizeof(size_t));
+
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
+       heap_next_obj_iterator(&it)) {
+    snapshot_object(&w, it.current, SNAPSHOT_HEAP);
+  }
+  for (size_t i = 0; i < large_objects.count; ++i) {
+    snapshot_object(&w, large_objects.index[i] + 1, SNAPSHOT_LARGE);
+  }
+  for (char *header = scoped.begin; header < scoped.current; header = get_end_of_obj(header)) {
+    snapshot_object(&w, header, SNAPSHOT_SCOPED);
+  }
+
+  // the same roots as the ones of mark_phase
+  if (stack_scanner != NULL) {
+    stack_scanner(snapshot_stack_slot, &w);
+    for (size_t *p = root_cards.begin; p < root_cards.end; ++p) { snapshot_stack_slot(p, &w); }
+  } else {
+    for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+      snapshot_stack_slot(p, &w);
+    }
+  }
+  for (void ***h = gc_handles.begin; h < gc_handles.current; ++h) {
+    snapshot_root(&w, ROOT_EXTRA, h - gc_handles.begin, *(size_t *)*h);
+  }
+#ifdef LAMA_ENV
+  for (size_t *p = (size_t *)&__start_custom_data; p < (size_t *)&__stop_custom_data; ++p) {
+    snapshot_root(&w, ROOT_GLOBAL, p - (size_t *)&__start_custom_data, *p);
+  }
+#endif
+  size_t scoped_objects = 0;
+  for (char *header = scoped.begin; header < scoped.current; header = get_end_of_obj(header)) {
+    snapshot_root(&w, ROOT_SCOPED, scoped_objects++, (size_t)get_object_content_ptr(header));
+  }
+
+  snapshot_put_byte(&w, SNAPSHOT_END);
+  snapshot_flush(&w);
+  free(w.buffer);
+  return w.failed ? -1 : 0;
+}
+
+void gc_request_heap_snapshot (void) { __atomic_store_n(&snapshot_requested, 1, __ATOMIC_RELAXED); }
+
+void gc_set_snapshot_prefix (const char *prefix) { snapshot_prefix = prefix; }
+
+// a failed snapshot is reported, but does not stop the program
+static void write_requested_snapshot (void) {
+  if (snapshot_prefix == NULL || !__atomic_exchange_n(&snapshot_requested, 0, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+  char name[PATH_MAX];
+  snprintf(name,
+           sizeof(name),
+           "%s.%d.%zu.heap",
+           snapshot_prefix,
+           (int)getpid(),
+           __atomic_fetch_add(&snapshots_written, 1, __ATOMIC_RELAXED));
+  int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || gc_heap_snapshot(fd) != 0) { perror("ERROR: heap snapshot failed"); }
+  if (fd >= 0) { close(fd); }
+}
+
 /* Functions for tests */
 
 #if defined(DEBUG_VERSION)
@@ -634,6 +1242,10 @@ size_t objects_snapshot (int *object_ids_buf, size_t object_ids_buf_size) {
   }
   return i;
 }
+
+size_t large_objects_number (void) { return large_objects.count; }
+
+size_t immortal_objects_number (void) { return immortal_objects; }
 #endif
 
 #ifdef DEBUG_VERSION
@@ -663,11 +1275,6 @@ void set_stack (size_t stack_top, size_t stack_bottom) {
   __gc_stack_bottom = stack_bottom;
 }
 
-void set_extra_roots (size_t extra_roots_size, void **extra_roots_ptr) {
-  memcpy(extra_roots.roots, extra_roots_ptr, MIN(sizeof(extra_roots.roots), extra_roots_size));
-  clear_extra_roots();
-}
-
 #endif
 
 /* Utility functions */
@@ -867,8 +1474,12 @@ size_t get_header_size (lama_type type) {
   }
 }
 
+static inline void *alloc_object (size_t bytes) {
+  return bytes < LARGE_OBJECT_THRESHOLD ? alloc(bytes) : alloc_large_object(bytes);
+}
+
 void *alloc_string (int len) {
-  data *obj        = alloc(string_size(len));
+  data *obj        = alloc_object(string_size(len));
   obj->data_header = STRING_TAG | (len << 3);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "%p, [STRING] tag=%zu\n", obj, TAG(obj->data_header));
@@ -881,7 +1492,7 @@ void *alloc_string (int len) {
 }
 
 void *alloc_array (int len) {
-  data *obj        = alloc(array_size(len));
+  data *obj        = alloc_object(array_size(len));
   obj->data_header = ARRAY_TAG | (len << 3);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "%p, [ARRAY] tag=%zu\n", obj, TAG(obj->data_header));
@@ -894,7 +1505,7 @@ void *alloc_array (int len) {
 }
 
 void *alloc_sexp (int members) {
-  sexp *obj        = alloc(sexp_size(members));
+  sexp *obj        = alloc_object(sexp_size(members));
   obj->data_header = SEXP_TAG | (members << 3);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "%p, SEXP tag=%zu\n", obj, TAG(obj->data_header));
@@ -909,7 +1520,7 @@ void *alloc_sexp (int members) {
 
 void *alloc_closure (int captured) {
 
-  data *obj        = alloc(closure_size(captured));
+  data *obj        = alloc_object(closure_size(captured));
   obj->data_header = CLOSURE_TAG | (captured << 3);
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "%p, [CLOSURE] tag=%zu\n", obj, TAG(obj->data_header));
@@ -42,6 +42,15 @@
 #else
 #  define MINIMUM_HEAP_CAPACITY (1 << 2)
 #endif
+// objects of at least this size (in bytes, header included) are allocated in the large object space
+// number of bytes which may be mapped for large objects before a GC cycle is forced
+#ifdef DEBUG_VERSION
+#  define LARGE_OBJECT_THRESHOLD (1 << 10)
+#  define LARGE_OBJECTS_GC_THRESHOLD (1 << 16)
+#else
+#  define LARGE_OBJECT_THRESHOLD (1 << 14)
+#  define LARGE_OBJECTS_GC_THRESHOLD (1 << 24)
+#endif
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -79,7 +88,7 @@ void *gc_alloc_on_existing_heap(size_t);
 void mark (void *obj);
 void mark_phase (void);
 // marks each pointer from extra roots
-void scan_extra_roots (void);
+void scan_handles (void);
 #ifdef LAMA_ENV
 // marks each valid pointer from global area
 void scan_global_area (void);
@@ -93,26 +102,255 @@ void   physically_relocate (memory_chunk *);
 
 
 // ============================================================================
-//                            GC extra roots
+//                            GC large objects
+// ============================================================================
+// Big objects (at least LARGE_OBJECT_THRESHOLD bytes) and contents of files
+// mapped by `Lfread` live outside of the compacted heap, each one in its own
+// page-aligned mapping. Such an object is preceded by a `large_object`
+// descriptor and then by an ordinary data header, so runtime functions treat
+// it as a regular Lama value. Large objects are marked like any other object,
+// but never relocated: dead ones are unmapped after compaction, live ones keep
+// their addresses forever, so GC pauses do not depend on their total size.
+// Since marking of the heap can not be interrupted (its queue lives in headers
+// of heap objects), marked large objects with pointer fields are put into a
+// separate gray list which is traced after all roots.
+typedef struct large_object {
+  void                *mapping;   // beginning of the mapping the object lives in
+  size_t               size;      // size of the mapping in bytes
+  struct large_object *next_gray;
+} large_object;
+
+typedef struct {
+  large_object **index;   // descriptors sorted by address, used to recognize pointers
+  size_t         count;
+  size_t         capacity;
+  size_t         lowest;      // content address of the first large object
+  size_t         highest;     // content address of the last large object
+  size_t         allocated;   // bytes mapped since the last GC cycle
+  size_t         live;        // bytes survived the last GC cycle
+  large_object  *gray;        // marked objects whose fields are not traced yet
+} large_object_space;
+
+// allocates zero-filled object of the given size (in bytes, header included) in a separate mapping,
+// returns pointer to the object header
+void *alloc_large_object (size_t bytes);
+// maps `len` bytes of an opened file as a string which is never moved by GC,
+// returns pointer to the object header or NULL if the file can not be mapped
+void *alloc_file_string (int fd, size_t len);
+// returns whether p points to the content of a large object
+bool  is_large_object_pointer (const size_t *p);
+// marks everything reachable from the gray large objects
+void  trace_large_objects (void);
+// fixes pointers from alive large objects to relocated heap objects
+void  update_large_object_references (memory_chunk *old_heap);
+// unmaps unmarked large objects and unmarks alive ones
+void  sweep_large_objects (void);
+
+
+// ============================================================================
+//                            GC immortal objects
+// ============================================================================
+// Immortal objects are never collected, moved or traced, thus they must not
+// hold pointers to other objects. They are bump-allocated in chunks released
+// only by `__shutdown`. The interpreter uses them to materialize string
+// literals once instead of copying them into the heap on each execution.
+#define IMMORTAL_CHUNK_SIZE (1 << 16)
+
+typedef struct immortal_chunk {
+  struct immortal_chunk *next;
+  size_t                 size;      // size of the mapping in bytes
+  char                  *current;   // first free byte
+  char                  *end;
+} immortal_chunk;
+
+// allocates zero-filled immortal string of the given length, returns pointer to the object header
+void *alloc_immortal_string (int len);
+// returns whether p points into an immortal object
+bool  is_immortal_pointer (const size_t *p);
+
+
+// ============================================================================
+//                            GC scoped region
+// ============================================================================
+// Objects which provably do not outlive the function activation that created
+// them (see escape analysis in the interpreter) are allocated in a LIFO region
+// instead of the heap. The interpreter remembers the region top on each call
+// and releases everything above it when the activation ends. Region objects
+// are never marked or moved, but their fields are precise roots for the heap.
+// Nothing but the stack and other region objects may point into the region.
+#ifdef DEBUG_VERSION
+#  define SCOPED_REGION_SIZE (1 << 12)
+#else
+#  define SCOPED_REGION_SIZE (1 << 20)
+#endif
+
+typedef struct {
+  char *begin;
+  char *current;
+  char *end;
+} scoped_region;
+
+// allocates s-expression in the scoped region, returns pointer to the object header or NULL if the region is full
+void  *alloc_scoped_sexp (int members);
+// returns current top of the scoped region
+size_t scoped_region_mark (void);
+// releases all objects allocated in the scoped region after the given mark
+void   scoped_region_release (size_t mark);
+// returns whether p points into the scoped region
+bool   is_scoped_pointer (const size_t *p);
+void   scan_scoped_region (void);
+void   update_scoped_region_references (memory_chunk *old_heap);
+
+
+// ============================================================================
+//                            GC handle scopes
 // ============================================================================
 // Lama's program stack is continuous, i.e. it never interleaves with runtime
 // function's activation records. But some valid Lama's pointers can escape
-// into runtime. Those values (theirs stack addresses) has to be registered in
-// an auxiliary data structure called `extra_roots_pool`.
-// extra_roots_pool is a simple LIFO stack. During `pop` it compares that pop's
-// argument is equal to the current stack top.
-#define MAX_EXTRA_ROOTS_NUMBER 32
+// into runtime. Those values (theirs stack addresses) has to be registered as
+// handles. Handles are bump-allocated in a contiguous region, which grows on
+// demand. A scope is the saved region top: a runtime function opens a scope,
+// registers its handles and closes the scope, dropping them all at once.
+// GC scans and fixes the region as a whole.
+#define HANDLE_REGION_INIT_SIZE 64
 
 typedef struct {
-  int    current_free;
-  void **roots[MAX_EXTRA_ROOTS_NUMBER];
-} extra_roots_pool;
+  void ***begin;
+  void ***current;
+  void ***end;
+} handle_region;
+
+// scopes are offsets since the region moves when it grows
+typedef size_t handle_scope;
+
+extern THREAD_LOCAL handle_region gc_handles;
+
+void clear_handles (void);
+void grow_handles (void);
+
+static inline handle_scope open_handle_scope (void) {
+  return gc_handles.current - gc_handles.begin;
+}
+
+static inline void close_handle_scope (handle_scope scope) {
+  gc_handles.current = gc_handles.begin + scope;
+}
 
-void clear_extra_roots (void);
+static inline void push_handle (void **p) {
+  if (gc_handles.current == gc_handles.end) { grow_handles(); }
+  *gc_handles.current++ = p;
+}
+
+// checked LIFO variant: `pop` compares that its argument is the last handle
 void push_extra_root (void **p);
 void pop_extra_root (void **p);
 
 
+// ============================================================================
+//                            GC root cards
+// ============================================================================
+// A range of stack slots which are not a stack (e.g. the global area an
+// embedder keeps at the bottom of its stack) may be split into cards of
+// ROOT_CARD_WORDS slots, each with a byte telling whether the card may hold a
+// pointer. Marking and fixing of references skip clean cards; marking cleans
+// cards holding no pointers to heap or large objects. The mutator has to mark
+// the card of a slot before storing into it. Objects are moved by each cycle,
+// so a card holding a pointer is never cleaned: only slots without pointers
+// (e.g. tables of integers) are skipped.
+#define ROOT_CARD_SHIFT 5
+#define ROOT_CARD_WORDS (1 << ROOT_CARD_SHIFT)
+
+typedef struct {
+  size_t        *begin;   // slots [begin, end) are within the stack
+  size_t        *end;
+  unsigned char *cards;   // card of slot p is (p - begin) >> ROOT_CARD_SHIFT, non-zero if dirty
+} root_card_table;
+
+// sets the carded range of slots, NULL cards scan the whole stack
+void gc_set_root_cards (size_t *begin, size_t *end, unsigned char *cards);
+
+
+// ============================================================================
+//                            GC stack scanner
+// ============================================================================
+// By default each word of the stack is a possible root filtered by
+// is_valid_heap_pointer, so stale words and integers that look like pointers
+// retain garbage. An embedder which knows the layout of its frames may install
+// a scanner which visits only the slots that may hold pointers. It has to visit
+// all of them outside of the root card range (cards are scanned by GC itself),
+// and the same slots each time it is called during one cycle.
+typedef void (*gc_slot_visitor) (size_t *slot, void *context);
+typedef void (*gc_stack_scanner) (gc_slot_visitor visit, void *context);
+
+// NULL scans the whole stack
+void gc_set_stack_scanner (gc_stack_scanner scanner);
+
+
+// ============================================================================
+//                            GC heap snapshots
+// ============================================================================
+// A snapshot is the object graph written in a compact binary format, read by
+// `tools/heapstat`. All words are in the native byte order:
+//   header: HEAP_SNAPSHOT_MAGIC (8 bytes), u32 version, u32 size of a pointer
+//   object: 'O', u8 lama_type, u8 space, pointer to the content (object id),
+//           u32 size in bytes (header included), u32 tag hash of s-expression
+//           (0 for other types), u32 number of references, references
+//   root:   'R', u8 root kind, u32 slot, object id
+//   end:    'E'
+// Objects are the ones of the heap (dead ones included, as a snapshot is taken
+// between GC cycles), large objects and the scoped region. Immortal objects
+// have no fields and are never collected, so references to them are omitted.
+// Stack slots are counted from the bottom of the stack.
+#define HEAP_SNAPSHOT_MAGIC "LAMAHEAP"
+#define HEAP_SNAPSHOT_VERSION 1
+#define HEAP_SNAPSHOT_BUFFER_SIZE (1 << 16)
+
+typedef enum { SNAPSHOT_OBJECT = 'O', SNAPSHOT_ROOT = 'R', SNAPSHOT_END = 'E' } heap_snapshot_record;
+typedef enum { SNAPSHOT_HEAP, SNAPSHOT_LARGE, SNAPSHOT_SCOPED } heap_snapshot_space;
+typedef enum { ROOT_STACK, ROOT_EXTRA, ROOT_GLOBAL, ROOT_SCOPED } heap_snapshot_root;
+
+// writes a snapshot through a buffer into an opened file, returns 0 or -1 if writing failed (errno is set)
+int  gc_heap_snapshot (int fd);
+// makes the next GC cycle of a thread with a snapshot prefix write a snapshot into
+// `<prefix>.<pid>.<number>.heap`; async-signal-safe, so it may be called from a signal handler
+void gc_request_heap_snapshot (void);
+// sets the prefix of requested snapshots for the current program, NULL (the default) ignores requests
+void gc_set_snapshot_prefix (const char *prefix);
+
+
+// ============================================================================
+//                            GC context
+// ============================================================================
+// Everything GC knows about one program: its heap, special spaces, roots and
+// stack bounds. Embedders which run several independent programs in one
+// process keep a context per program and switch between them, i.e. save the
+// context of the program being suspended and restore the one being resumed.
+// A zero-filled context is the state before `__init`.
+typedef struct {
+  memory_chunk       heap;
+  handle_region      handles;
+  large_object_space large_objects;
+  immortal_chunk    *immortal_chunks;
+  scoped_region      scoped;
+  root_card_table    root_cards;
+  gc_stack_scanner   stack_scanner;
+  size_t             gc_cycles;
+  size_t             gc_stack_top;
+  size_t             gc_stack_bottom;
+  const char        *snapshot_prefix;
+#ifdef DEBUG_VERSION
+  size_t cur_id;
+  size_t immortal_objects;
+#endif
+} gc_context;
+
+void gc_context_save (gc_context *ctx);
+void gc_context_restore (const gc_context *ctx);
+
+// returns number of GC cycles run since the last `__init` (heap growth included)
+size_t gc_cycles_number (void);
+
+
 // ============================================================================
 //                   Implemented in GASM: see gc_runtime.s
 // ============================================================================
@@ -121,7 +359,8 @@ void pop_extra_root (void **p);
 void __gc_init (void);
 
 // should be called before interaction with GC in case of using in tests with
-// virtual stack, otherwise it is automatically invoked by `__gc_init`
+// virtual stack, otherwise it is automatically invoked by `__gc_init`;
+// the SIGSEGV handler of the runtime is installed by the first call in the process only
 void __init (void);
 
 // mostly useful for tests but basically you want to call this in case you want
@@ -134,6 +373,8 @@ extern void __shutdown (void);
 // ============================================================================
 extern void        gc_test_and_mark_root (size_t **root);
 bool               is_valid_heap_pointer (const size_t *);
+// returns whether p points to the content of any object managed by GC (either movable, large, immortal or scoped)
+bool               is_valid_lama_pointer (const size_t *);
 static inline bool is_valid_pointer (const size_t *);
 
 
@@ -146,15 +387,18 @@ static inline bool is_valid_pointer (const size_t *);
 // object_ids_buf is pointer to area preallocated by user for dumping ids of objects in heap
 // object_ids_buf_size is in WORDS, NOT BYTES
 size_t objects_snapshot (int *object_ids_buf, size_t object_ids_buf_size);
+
+// returns number of large objects which are currently mapped
+size_t large_objects_number (void);
+
+// returns number of immortal objects allocated since the last `__init`
+size_t immortal_objects_number (void);
 #endif
 
 
 #ifdef DEBUG_VERSION
 // essential function to mock program stack
 void set_stack (size_t stack_top, size_t stack_bottom);
-
-// function to mock extra roots (Lama specific)
-void set_extra_roots (size_t extra_roots_size, void **extra_roots_ptr);
 #endif
 
 
@@ -1,7 +0,0 @@
-#include "../gc.h"
-
-#include <stddef.h>
-
-int main () {
-  for (size_t i = 0; i < MAX_EXTRA_ROOTS_NUMBER + 1; ++i) { push_extra_root(NULL); }
-}
\ No newline at end of file
@@ -7,7 +7,7 @@
 #include "gc.h"
 #include "runtime_common.h"
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern THREAD_LOCAL size_t __gc_stack_top, __gc_stack_bottom;
 
 #define PRE_GC()                                                                                   \
   bool flag = false;                                                                               \
@@ -59,9 +59,9 @@ void Lassert (void *f, char *s, ...) {
 extern void *Bsexp (int n, ...);
 extern int   LtagHash (char *);
 
-void *global_sysargs;
-void *global_stdout;
-void *global_stderr;
+THREAD_LOCAL void *global_sysargs;
+THREAD_LOCAL void *global_stdout;
+THREAD_LOCAL void *global_stderr;
 
 // Gets a raw data_header
 extern int LkindOf (void *p) {
@@ -95,11 +95,11 @@ void *Ls__Infix_58 (void *p, void *q) {
 
   // PRE_GC();
 
-  push_extra_root(&p);
-  push_extra_root(&q);
+  handle_scope scope = open_handle_scope();
+  push_handle(&p);
+  push_handle(&q);
   res = Bsexp(BOX(3), p, q, LtagHash("cons"));   //BOX(848787));
-  pop_extra_root(&q);
-  pop_extra_root(&p);
+  close_handle_scope(scope);
 
   // POST_GC();
 
@@ -241,7 +241,7 @@ extern int LtagHash (char *s) {
 }
 
 char *de_hash (int n) {
-  static char buf[6] = {0, 0, 0, 0, 0, 0};
+  static THREAD_LOCAL char buf[6] = {0, 0, 0, 0, 0, 0};
   char       *p      = (char *)BOX(NULL);
   p                  = &buf[5];
 
@@ -261,7 +261,7 @@ typedef struct {
   int   len;
 } StringBuf;
 
-static StringBuf stringBuf;
+static THREAD_LOCAL StringBuf stringBuf;
 
 #define STRINGBUF_INIT 128
 
@@ -317,7 +317,7 @@ static void printValue (void *p) {
   if (UNBOXED(p)) {
     printStringBuf("%d", UNBOX(p));
   } else {
-    if (!is_valid_heap_pointer(p)) {
+    if (!is_valid_lama_pointer(p)) {
       printStringBuf("0x%x", p);
       return;
     }
@@ -453,9 +453,10 @@ extern void *Lsubstring (void *subj, int p, int l) {
 
     // PRE_GC();
 
-    push_extra_root(&subj);
+    handle_scope scope = open_handle_scope();
+    push_handle(&subj);
     r = (data *)alloc_string(ll);
-    pop_extra_root(&subj);
+    close_handle_scope(scope);
 
     strncpy(r->contents, (char *)subj + pp, ll);
 
@@ -515,7 +516,8 @@ void *Lclone (void *p) {
   data *a = TO_DATA(p);
   int   t = TAG(a->data_header), l = LEN(a->data_header);
 
-  push_extra_root(&p);
+  handle_scope scope = open_handle_scope();
+  push_handle(&p);
   switch (t) {
     case STRING_TAG: res = Bstring(TO_DATA(p)->contents); break;
 
@@ -538,7 +540,7 @@ void *Lclone (void *p) {
 
     default: failure("invalid data_header %d in clone *****\n", t);
   }
-  pop_extra_root(&p);
+  close_handle_scope(scope);
 
   // POST_GC();
   return res;
@@ -552,7 +554,7 @@ int inner_hash (int depth, unsigned acc, void *p) {
   if (depth > HASH_DEPTH) return acc;
 
   if (UNBOXED(p)) return HASH_APPEND(acc, UNBOX(p));
-  else if (is_valid_heap_pointer(p)) {
+  else if (is_valid_lama_pointer(p)) {
     data *a = TO_DATA(p);
     int   t = TAG(a->data_header), l = LEN(a->data_header), i;
 
@@ -626,8 +628,8 @@ extern int Lcompare (void *p, void *q) {
     else return BOX(-1);
   } else if (UNBOXED(q)) return BOX(1);
   else {
-    if (is_valid_heap_pointer(p)) {
-      if (is_valid_heap_pointer(q)) {
+    if (is_valid_lama_pointer(p)) {
+      if (is_valid_lama_pointer(q)) {
         data *a = TO_DATA(p), *b = TO_DATA(q);
         int   ta = TAG(a->data_header), tb = TAG(b->data_header);
         int   la = LEN(a->data_header), lb = LEN(b->data_header);
@@ -668,7 +670,7 @@ extern int Lcompare (void *p, void *q) {
         }
         return BOX(0);
       } else return BOX(-1);
-    } else if (is_valid_heap_pointer(q)) return BOX(1);
+    } else if (is_valid_lama_pointer(q)) return BOX(1);
     else return BOX(p - q);
   }
 }
@@ -729,9 +731,10 @@ extern void *Bstring (void *p) {
 
   // PRE_GC();
 
-  push_extra_root(&p);
+  handle_scope scope = open_handle_scope();
+  push_handle(&p);
   s = LmakeString(BOX(n));
-  pop_extra_root(&p);
+  close_handle_scope(scope);
   strncpy((char *)&TO_DATA(s)->contents, p, n + 1);   // +1 because of '\0' in the end of C-strings
 
   // POST_GC();
@@ -749,9 +752,10 @@ extern void *Lstringcat (void *p) {
   createStringBuf();
   stringcat(p);
 
-  push_extra_root(&p);
+  handle_scope scope = open_handle_scope();
+  push_handle(&p);
   s = Bstring(stringBuf.contents);
-  pop_extra_root(&p);
+  close_handle_scope(scope);
 
   deleteStringBuf();
 
@@ -768,9 +772,10 @@ extern void *Lstring (void *p) {
   createStringBuf();
   printValue(p);
 
-  push_extra_root(&p);
+  handle_scope scope = open_handle_scope();
+  push_handle(&p);
   s = Bstring(stringBuf.contents);
-  pop_extra_root(&p);
+  close_handle_scope(scope);
 
   deleteStringBuf();
 
@@ -789,11 +794,12 @@ extern void *Bclosure (int bn, void *entry, ...) {
 
   // PRE_GC();
 
-  argss = (ebp + 12);
-  for (i = 0; i < n; i++, argss++) { push_extra_root((void **)argss); }
+  handle_scope scope = open_handle_scope();
+  argss              = (ebp + 12);
+  for (i = 0; i < n; i++, argss++) { push_handle((void **)argss); }
 
   r = (data *)alloc_closure(n + 1);
-  push_extra_root((void **)&r);
+  push_handle((void **)&r);
   ((void **)r->contents)[0] = entry;
 
   va_start(args, entry);
@@ -807,9 +813,7 @@ extern void *Bclosure (int bn, void *entry, ...) {
 
   // POST_GC();
 
-  pop_extra_root((void **)&r);
-  argss--;
-  for (i = 0; i < n; i++, argss--) { pop_extra_root((void **)argss); }
+  close_handle_scope(scope);
   return r->contents;
 }
 
@@ -1022,11 +1026,11 @@ extern void * /*Lstrcat*/ Li__Infix_4343 (void *a, void *b) {
 
   // PRE_GC();
 
-  push_extra_root(&a);
-  push_extra_root(&b);
+  handle_scope scope = open_handle_scope();
+  push_handle(&a);
+  push_handle(&b);
   d = alloc_string(LEN(da->data_header) + LEN(db->data_header));
-  pop_extra_root(&b);
-  pop_extra_root(&a);
+  close_handle_scope(scope);
 
   da = TO_DATA(a);
   db = TO_DATA(b);
@@ -1055,9 +1059,10 @@ extern void *Lsprintf (char *fmt, ...) {
 
   // PRE_GC();
 
-  push_extra_root((void **)&fmt);
+  handle_scope scope = open_handle_scope();
+  push_handle((void **)&fmt);
   s = Bstring(stringBuf.contents);
-  pop_extra_root((void **)&fmt);
+  close_handle_scope(scope);
 
   // POST_GC();
 
@@ -1145,10 +1150,28 @@ extern void *LreadLine () {
 }
 
 extern void *Lfread (char *fname) {
-  FILE *f;
+  FILE       *f;
+  struct stat st;
 
   ASSERT_STRING("fread", fname);
 
+  // alloc_file_string may collect before it gives up, fname is used afterwards
+  handle_scope scope = open_handle_scope();
+  push_handle((void **)&fname);
+
+  // regular files are mapped outside of the heap, so they are neither copied nor moved by GC
+  int fd = open(fname, O_RDONLY);
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    data *d = alloc_file_string(fd, st.st_size);
+    close(fd);
+    if (d) {
+      close_handle_scope(scope);
+      return d->contents;
+    }
+  } else if (fd >= 0) {
+    close(fd);
+  }
+
   f = fopen(fname, "r");
 
   if (f && fseek(f, 0l, SEEK_END) >= 0) {
@@ -1159,6 +1182,7 @@ extern void *Lfread (char *fname) {
 
     if (fread(s, 1, size, f) == size) {
       fclose(f);
+      close_handle_scope(scope);
       return s;
     }
   }
@@ -1254,17 +1278,19 @@ extern void set_args (int argc, char *argv[]) {
 
   // PRE_GC();
 
-  p = LmakeArray(BOX(n));
-  push_extra_root((void **)&p);
+  p                  = LmakeArray(BOX(n));
+  handle_scope scope = open_handle_scope();
+  push_handle((void **)&p);
 
   for (i = 0; i < n; i++) { ((int *)p)[i] = (int)Bstring(argv[i]); }
 
-  pop_extra_root((void **)&p);
+  close_handle_scope(scope);
   // POST_GC();
 
   global_sysargs = p;
   global_stdout  = stdout;
   global_stderr  = stderr;
 
-  push_extra_root((void **)&global_sysargs);
+  // stays registered for the whole run
+  push_handle((void **)&global_sysargs);
 }
@@ -25,6 +25,9 @@
 
 #define MEMBER_SIZE sizeof(int)
 
+// GC and runtime state is kept per thread, so independent programs may run in parallel threads
+#define THREAD_LOCAL __thread
+
 #define TO_DATA(x) ((data *)((char *)(x)-DATA_HEADER_SZ))
 #define TO_SEXP(x) ((sexp *)((char *)(x)-DATA_HEADER_SZ))
 
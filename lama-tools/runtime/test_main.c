@@ -2,6 +2,7 @@
 #include "runtime_common.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,8 +16,10 @@ extern void *Bsexp (int n, ...);
 extern void *Barray (int bn, ...);
 extern void *Bstring (void *);
 extern void *Bclosure (int bn, void *entry, ...);
+extern void *Lfread (char *fname);
+extern void *LmakeArray (int length);
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern THREAD_LOCAL size_t __gc_stack_top, __gc_stack_bottom;
 
 void test_correct_structure_sizes (void) {
   // something like induction base
@@ -193,7 +196,304 @@ void test_small_tree_compaction (void) {
   cleanup_test(st);
 }
 
-extern size_t cur_id;
+void test_file_string_is_not_relocated (void) {
+  virt_stack *st       = init_test();
+  const char *fname    = "test_file_string.txt";
+  const char *contents = "contents of a mapped file";
+
+  FILE *f = fopen(fname, "w");
+  fputs(contents, f);
+  fclose(f);
+
+  // garbage in front of alive objects makes compaction move them
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "aaaaaaaaaaaaaaaaaaaaaa");
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, fname));
+  size_t s = call_runtime_function(vstack_top(st) - 4, Lfread, 1, vstack_kth_from_start(st, 0));
+  vstack_push(st, s);
+
+  force_gc_cycle(st);
+  assert((vstack_kth_from_start(st, 1) == s));
+  assert((strcmp((char *)s, contents) == 0));
+  assert((large_objects_number() == 1));
+
+  // file contents are not copied into the heap
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 1));
+
+  vstack_pop(st);
+  force_gc_cycle(st);
+  assert((large_objects_number() == 0));
+
+  remove(fname);
+  cleanup_test(st);
+}
+
+void test_large_array_is_not_relocated (void) {
+  virt_stack *st  = init_test();
+  const int   len = LARGE_OBJECT_THRESHOLD / sizeof(size_t);
+
+  size_t arr = call_runtime_function(vstack_top(st) - 4, LmakeArray, 1, BOX(len));
+  vstack_push(st, arr);
+  assert((large_objects_number() == 1));
+
+  // garbage in front of the string makes compaction move it, the string is reachable only from the array
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "aaaaaaaaaaaaaaaaaaaaaa");
+  size_t str = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "small");
+  ((size_t *)arr)[len - 1] = str;
+
+  force_gc_cycle(st);
+  assert((vstack_kth_from_start(st, 0) == arr));
+  assert((large_objects_number() == 1));
+  assert((((size_t *)arr)[0] == BOX(0)));
+  assert((((size_t *)arr)[len - 1] != str));
+  assert((strcmp((char *)((size_t *)arr)[len - 1], "small") == 0));
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 1));
+
+  vstack_pop(st);
+  force_gc_cycle(st);
+  assert((large_objects_number() == 0));
+  alive = objects_snapshot(ids, N);
+  assert((alive == 0));
+
+  cleanup_test(st);
+}
+
+void test_immortal_string_is_not_collected (void) {
+  virt_stack *st  = init_test();
+  data       *obj = alloc_immortal_string(7);
+  strcpy(obj->contents, "literal");
+  size_t s = (size_t)obj->contents;
+  vstack_push(st, s);
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+
+  assert((is_valid_lama_pointer((size_t *)s)));
+  force_gc_cycle(st);
+  assert((vstack_kth_from_start(st, 0) == s));
+  assert((strcmp((char *)s, "literal") == 0));
+  assert((immortal_objects_number() == 1));
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 0));
+
+  vstack_pop(st);
+  force_gc_cycle(st);
+  assert((strcmp((char *)s, "literal") == 0));
+
+  cleanup_test(st);
+}
+
+void test_scoped_sexp_fields_are_roots (void) {
+  virt_stack *st   = init_test();
+  size_t      mark = scoped_region_mark();
+
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  size_t str = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "field");
+  sexp  *obj = alloc_scoped_sexp(2);
+  assert((obj != NULL));
+  ((size_t *)obj->contents)[0] = str;
+  ((size_t *)obj->contents)[1] = BOX(1);
+  size_t value = (size_t)((data *)obj)->contents;
+  vstack_push(st, value);
+
+  force_gc_cycle(st);
+  assert((vstack_kth_from_start(st, 0) == value));
+  assert((((size_t *)obj->contents)[0] != str));
+  assert((strcmp((char *)((size_t *)obj->contents)[0], "field") == 0));
+  assert((((size_t *)obj->contents)[1] == BOX(1)));
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 1));
+
+  vstack_pop(st);
+  scoped_region_release(mark);
+  assert((!is_scoped_pointer((size_t *)value)));
+  force_gc_cycle(st);
+  alive = objects_snapshot(ids, N);
+  assert((alive == 0));
+
+  cleanup_test(st);
+}
+
+void test_gc_context_switch (void) {
+  gc_context  first, second;
+  virt_stack *st1 = init_test();
+  vstack_push(st1, call_runtime_function(vstack_top(st1) - 4, Bstring, 1, "first"));
+  gc_context_save(&first);
+
+  virt_stack *st2 = init_test();
+  call_runtime_function(vstack_top(st2) - 4, Bstring, 1, "garbage");
+  vstack_push(st2, call_runtime_function(vstack_top(st2) - 4, Bstring, 1, "second"));
+  gc_context_save(&second);
+
+  // collection in one context does not touch objects of another one
+  gc_context_restore(&first);
+  size_t cycles = gc_cycles_number();
+  force_gc_cycle(st1);
+  assert((gc_cycles_number() == cycles + 1));
+  assert((strcmp((char *)vstack_kth_from_start(st1, 0), "first") == 0));
+
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 1));
+  cleanup_test(st1);
+
+  gc_context_restore(&second);
+  assert((gc_cycles_number() == second.gc_cycles));
+  assert((objects_snapshot(ids, N) == 2));
+  force_gc_cycle(st2);
+  assert((objects_snapshot(ids, N) == 1));
+  assert((strcmp((char *)vstack_kth_from_start(st2, 0), "second") == 0));
+  cleanup_test(st2);
+}
+
+void test_root_cards (void) {
+  virt_stack   *st     = init_test();
+  size_t       *bottom = (size_t *)__gc_stack_bottom;
+  unsigned char cards[2] = {1, 1};
+  gc_set_root_cards(bottom - 2 * ROOT_CARD_WORDS, bottom, cards);
+
+  // the card of the deepest slots holds unboxed values only, the other one a string
+  for (int i = 0; i < 2 * ROOT_CARD_WORDS - 1; ++i) { vstack_push(st, BOX(i)); }
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  size_t str = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "carded");
+  vstack_push(st, str);
+
+  force_gc_cycle(st);
+  assert((cards[0] == 1 && cards[1] == 0));
+  assert((vstack_kth_from_start(st, 2 * ROOT_CARD_WORDS - 1) != str));
+  assert((strcmp((char *)vstack_kth_from_start(st, 2 * ROOT_CARD_WORDS - 1), "carded") == 0));
+  for (int i = 0; i < 2 * ROOT_CARD_WORDS - 1; ++i) { assert((vstack_kth_from_start(st, i) == BOX(i))); }
+
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 1));
+
+  gc_set_root_cards(NULL, NULL, NULL);
+  cleanup_test(st);
+}
+
+void test_handle_scopes (void) {
+  virt_stack *st = init_test();
+
+  // more handles than the initial region holds, so it grows while they are pushed
+  const int    N = 3 * HANDLE_REGION_INIT_SIZE;
+  void        *strings[N];
+  handle_scope scope = open_handle_scope();
+  for (int i = 0; i < N; ++i) {
+    strings[i] = (void *)call_runtime_function(vstack_top(st) - 4, Bstring, 1, "handle");
+    push_handle(&strings[i]);
+  }
+
+  force_gc_cycle(st);
+  for (int i = 0; i < N; ++i) { assert((strcmp((char *)strings[i], "handle") == 0)); }
+  int ids[N];
+  assert((objects_snapshot(ids, N) == N));
+
+  close_handle_scope(scope);
+  force_gc_cycle(st);
+  assert((objects_snapshot(ids, N) == 0));
+
+  cleanup_test(st);
+}
+
+static size_t scanned_value;
+
+// visits only the slot holding `scanned_value`
+static void scan_one_slot (gc_slot_visitor visit, void *context) {
+  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
+    if (*p == scanned_value) { visit(p, context); }
+  }
+}
+
+void test_stack_scanner (void) {
+  virt_stack *st = init_test();
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "not scanned"));
+  scanned_value = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "scanned");
+  vstack_push(st, scanned_value);
+
+  gc_set_stack_scanner(scan_one_slot);
+  force_gc_cycle(st);
+  assert((vstack_kth_from_start(st, 1) != scanned_value));
+  assert((strcmp((char *)vstack_kth_from_start(st, 1), "scanned") == 0));
+
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 1));
+
+  cleanup_test(st);
+}
+
+void test_heap_snapshot (void) {
+  virt_stack *st = init_test();
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "left-s"));
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "right-s"));
+  vstack_push(st,
+              call_runtime_function(vstack_top(st) - 4,
+                                    Bsexp,
+                                    4,
+                                    BOX(3),
+                                    vstack_kth_from_start(st, 0),
+                                    vstack_kth_from_start(st, 1),
+                                    LtagHash("tree")));
+  size_t tree = vstack_kth_from_start(st, 2);
+
+  FILE *f        = tmpfile();
+  __gc_stack_top = (size_t)vstack_top(st) - 4;
+  assert((gc_heap_snapshot(fileno(f)) == 0));
+  __gc_stack_top = 0;
+  rewind(f);
+
+  char     magic[8];
+  uint32_t version, word;
+  assert((fread(magic, 1, sizeof(magic), f) == sizeof(magic)));
+  assert((memcmp(magic, HEAP_SNAPSHOT_MAGIC, sizeof(magic)) == 0));
+  assert((fread(&version, sizeof(version), 1, f) == 1 && version == HEAP_SNAPSHOT_VERSION));
+  assert((fread(&word, sizeof(word), 1, f) == 1 && word == sizeof(size_t)));
+
+  // dead objects are in the snapshot too, but only live ones are referenced from roots
+  int objects = 0, roots = 0;
+  for (int record; (record = fgetc(f)) != SNAPSHOT_END;) {
+    size_t   id;
+    uint32_t slot, size, tag, refs;
+    if (record == SNAPSHOT_ROOT) {
+      assert((fgetc(f) == ROOT_STACK));
+      assert((fread(&slot, sizeof(slot), 1, f) == 1 && fread(&id, sizeof(id), 1, f) == 1));
+      assert((slot < vstack_size(st)));
+      ++roots;
+      continue;
+    }
+    assert((record == SNAPSHOT_OBJECT));
+    int type = fgetc(f);
+    assert((fgetc(f) == SNAPSHOT_HEAP));
+    assert((fread(&id, sizeof(id), 1, f) == 1 && fread(&size, sizeof(size), 1, f) == 1));
+    assert((fread(&tag, sizeof(tag), 1, f) == 1 && fread(&refs, sizeof(refs), 1, f) == 1));
+    if (id == tree) {
+      assert((type == SEXP && size == sexp_size(2) && tag == UNBOX(LtagHash("tree")) && refs == 2));
+    } else {
+      assert((type == STRING && refs == 0));
+    }
+    for (uint32_t i = 0; i < refs; ++i) { assert((fread(&id, sizeof(id), 1, f) == 1)); }
+    ++objects;
+  }
+  assert((objects == 4 && roots == 3));
+
+  fclose(f);
+  cleanup_test(st);
+}
+
+extern THREAD_LOCAL size_t cur_id;
 
 size_t generate_random_obj_forest (virt_stack *st, int cnt, int seed) {
   srand(seed);
@@ -262,6 +562,15 @@ int main (int argc, char **argv) {
   test_garbage_is_reclaimed();
   test_alive_are_not_reclaimed();
   test_small_tree_compaction();
+  test_file_string_is_not_relocated();
+  test_large_array_is_not_relocated();
+  test_immortal_string_is_not_collected();
+  test_scoped_sexp_fields_are_roots();
+  test_gc_context_switch();
+  test_root_cards();
+  test_handle_scopes();
+  test_stack_scanner();
+  test_heap_snapshot();
 
   time_t start, end;
   double diff;
@@ -0,0 +1,146 @@
+#include "bytefile.h"
+#include "cfg.h"
+#include "error.h"
+#include "functors/c_emit.h"
+#include "functors/default.h"
+#include "inst_reader.h"
+#include "verify.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string.h>
+#include <vector>
+
+/*
+ * Translates verified bytecode into C. Each function becomes a C function
+ * `f_<offset>(argc, is_closure)` with a label for each jump target;
+ * the result is compiled against bc2c_runtime.h and linked with runtime.a.
+ */
+
+namespace {
+
+struct CommandLine {
+    const char *input = nullptr;
+    const char *output = nullptr;
+};
+
+CommandLine parse_command_line(int argc, const char *argv[]) {
+    CommandLine cl;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            ASSERT(i + 1 < argc, 1, "-o expects a file name");
+            cl.output = argv[++i];
+        } else if (argv[i][0] == '-') {
+            FAIL(1, "Unknown option %s", argv[i]);
+        } else {
+            ASSERT(cl.input == nullptr, 1, "Only one input file is expected");
+            cl.input = argv[i];
+        }
+    }
+    ASSERT(cl.input != nullptr, 1, "Usage: %s <file.bc> [-o <file.c>]", argv[0]);
+    return cl;
+}
+
+/* Instructions of a function run up to its first End, as the verifier finds them */
+void translate_function(CEmitContext *ctx, const std::vector<bool> &reachable,
+                        const std::vector<bool> &jump, const std::vector<bool> &label, std::ostream &out) {
+    const bytefile *file = ctx->file;
+    InstReader reader(file);
+    out << "static void " << c_function_name(ctx->function - file->code_ptr) << "(int argc, int is_closure) {\n";
+    bool after_jump = false;
+    for (const char *ip = ctx->function;;) {
+        size_t offset = ip - file->code_ptr;
+        const char *next = reader.read_inst<DefaultFunctor>(ip);
+        if (reachable[offset]) {
+            // labels skip targets next to their jumps, which are still targets of `goto`;
+            // a function is only entered by calls, which go to its Begin
+            if ((label[offset] || after_jump) && ip != ctx->function) {
+                out << c_label_name(offset) << ":;\n";
+            }
+            reader.read_inst<CEmitFunctor, std::ostream &, CEmitContext *>(ip, out, ctx);
+        }
+        if (*ip == Opcode_End) {
+            break;
+        }
+        after_jump = jump[offset];
+        ip = next;
+    }
+    out << "}\n\n";
+}
+
+void translate(const char *file_name, const bytefile *file, std::ostream &out) {
+    VerificationInfo info = verify_reachable_instructions(file, get_entrypoints(file));
+    std::vector<bool> reachable = mark_reachable_instructions(file, get_entrypoints(file));
+    std::vector<bool> jump, label;
+    mark_jumps(file, &jump, &label);
+
+    const char *main = nullptr;
+    for (int i = 0; i < file->public_symbols_number; i++) {
+        if (strcmp(get_public_name(file, i), "main") == 0) {
+            main = file->code_ptr + get_public_offset(file, i);
+        }
+    }
+    ASSERT(main != nullptr, 1, "main symbol not found in %s", file_name);
+
+    std::vector<const char *> functions = info.functions;
+    std::sort(functions.begin(), functions.end());
+
+    CEmitContext ctx{.file = file, .file_name = file_name, .function = nullptr, .tags = {}, .closures = {}};
+    std::ostringstream bodies;
+    for (const char *function : functions) {
+        ctx.function = function;
+        translate_function(&ctx, reachable, jump, label, bodies);
+    }
+
+    out << "/* Translated by bc2c from " << file_name << " */\n"
+        << "#include \"bc2c_runtime.h\"\n\n";
+
+    out << "static int tags[" << std::max<size_t>(ctx.tags.size(), 1) << "];\n\n";
+
+    for (const char *function : functions) {
+        out << "static void " << c_function_name(function - file->code_ptr) << "(int argc, int is_closure);\n";
+    }
+    out << "\n";
+
+    out << "static void call_closure(int argc) {\n"
+        << "    switch (*(int *)vstack_kth_from_end(argc)) {\n";
+    for (int entry : ctx.closures) {
+        out << "    case 0x" << std::hex << entry << std::dec << ":\n"
+            << "        " << c_function_name(entry) << "(argc, 1);\n"
+            << "        break;\n";
+    }
+    out << "    default:\n"
+        << "        failure(\"Unknown closure entry 0x%x\\n\", *(int *)vstack_kth_from_end(argc));\n"
+        << "    }\n"
+        << "}\n\n";
+
+    out << bodies.str();
+
+    out << "int main() {\n"
+        << "    __init();\n"
+        << "    vstack_init(" << file->global_area_size << ");\n";
+    for (const auto &[name, index] : ctx.tags) {
+        out << "    tags[" << index << "] = LtagHash(" << c_string_literal(name.c_str()) << ");\n";
+    }
+    out << "    " << c_function_name(main - file->code_ptr) << "(0, 0);\n"
+        << "    __shutdown();\n"
+        << "    return 0;\n"
+        << "}\n";
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+    CommandLine cl = parse_command_line(argc, argv);
+    const bytefile *file = read_file(cl.input);
+
+    if (cl.output == nullptr) {
+        translate(cl.input, file, std::cout);
+    } else {
+        std::ofstream out(cl.output);
+        ASSERT(out.is_open(), 1, "Cannot open %s", cl.output);
+        translate(cl.input, file, out);
+    }
+}
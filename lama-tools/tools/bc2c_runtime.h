@@ -0,0 +1,198 @@
+#ifndef BC2C_RUNTIME_H
+#define BC2C_RUNTIME_H
+
+/*
+ * Support code for C translated from bytecode by bc2c, linked with runtime.a.
+ * Values live on the virtual stack scanned by the GC. Frames of bc2c have no header,
+ * unlike those of the interpreter: locals follow the arguments right away,
+ *
+ *     globals | A(0) ... A(n-1) | L(0) ... L(m-1) | operands
+ *
+ * with the closure being called right above A(0). Each function keeps pointers to its
+ * frame as C locals, the C stack keeps return addresses.
+ */
+
+#include "../runtime/gc.h"
+#include "../runtime/runtime_common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+extern THREAD_LOCAL size_t *__gc_stack_top;
+extern THREAD_LOCAL size_t *__gc_stack_bottom;
+
+extern void failure(char *s, ...);
+
+extern int Lread();
+extern int Lwrite(int n);
+extern int Llength(void *p);
+extern void *Lstring(void *p);
+
+extern int Ls__Infix_43(void *p, void *q);
+extern int Ls__Infix_45(void *p, void *q);
+extern int Ls__Infix_42(void *p, void *q);
+extern int Ls__Infix_47(void *p, void *q);
+extern int Ls__Infix_37(void *p, void *q);
+extern int Ls__Infix_60(void *p, void *q);
+extern int Ls__Infix_6061(void *p, void *q);
+extern int Ls__Infix_62(void *p, void *q);
+extern int Ls__Infix_6261(void *p, void *q);
+extern int Ls__Infix_6161(void *p, void *q);
+extern int Ls__Infix_3361(void *p, void *q);
+extern int Ls__Infix_3838(void *p, void *q);
+extern int Ls__Infix_3333(void *p, void *q);
+
+extern void *Bstring(void *p);
+extern int LtagHash(char *s);
+extern void *Bsta(void *v, int i, void *x);
+extern void *Belem(void *p, int i);
+extern int Btag(void *d, int t, int n);
+extern int Barray_patt(void *d, int n);
+
+extern int Bstring_patt(void *x, void *y);
+extern int Bclosure_tag_patt(void *x);
+extern int Bboxed_patt(void *x);
+extern int Bunboxed_patt(void *x);
+extern int Barray_tag_patt(void *x);
+extern int Bstring_tag_patt(void *x);
+extern int Bsexp_tag_patt(void *x);
+
+extern void Bmatch_failure(void *v, char *fname, int line, int col);
+
+extern void __init();
+extern void __shutdown();
+
+/* Reserved lazily, overflow runs into the guard page below */
+#define VSTACK_SIZE (64 << 20)
+
+static size_t vstack_globals_count;
+
+static inline void vstack_init(size_t globals_count) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    char *mapping = (char *)mmap(NULL, page + VSTACK_SIZE, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED || mprotect(mapping, page, PROT_NONE) != 0) {
+        failure("Cannot reserve %d bytes for virtual stack\n", VSTACK_SIZE);
+    }
+    // the collector looks one word past the bottom, it has to stay in the mapping
+    __gc_stack_bottom = (size_t *)(mapping + page + VSTACK_SIZE) - 1;
+    __gc_stack_top = __gc_stack_bottom - 1 - globals_count;
+    vstack_globals_count = globals_count;
+}
+
+static inline void vstack_push(size_t value) {
+    *(__gc_stack_top--) = value;
+}
+
+static inline size_t vstack_pop() {
+    return *(++__gc_stack_top);
+}
+
+static inline size_t vstack_top() {
+    return *(__gc_stack_top + 1);
+}
+
+static inline size_t vstack_kth_from_end(size_t index) {
+    return *(__gc_stack_top + 1 + index);
+}
+
+typedef struct {
+    size_t *args;   /* A(0) */
+    size_t *locals; /* L(0) */
+    int is_closure;
+} Frame;
+
+/* Locations of the current `frame` */
+#define G(i) (__gc_stack_bottom[-1 - (i)])
+#define L(i) (frame.locals[-(i)])
+#define A(i) (frame.args[-(i)])
+#define C(i) ((*(size_t **)(frame.args + 1))[1 + (i)])
+
+/* Takes `argc` arguments (and the closure) on top of the stack */
+static inline void frame_call(Frame *frame, int argc, int is_closure) {
+    frame->args = __gc_stack_top + argc;
+    frame->is_closure = is_closure;
+}
+
+/* Locals are cleared, so the collector never sees stale values in them */
+static inline void frame_alloc(Frame *frame, int locc) {
+    frame->locals = __gc_stack_top;
+    for (int i = 0; i < locc; i++) {
+        vstack_push(BOX(0));
+    }
+}
+
+/* Replaces arguments of the current frame with `argc` values on top of the stack */
+static inline void frame_tail_call(Frame *frame, int argc) {
+    size_t *high = frame->args + frame->is_closure;
+    memmove(high - argc + 1, __gc_stack_top + 1, argc * sizeof(size_t));
+    __gc_stack_top = high - argc;
+    frame->args = high;
+    frame->is_closure = 0;
+}
+
+/* Leaves the return value in place of the arguments */
+static inline void frame_end(Frame *frame) {
+    size_t value = vstack_pop();
+    __gc_stack_top = frame->args + frame->is_closure;
+    vstack_push(value);
+}
+
+#define BINOP_INT(op)                                                               \
+    do {                                                                            \
+        size_t rhv = vstack_pop(), lhv = vstack_pop();                              \
+        vstack_push(BOX(UNBOX(lhv) op UNBOX(rhv)));                                 \
+    } while (0)
+
+/* Operands of other types are checked by the runtime implementations of infix operators */
+#define BINOP(op, helper)                                                           \
+    do {                                                                            \
+        size_t rhv = vstack_pop(), lhv = vstack_pop();                              \
+        if (UNBOXED(lhv & rhv)) {                                                   \
+            vstack_push(BOX(UNBOX(lhv) op UNBOX(rhv)));                             \
+        } else {                                                                    \
+            vstack_push(helper((void *)lhv, (void *)rhv));                          \
+        }                                                                           \
+    } while (0)
+
+static inline void *Barray(int n) {
+    data *r = (data *)alloc_array(n);
+    for (int i = n - 1; i >= 0; i--) {
+        ((int *)r->contents)[i] = vstack_pop();
+    }
+    return r->contents;
+}
+
+static inline void *BSexp(int n, int tag) {
+    data *r = (data *)alloc_sexp(n);
+    ((sexp *)r)->tag = 0;
+    for (int i = n; i > 0; i--) {
+        ((int *)r->contents)[i] = vstack_pop();
+    }
+    ((sexp *)r)->tag = tag;
+    return r->contents;
+}
+
+/* Captured values are stored by the caller right after the allocation */
+static inline size_t *Bclosure(int n, int entry) {
+    data *r = (data *)alloc_closure(n + 1);
+    ((int *)r->contents)[0] = entry;
+    return (size_t *)r->contents;
+}
+
+static inline void sta() {
+    void *v = (void *)vstack_pop();
+    int i = vstack_pop();
+    void *x = (void *)vstack_pop();
+    vstack_push((size_t)Bsta(v, i, x));
+}
+
+static inline void sti() {
+    size_t v = vstack_pop();
+    *(size_t *)vstack_pop() = v;
+    vstack_push(v);
+}
+
+#endif // BC2C_RUNTIME_H
@@ -1,17 +1,117 @@
 #include "bytefile.h"
+#include "error.h"
+#include "functors/default.h"
 #include "functors/print_inst.h"
 #include "inst_reader.h"
+#include "text_buffer.h"
 
-#include <iomanip>
-#include <iostream>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
 
-int main(int argc, const char *argv[]) {
-    const bytefile *file = read_file(argv[1]);
+/*
+ * Instructions are formatted into buffers written out at once. The code is split
+ * into chunks starting at functions, which are disassembled in parallel and
+ * printed in order, so the output is the same as of a sequential dump.
+ * `-j <n>` splits the code into up to `n` chunks however small they are,
+ * `-j 1` gives a sequential dump.
+ */
+
+namespace {
+
+struct CommandLine {
+    const char *input = nullptr;
+    size_t chunks_count = 0; /* 0 for a chunk per hardware thread */
+};
+
+CommandLine parse_command_line(int argc, const char *argv[]) {
+    CommandLine cl;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0) {
+            ASSERT(i + 1 < argc, 1, "-j expects a number of chunks");
+            int chunks_count = atoi(argv[++i]);
+            ASSERT(chunks_count > 0, 1, "-j expects a positive number, got %s", argv[i]);
+            cl.chunks_count = chunks_count;
+        } else if (argv[i][0] == '-') {
+            FAIL(1, "Unknown option %s", argv[i]);
+        } else {
+            ASSERT(cl.input == nullptr, 1, "Only one input file is expected");
+            cl.input = argv[i];
+        }
+    }
+    ASSERT(cl.input != nullptr, 1, "Usage: %s [-j <chunks>] <file.bc>", argv[0]);
+    return cl;
+}
+
+/* Chunks smaller than that are not worth a thread */
+constexpr size_t MIN_CHUNK_SIZE = 1 << 16;
+
+/* About the size of the text of an instruction */
+constexpr size_t CHARS_PER_CODE_BYTE = 6;
+
+/*
+ * Offsets where chunks start, the last one is the end of the code.
+ * Entrypoints and other functions start at Begin, so the boundaries are taken from
+ * Begin and CBegin found by a scan, which only decodes instruction lengths.
+ */
+std::vector<const char *> split_code(const bytefile *file, size_t chunks_count, size_t min_chunk_size) {
+    const char *code_begin = file->code_ptr;
+    const char *code_end = file->code_ptr + get_code_size(file);
+    size_t chunk_size = std::max(min_chunk_size, (size_t)(code_end - code_begin) / chunks_count + 1);
+
+    std::vector<const char *> bounds = {code_begin};
+    InstReader reader(file);
+    for (const char *ip = code_begin; ip < code_end; ip = reader.read_inst<DefaultFunctor>(ip)) {
+        if ((*ip == Opcode_Begin || *ip == Opcode_CBegin) && (size_t)(ip - bounds.back()) >= chunk_size) {
+            bounds.push_back(ip);
+        }
+    }
+    bounds.push_back(code_end);
+    return bounds;
+}
 
+void dump_chunk(const bytefile *file, const char *begin, const char *end, TextBuffer *out) {
     InstReader reader(file);
-    for (const char *ip = file->code_ptr; ip < file->code_ptr + get_code_size(file);) {
-        std::cout << "0x" << std::setw(8) << std::hex << ip - file->code_ptr << "\t" << std::dec;
-        ip = reader.read_inst<PrinterFunctor, std::ostream &>(ip, std::cout);
-        std::cout << std::endl;
+    for (const char *ip = begin; ip < end;) {
+        out->put("0x");
+        out->put_hex(ip - file->code_ptr, 8);
+        out->put('\t');
+        ip = reader.read_inst<PrinterFunctor, TextBuffer *>(ip, out);
+        out->put('\n');
+    }
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+    CommandLine cl = parse_command_line(argc, argv);
+    const bytefile *file = read_file(cl.input);
+
+    std::vector<const char *> bounds =
+        cl.chunks_count != 0 ? split_code(file, cl.chunks_count, 1)
+                             : split_code(file, std::max(1u, std::thread::hardware_concurrency()), MIN_CHUNK_SIZE);
+    size_t chunks_count = bounds.size() - 1;
+
+    std::vector<TextBuffer> buffers;
+    for (size_t i = 0; i < chunks_count; i++) {
+        buffers.emplace_back((bounds[i + 1] - bounds[i]) * CHARS_PER_CODE_BYTE);
+    }
+
+    if (chunks_count == 1) {
+        dump_chunk(file, bounds[0], bounds[1], &buffers[0]);
+    } else {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < chunks_count; i++) {
+            threads.emplace_back(dump_chunk, file, bounds[i], bounds[i + 1], &buffers[i]);
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+    }
+
+    for (const TextBuffer &buffer : buffers) {
+        buffer.write(stdout);
     }
 }
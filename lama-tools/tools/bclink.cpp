@@ -0,0 +1,58 @@
+#include "bytefile.h"
+#include "error.h"
+#include "link.h"
+#include "verify.h"
+
+#include <iostream>
+#include <string.h>
+#include <vector>
+
+/*
+ * Links units compiled separately into one file, see link_units.
+ * Each unit is verified on its own before linking and the result is verified again.
+ */
+
+namespace {
+
+struct CommandLine {
+    std::vector<const char *> inputs;
+    const char *output = nullptr;
+};
+
+CommandLine parse_command_line(int argc, const char *argv[]) {
+    CommandLine cl;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            ASSERT(i + 1 < argc, 1, "-o expects a file name");
+            cl.output = argv[++i];
+        } else if (argv[i][0] == '-') {
+            FAIL(1, "Unknown option %s", argv[i]);
+        } else {
+            cl.inputs.push_back(argv[i]);
+        }
+    }
+    ASSERT(!cl.inputs.empty() && cl.output != nullptr, 1, "Usage: %s <file.bc>... -o <file.bc>", argv[0]);
+    return cl;
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+    CommandLine cl = parse_command_line(argc, argv);
+
+    std::vector<const bytefile *> units;
+    for (const char *input : cl.inputs) {
+        const bytefile *unit = read_file(input);
+        verify_reachable_instructions(unit, get_entrypoints(unit));
+        units.push_back(unit);
+    }
+
+    const bytefile *linked = link_units(units);
+    verify_reachable_instructions(linked, get_entrypoints(linked));
+    write_file(cl.output, linked);
+
+    std::cerr << "Units: " << units.size() << std::endl;
+    std::cerr << "Code: " << get_code_size(linked) << " bytes" << std::endl;
+    std::cerr << "Strings: " << linked->stringtab_size << " bytes" << std::endl;
+    std::cerr << "Globals: " << linked->global_area_size << std::endl;
+}
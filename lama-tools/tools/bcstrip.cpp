@@ -0,0 +1,160 @@
+#include "bytefile.h"
+#include "cfg.h"
+#include "error.h"
+#include "functors/default.h"
+#include "inst_reader.h"
+#include "opcode.h"
+#include "string_table.h"
+#include "verify.h"
+
+#include <iostream>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Rewrites verified bytecode keeping only instructions reachable from public symbols:
+ * dead functions are removed with their End, live ones lose unreachable instructions.
+ * The string table keeps only strings still referenced. Code offsets of jumps, calls,
+ * closures and public symbols are relocated, and the result is verified again.
+ */
+
+namespace {
+
+struct CommandLine {
+    const char *input = nullptr;
+    const char *output = nullptr;
+};
+
+CommandLine parse_command_line(int argc, const char *argv[]) {
+    CommandLine cl;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0) {
+            ASSERT(i + 1 < argc, 1, "-o expects a file name");
+            cl.output = argv[++i];
+        } else if (argv[i][0] == '-') {
+            FAIL(1, "Unknown option %s", argv[i]);
+        } else {
+            ASSERT(cl.input == nullptr, 1, "Only one input file is expected");
+            cl.input = argv[i];
+        }
+    }
+    ASSERT(cl.input != nullptr && cl.output != nullptr, 1, "Usage: %s <file.bc> -o <file.bc>", argv[0]);
+    return cl;
+}
+
+/* Jmp, CJmpZ, CJmpNZ, Call and Closure have the referenced offset as the first operand */
+bool has_target(unsigned char opcode) {
+    return opcode == Opcode_Jmp || opcode == Opcode_CJmpZ || opcode == Opcode_CJmpNZ ||
+           opcode == Opcode_Call || opcode == Opcode_Closure;
+}
+
+/* String, SExp and Tag have the string as the first operand */
+bool has_string(unsigned char opcode) {
+    return opcode == Opcode_String || opcode == Opcode_SExp || opcode == Opcode_Tag;
+}
+
+int get_operand(const char *inst) {
+    int value;
+    memcpy(&value, inst + 1, sizeof(int));
+    return value;
+}
+
+void set_operand(char *inst, int value) {
+    memcpy(inst + 1, &value, sizeof(int));
+}
+
+/* Kept instructions, the End of a function is kept if its Begin is reachable */
+std::vector<bool> mark_kept_instructions(const bytefile *file, const std::vector<bool> &reachable) {
+    std::vector<bool> kept(reachable.size(), false);
+    InstReader reader(file);
+    const char *code_end = file->code_ptr + get_code_size(file);
+    bool live_function = false;
+    for (const char *ip = file->code_ptr; ip != code_end; ip = reader.read_inst<DefaultFunctor>(ip)) {
+        size_t offset = ip - file->code_ptr;
+        if (*ip == Opcode_Begin || *ip == Opcode_CBegin) {
+            live_function = reachable[offset];
+        }
+        // the verifier finds the end of a function by its first End
+        if (*ip == Opcode_End) {
+            kept[offset] = live_function;
+            live_function = false;
+        } else {
+            kept[offset] = reachable[offset];
+        }
+    }
+    return kept;
+}
+
+const bytefile *strip(const bytefile *file) {
+    auto entrypoints = get_entrypoints(file);
+    std::vector<bool> kept = mark_kept_instructions(file, mark_reachable_instructions(file, entrypoints));
+
+    InstReader reader(file);
+    const char *code_end = file->code_ptr + get_code_size(file);
+
+    std::unordered_map<int, int> offsets;
+    int size = 0;
+    for (const char *ip = file->code_ptr; ip != code_end;) {
+        const char *next = reader.read_inst<DefaultFunctor>(ip);
+        if (kept[ip - file->code_ptr]) {
+            offsets[ip - file->code_ptr] = size;
+            size += next - ip;
+        }
+        ip = next;
+    }
+
+    StringTable strings;
+    std::vector<int> publics;
+    for (int i = 0; i < file->public_symbols_number; i++) {
+        publics.push_back(strings.add(get_public_name(file, i)));
+        publics.push_back(offsets.at(get_public_offset(file, i)));
+    }
+
+    std::vector<char> code;
+    code.reserve(size);
+    for (const char *ip = file->code_ptr; ip != code_end;) {
+        const char *next = reader.read_inst<DefaultFunctor>(ip);
+        if (kept[ip - file->code_ptr]) {
+            size_t begin = code.size();
+            code.insert(code.end(), ip, next);
+            unsigned char opcode = *ip;
+            if (has_target(opcode)) {
+                // targets of reachable instructions are reachable themselves
+                set_operand(&code[begin], offsets.at(get_operand(ip)));
+            } else if (has_string(opcode)) {
+                set_operand(&code[begin], strings.add(get_string(file, get_operand(ip))));
+            }
+        }
+        ip = next;
+    }
+
+    return make_bytefile(file->global_area_size, publics, strings.strings, code);
+}
+
+int count_functions(const bytefile *file) {
+    InstReader reader(file);
+    const char *code_end = file->code_ptr + get_code_size(file);
+    int count = 0;
+    for (const char *ip = file->code_ptr; ip != code_end; ip = reader.read_inst<DefaultFunctor>(ip)) {
+        count += *ip == Opcode_Begin || *ip == Opcode_CBegin;
+    }
+    return count;
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+    CommandLine cl = parse_command_line(argc, argv);
+    const bytefile *file = read_file(cl.input);
+    verify_reachable_instructions(file, get_entrypoints(file));
+
+    const bytefile *stripped = strip(file);
+    // relocation keeps the code valid, but the output is checked as any other input
+    verify_reachable_instructions(stripped, get_entrypoints(stripped));
+    write_file(cl.output, stripped);
+
+    std::cerr << "Functions: " << count_functions(file) << " -> " << count_functions(stripped) << std::endl;
+    std::cerr << "Code: " << get_code_size(file) << " -> " << get_code_size(stripped) << " bytes" << std::endl;
+    std::cerr << "Strings: " << file->stringtab_size << " -> " << stripped->stringtab_size << " bytes" << std::endl;
+}
@@ -0,0 +1,261 @@
+#include "error.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <math.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Benchmark driver for the interpreter.
+ * Each bytecode file is run `--warmup` times unmeasured, then `--runs` times measured.
+ * `<name>.input` next to `<name>.bc` is fed to stdin if it exists, stdout is discarded.
+ * Counters are taken from the `--stats` output of the interpreter.
+ */
+
+namespace {
+
+struct CommandLine {
+    int runs = 10;
+    int warmup = 2;
+    double threshold = 5; /* Percents of median time considered a regression */
+    const char *json = nullptr;
+    const char *baseline = nullptr;
+    const char *interpreter = nullptr;
+    std::vector<const char *> files;
+};
+
+struct Run {
+    double wall_ms;
+    size_t instructions;
+    size_t gc_cycles;
+    long peak_rss_kb;
+};
+
+struct Result {
+    std::string name;
+    double median_ms;
+    double p95_ms;
+    size_t instructions;
+    double instructions_per_second;
+    size_t gc_cycles;
+    long peak_rss_kb;
+};
+
+CommandLine parse_command_line(int argc, const char *argv[]) {
+    CommandLine cl;
+    auto number = [&](int &i) {
+        ASSERT(i + 1 < argc, 1, "%s expects a number", argv[i]);
+        char *end;
+        double value = strtod(argv[++i], &end);
+        ASSERT(*end == '\0' && value >= 0, 1, "Invalid number %s", argv[i]);
+        return value;
+    };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--runs") == 0) {
+            cl.runs = (int)number(i);
+        } else if (strcmp(argv[i], "--warmup") == 0) {
+            cl.warmup = (int)number(i);
+        } else if (strcmp(argv[i], "--threshold") == 0) {
+            cl.threshold = number(i);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            ASSERT(i + 1 < argc, 1, "--json expects a file name");
+            cl.json = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0) {
+            ASSERT(i + 1 < argc, 1, "--baseline expects a file name");
+            cl.baseline = argv[++i];
+        } else if (argv[i][0] == '-') {
+            FAIL(1, "Unknown option %s", argv[i]);
+        } else if (cl.interpreter == nullptr) {
+            cl.interpreter = argv[i];
+        } else {
+            cl.files.push_back(argv[i]);
+        }
+    }
+    ASSERT(!cl.files.empty() && cl.runs > 0, 1,
+           "Usage: %s [--runs N] [--warmup N] [--json <file>] [--baseline <file>] [--threshold <percent>] <interpreter> <file.bc>...",
+           argv[0]);
+    return cl;
+}
+
+std::string benchmark_name(const std::string &file) {
+    size_t begin = file.find_last_of('/');
+    begin = begin == std::string::npos ? 0 : begin + 1;
+    size_t end = file.rfind(".bc");
+    return file.substr(begin, end == std::string::npos || end < begin ? std::string::npos : end - begin);
+}
+
+size_t read_counter(const std::string &output, const char *title) {
+    size_t pos = output.find(title);
+    ASSERT(pos != std::string::npos, 1, "No \"%s\" in the interpreter output", title);
+    return strtoull(output.c_str() + pos + strlen(title), nullptr, 10);
+}
+
+Run run_once(const CommandLine &cl, const char *file) {
+    std::string input = std::string(file, strlen(file) - (strlen(file) > 3 ? 3 : 0)) + ".input";
+
+    int err[2];
+    ASSERT(pipe(err) == 0, 1, "Cannot create a pipe");
+
+    auto begin = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    ASSERT(pid >= 0, 1, "Cannot fork");
+    if (pid == 0) {
+        int in = open(input.c_str(), O_RDONLY);
+        if (in < 0) {
+            in = open("/dev/null", O_RDONLY);
+        }
+        int out = open("/dev/null", O_WRONLY);
+        dup2(in, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(err[0]);
+        execl(cl.interpreter, cl.interpreter, "--stats", file, (char *)nullptr);
+        _exit(127);
+    }
+    close(err[1]);
+
+    std::string output;
+    char buf[4096];
+    for (ssize_t n; (n = read(err[0], buf, sizeof(buf))) > 0;) {
+        output.append(buf, n);
+    }
+    close(err[0]);
+
+    int status;
+    struct rusage usage;
+    ASSERT(wait4(pid, &status, 0, &usage) == pid, 1, "Cannot wait for the interpreter");
+    auto end = std::chrono::steady_clock::now();
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0, 1, "%s failed:\n%s", file, output.c_str());
+
+    return Run{
+        .wall_ms = std::chrono::duration<double, std::milli>(end - begin).count(),
+        .instructions = read_counter(output, "Instructions: "),
+        .gc_cycles = read_counter(output, "GC cycles: "),
+        .peak_rss_kb = usage.ru_maxrss,
+    };
+}
+
+Result measure(const CommandLine &cl, const char *file) {
+    for (int i = 0; i < cl.warmup; i++) {
+        run_once(cl, file);
+    }
+
+    std::vector<Run> runs;
+    for (int i = 0; i < cl.runs; i++) {
+        runs.push_back(run_once(cl, file));
+    }
+
+    std::vector<double> times;
+    long peak_rss_kb = 0;
+    for (const Run &run : runs) {
+        times.push_back(run.wall_ms);
+        peak_rss_kb = std::max(peak_rss_kb, run.peak_rss_kb);
+    }
+    std::sort(times.begin(), times.end());
+    size_t n = times.size();
+    double median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+    // nearest rank
+    double p95 = times[(size_t)ceil(0.95 * n) - 1];
+
+    // programs are deterministic, so counters are equal for all runs
+    return Result{
+        .name = benchmark_name(file),
+        .median_ms = median,
+        .p95_ms = p95,
+        .instructions = runs[0].instructions,
+        .instructions_per_second = runs[0].instructions / (median / 1000),
+        .gc_cycles = runs[0].gc_cycles,
+        .peak_rss_kb = peak_rss_kb,
+    };
+}
+
+/* Each benchmark is written on its own line, `read_baseline` relies on it */
+void write_json(const CommandLine &cl, const std::vector<Result> &results, std::ostream &out) {
+    out << "{\n  \"runs\": " << cl.runs << ",\n  \"warmup\": " << cl.warmup << ",\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        out << "    {\"name\": \"" << r.name << "\""
+            << ", \"median_ms\": " << r.median_ms
+            << ", \"p95_ms\": " << r.p95_ms
+            << ", \"instructions\": " << r.instructions
+            << ", \"instructions_per_second\": " << (size_t)r.instructions_per_second
+            << ", \"gc_cycles\": " << r.gc_cycles
+            << ", \"peak_rss_kb\": " << r.peak_rss_kb << "}"
+            << (i + 1 == results.size() ? "\n" : ",\n");
+    }
+    out << "  ]\n}\n";
+}
+
+/* Reads names and median times from a file written by `write_json` */
+std::vector<std::pair<std::string, double>> read_baseline(const char *file_name) {
+    std::ifstream in(file_name);
+    ASSERT(in, 1, "Cannot open baseline %s", file_name);
+
+    std::vector<std::pair<std::string, double>> baseline;
+    for (std::string line; std::getline(in, line);) {
+        static const std::string name_key = "\"name\": \"", median_key = "\"median_ms\": ";
+        size_t name = line.find(name_key);
+        size_t median = line.find(median_key);
+        if (name == std::string::npos || median == std::string::npos) {
+            continue;
+        }
+        name += name_key.size();
+        baseline.push_back({line.substr(name, line.find('"', name) - name),
+                            strtod(line.c_str() + median + median_key.size(), nullptr)});
+    }
+    return baseline;
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+    CommandLine cl = parse_command_line(argc, argv);
+
+    std::vector<std::pair<std::string, double>> baseline;
+    if (cl.baseline != nullptr) {
+        baseline = read_baseline(cl.baseline);
+    }
+
+    std::cout << std::left << std::setw(16) << "Benchmark" << std::right
+              << std::setw(12) << "median ms" << std::setw(12) << "p95 ms"
+              << std::setw(12) << "Minst/s" << std::setw(8) << "GC"
+              << std::setw(12) << "RSS KB" << (baseline.empty() ? "" : "    vs baseline") << std::endl;
+
+    std::vector<Result> results;
+    int regressions = 0;
+    for (const char *file : cl.files) {
+        const Result &r = results.emplace_back(measure(cl, file));
+        std::cout << std::left << std::setw(16) << r.name << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(12) << r.median_ms << std::setw(12) << r.p95_ms
+                  << std::setw(12) << r.instructions_per_second / 1e6 << std::setw(8) << r.gc_cycles
+                  << std::setw(12) << r.peak_rss_kb;
+
+        auto base = std::find_if(baseline.begin(), baseline.end(), [&](const auto &b) { return b.first == r.name; });
+        if (base != baseline.end()) {
+            double change = (r.median_ms / base->second - 1) * 100;
+            std::cout << std::setw(14) << std::showpos << change << "%" << std::noshowpos;
+            if (change > cl.threshold) {
+                std::cout << " REGRESSION";
+                regressions++;
+            }
+        }
+        std::cout << std::defaultfloat << std::endl;
+    }
+
+    if (cl.json != nullptr) {
+        std::ofstream out(cl.json);
+        ASSERT(out, 1, "Cannot write %s", cl.json);
+        write_json(cl, results, out);
+    }
+
+    return regressions == 0 ? 0 : 2;
+}
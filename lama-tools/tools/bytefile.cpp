@@ -1,37 +1,51 @@
 #include "bytefile.h"
 #include "error.h"
 
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 void *__start_custom_data;
 void *__stop_custom_data;
 
+/*
+ * The file is mapped read-only right after the unpacked header, which gets
+ * its own writable page, so the code is shared by all users of the file.
+ */
 bytefile *read_file(const char *fname) {
-    FILE *f = fopen(fname, "rb");
-    long size;
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
     bytefile *file;
 
-    if (f == 0) {
+    if (fd == -1) {
         FAIL(1, "%s\n", strerror(errno));
     }
 
-    if (fseek(f, 0, SEEK_END) == -1) {
+    if (fstat(fd, &st) == -1) {
         FAIL(1, "%s\n", strerror(errno));
     }
 
-    size_t total_size = sizeof(int) * 5 + (size = ftell(f));
-    file = (bytefile *)malloc(total_size);
-    file->size = total_size;
+    size_t size = st.st_size;
+    size_t header_size = offsetof(bytefile, stringtab_size);
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    ASSERT(size >= 3 * sizeof(int), 1, "File is too small");
 
-    if (file == 0) {
+    char *mapping = (char *)mmap(NULL, page + size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
         FAIL(1, "*** FAILURE: unable to allocate memory.\n");
     }
 
-    rewind(f);
-
-    if (size != fread(&file->stringtab_size, 1, size, f)) {
+    if (mmap(mapping + page, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
         FAIL(1, "%s\n", strerror(errno));
     }
 
-    fclose(f);
+    close(fd);
+
+    file = (bytefile *)(mapping + page - header_size);
+    file->size = header_size + size;
 
     ASSERT(file->stringtab_size >= 0, 1, "Negative string section size");
     ASSERT(file->public_symbols_number >= 0, 1, "Negative public symbols number");
@@ -50,6 +64,57 @@ bytefile *read_file(const char *fname) {
     return file;
 }
 
+bytefile *make_bytefile(const bytefile *base, const std::vector<int> &publics, const std::vector<char> &code) {
+    return make_bytefile(base->global_area_size, publics,
+                         std::vector<char>(base->string_ptr, base->string_ptr + base->stringtab_size), code);
+}
+
+bytefile *make_bytefile(int global_area_size, const std::vector<int> &publics, const std::vector<char> &strings,
+                        const std::vector<char> &code) {
+    size_t publics_size = publics.size() * sizeof(int);
+    size_t size = offsetof(bytefile, buffer) + publics_size + strings.size() + code.size();
+
+    bytefile *file = (bytefile *)malloc(size);
+    if (file == nullptr) {
+        FAIL(1, "*** FAILURE: unable to allocate memory.\n");
+    }
+
+    file->size = size;
+    file->stringtab_size = strings.size();
+    file->global_area_size = global_area_size;
+    file->public_symbols_number = publics.size() / 2;
+
+    file->public_ptr = (int *)file->buffer;
+    file->string_ptr = &file->buffer[publics_size];
+    file->code_ptr = &file->string_ptr[file->stringtab_size];
+    file->global_ptr = (int *)malloc(file->global_area_size * sizeof(int));
+
+    memcpy(file->public_ptr, publics.data(), publics_size);
+    memcpy(file->string_ptr, strings.data(), strings.size());
+    memcpy(file->code_ptr, code.data(), code.size());
+    return file;
+}
+
+bytefile *copy_bytefile(const bytefile *file) {
+    std::vector<int> publics(file->public_ptr, file->public_ptr + 2 * file->public_symbols_number);
+    return make_bytefile(file, publics, std::vector<char>(file->code_ptr, file->code_ptr + get_code_size(file)));
+}
+
+/* On disk the header starts with the string table size, sections follow right after it */
+void write_file(const char *fname, const bytefile *file) {
+    FILE *out = fopen(fname, "wb");
+    if (out == nullptr) {
+        FAIL(1, "%s\n", strerror(errno));
+    }
+
+    size_t header_size = offsetof(bytefile, stringtab_size);
+    const char *begin = (const char *)file + header_size;
+    size_t size = file->size - header_size;
+    if (fwrite(begin, 1, size, out) != size || fclose(out) != 0) {
+        FAIL(1, "Cannot write %s: %s\n", fname, strerror(errno));
+    }
+}
+
 const char *get_string(const bytefile *f, int pos) {
     ASSERT(pos >= 0, 1,
            "Negative string index %d",
@@ -24,6 +24,22 @@ typedef struct {
 /* Reads a binary bytecode file by name and unpacks it */
 bytefile *read_file(const char *fname);
 
+/*
+ * Builds an unpacked file in memory with the string table and globals of `base`,
+ * public symbols given as pairs of name and code offset, and code
+ */
+bytefile *make_bytefile(const bytefile *base, const std::vector<int> &publics, const std::vector<char> &code);
+
+/* The same with its own string table and size of the global area */
+bytefile *make_bytefile(int global_area_size, const std::vector<int> &publics, const std::vector<char> &strings,
+                        const std::vector<char> &code);
+
+/* Copies an unpacked file into memory of its own, which is writable */
+bytefile *copy_bytefile(const bytefile *file);
+
+/* Writes an unpacked file in the binary format read by `read_file` */
+void write_file(const char *fname, const bytefile *file);
+
 /* Gets a string from a string table by an index */
 const char *get_string(const bytefile *f, int pos);
 
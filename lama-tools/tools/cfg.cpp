@@ -0,0 +1,76 @@
+#include "cfg.h"
+#include "bytefile.h"
+#include "functors/default.h"
+#include "functors/successors.h"
+#include "inst_reader.h"
+#include "opcode.h"
+
+#include <queue>
+#include <vector>
+
+std::vector<bool> mark_reachable_instructions(const bytefile *file, const std::vector<const char *> &entrypoints) {
+    std::queue<const char *> q;
+    std::vector<bool> visited(get_code_size(file));
+    for (const char *entry : entrypoints) {
+        q.push(entry);
+        visited[entry - file->code_ptr] = true;
+    }
+
+    InstReader reader(file);
+
+    while (!q.empty()) {
+        const char *ip = q.front();
+        q.pop();
+
+        std::vector<const char *> successors;
+        const char *next = reader.read_inst<DefaultFunctor>(ip);
+        reader.read_inst<SuccessorsFunctor, const char *, const char *, std::vector<const char *> *>(ip, file->code_ptr, next, &successors);
+        for (const char *s : successors) {
+            if (!visited[s - file->code_ptr]) {
+                visited[s - file->code_ptr] = true;
+                q.push(s);
+            }
+        }
+    }
+
+    return visited;
+}
+
+void mark_jumps(const bytefile *file, std::vector<bool> *jump, std::vector<bool> *label) {
+    const char *code_begin = file->code_ptr;
+    const char *code_end = file->code_ptr + get_code_size(file);
+
+    jump->assign(code_end - code_begin, false);
+    label->assign(code_end - code_begin, false);
+    InstReader reader(file);
+
+    for (const char *ip = code_begin; ip != code_end;) {
+        unsigned char opcode = *ip;
+        switch (opcode) {
+        case Opcode_Jmp:
+        case Opcode_CJmpNZ:
+        case Opcode_CJmpZ:
+        case Opcode_Call:
+        case Opcode_CallC:
+        case Opcode_Fail:
+        case COMPOSED(HOpcode_Stop, 0):
+            jump->at(ip - code_begin) = true;
+            break;
+        default:
+            if ((opcode >> 4) == HOpcode_CmpJmpZ || (opcode >> 4) == HOpcode_CmpJmpNZ) {
+                jump->at(ip - code_begin) = true;
+            }
+            break;
+        }
+
+        std::vector<const char *> successors;
+        const char *next = reader.read_inst<DefaultFunctor>(ip);
+        reader.read_inst<SuccessorsFunctor, const char *, const char *, std::vector<const char *> *>(ip, file->code_ptr, next, &successors);
+        for (const char *s : successors) {
+            if (next != s) {
+                label->at(s - code_begin) = true;
+            }
+        }
+        ip = (char *)next;
+    }
+}
@@ -0,0 +1,17 @@
+#ifndef CFG_H
+#define CFG_H
+
+#include "bytefile.h"
+
+#include <vector>
+
+/* Marks code offsets of instructions reachable from the entrypoints */
+std::vector<bool> mark_reachable_instructions(const bytefile *file, const std::vector<const char *> &entrypoints);
+
+/*
+ * Marks instructions that transfer control (jump) and targets of non-sequential
+ * transfers (label); an idiom may not continue past the first nor into the second.
+ */
+void mark_jumps(const bytefile *file, std::vector<bool> *jump, std::vector<bool> *label);
+
+#endif // CFG_H
@@ -0,0 +1,125 @@
+#include "escape.h"
+#include "bytefile.h"
+#include "error.h"
+#include "functors/default.h"
+#include "functors/escape.h"
+#include "functors/successors.h"
+#include "inst_reader.h"
+#include "opcode.h"
+
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+/**
+ * Merges `incoming` into `state`. Slots holding different values become Unknown,
+ * and the objects they held are considered escaped.
+ * Returns whether `state` has changed.
+ */
+static inline bool join(EscapeState &state, const EscapeState &incoming, EscapeContext *context) {
+    bool changed = false;
+    auto join_slots = [&](std::vector<int> &slots, const std::vector<int> &other) {
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i] != other[i]) {
+                escape(context, slots[i]);
+                escape(context, other[i]);
+                changed |= slots[i] != Unknown;
+                slots[i] = Unknown;
+            }
+        }
+    };
+    join_slots(state.stack, incoming.stack);
+    join_slots(state.locals, incoming.locals);
+    return changed;
+}
+
+static inline void analyze_function(const bytefile *file, const char *begin, std::vector<bool> *escaped) {
+    InstReader reader(file);
+
+    const char *end = begin;
+    std::vector<int> sites;
+    std::vector<bool> address_taken;
+    while (*end != Opcode_End) {
+        unsigned char x = *end;
+        if (x == Opcode_SExp) {
+            sites.push_back(end - file->code_ptr);
+        } else if (x == COMPOSED(HOpcode_LdA, Location_Local)) {
+            int index = *(const int *)(end + 1);
+            if (index >= (int)address_taken.size()) {
+                address_taken.resize(index + 1, false);
+            }
+            address_taken[index] = true;
+        } else if (x == Opcode_Begin || x == Opcode_CBegin) {
+            int locals_count = *(const int *)(end + 1 + sizeof(int));
+            address_taken.resize(std::max((int)address_taken.size(), locals_count), false);
+        }
+        end = reader.read_inst<DefaultFunctor>(end);
+    }
+
+    EscapeContext context{
+        .inst = 0,
+        .address_taken = &address_taken,
+        .escaped = escaped,
+    };
+
+    std::unordered_map<const char *, EscapeState> states;
+    std::queue<const char *> q;
+    states[begin] = EscapeState{};
+    q.push(begin);
+
+    while (!q.empty()) {
+        const char *ip = q.front();
+        q.pop();
+
+        EscapeState state = states[ip];
+        context.inst = ip - file->code_ptr;
+        const char *next = reader.read_inst<EscapeFunctor>(ip, &state, &context);
+
+        std::vector<const char *> successors;
+        reader.read_inst<SuccessorsFunctor>(ip, file->code_ptr, next, &successors);
+        for (const char *s : successors) {
+            if (s < begin || s > end) {
+                continue;
+            }
+            auto it = states.find(s);
+            if (it == states.end()) {
+                states[s] = state;
+                q.push(s);
+                continue;
+            }
+            if (it->second.stack.size() != state.stack.size() || it->second.locals.size() != state.locals.size()) {
+                // inconsistent stack layout: nothing in this function can be proven not to escape
+                for (int site : sites) {
+                    (*escaped)[site] = true;
+                }
+                return;
+            }
+            if (join(it->second, state, &context)) {
+                q.push(s);
+            }
+        }
+    }
+}
+
+} // namespace
+
+std::vector<bool> find_scoped_allocations(const bytefile *file, const std::vector<const char *> &functions) {
+    std::vector<bool> escaped(get_code_size(file), false);
+    std::vector<bool> scoped(get_code_size(file), false);
+
+    for (const char *begin : functions) {
+        analyze_function(file, begin, &escaped);
+    }
+
+    InstReader reader(file);
+    for (const char *begin : functions) {
+        for (const char *ip = begin; *ip != Opcode_End; ip = reader.read_inst<DefaultFunctor>(ip)) {
+            if (*ip == Opcode_SExp && !escaped[ip - file->code_ptr]) {
+                scoped[ip - file->code_ptr] = true;
+            }
+        }
+    }
+    return scoped;
+}
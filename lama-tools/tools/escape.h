@@ -0,0 +1,13 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include "bytefile.h"
+
+/*
+ * Finds SExp instructions whose results never leave the activation of the function
+ * containing them, so they can be allocated in the scoped region.
+ * Returns a flag for each offset in the code section.
+ */
+std::vector<bool> find_scoped_allocations(const bytefile *file, const std::vector<const char *> &functions);
+
+#endif // ESCAPE_H
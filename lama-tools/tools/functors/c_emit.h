@@ -0,0 +1,477 @@
+#ifndef FUNCTOR_C_EMIT_H
+#define FUNCTOR_C_EMIT_H
+
+#include "../bytefile.h"
+#include "../error.h"
+#include "../opcode.h"
+
+#include <cstdio>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+
+/* Translation state shared by instructions of one program, see bc2c_runtime.h for the generated code */
+struct CEmitContext {
+    const bytefile *file;
+    const char *file_name;
+    const char *function;            /* Begin of the function being translated */
+    std::map<std::string, int> tags; /* Index in the table of tag hashes by name */
+    std::set<int> closures;          /* Entries of created closures */
+
+    int tag(const char *name) {
+        return tags.emplace(name, tags.size()).first->second;
+    }
+};
+
+/* A C string literal with the same bytes as `s` */
+inline std::string c_string_literal(const char *s) {
+    std::string literal = "\"";
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\' || c == '?') {
+            literal += '\\';
+            literal += c;
+        } else if (c < ' ' || c >= 0x7F) {
+            char escape[5];
+            snprintf(escape, sizeof(escape), "\\%03o", c);
+            literal += escape;
+        } else {
+            literal += c;
+        }
+    }
+    return literal + "\"";
+}
+
+inline std::string c_function_name(int offset) {
+    char name[16];
+    snprintf(name, sizeof(name), "f_%x", offset);
+    return name;
+}
+
+inline std::string c_label_name(int offset) {
+    char name[16];
+    snprintf(name, sizeof(name), "label_%x", offset);
+    return name;
+}
+
+inline std::string c_location(unsigned char location, int index) {
+    static constexpr const char *locations[] = {"G", "L", "A", "C"};
+    ASSERT(location < sizeof(locations) / sizeof(locations[0]), 1, "Unexpected location type %d", location);
+    return std::string(locations[location]) + "(" + std::to_string(index) + ")";
+}
+
+template <unsigned char opcode, typename... Args>
+struct CEmitFunctor {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(Args...) {
+        FAIL(1, "Opcode %d can not be translated to C", opcode);
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Const, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int value) {
+        out << "    vstack_push(BOX(" << value << "));\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_String, const char *> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(const char *s) {
+        out << "    vstack_push((size_t)Bstring((void *)" << c_string_literal(s) << "));\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_SExp, const char *, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(const char *tag, int n) {
+        out << "    vstack_push((size_t)BSexp(" << n << ", UNBOX(tags[" << ctx->tag(tag) << "])));\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_StI> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    sti();\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_StA> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    sta();\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Jmp, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int target) {
+        out << "    goto " << c_label_name(target) << ";\n";
+    }
+};
+
+template <unsigned char opcode>
+    requires(opcode == SINGLE(Opcode_End) || opcode == SINGLE(Opcode_Ret))
+struct CEmitFunctor<opcode> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    frame_end(&frame);\n"
+            << "    return;\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Drop> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    vstack_pop();\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Dup> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    vstack_push(vstack_top());\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Swap> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    {\n"
+            << "        size_t fst = vstack_pop(), snd = vstack_pop();\n"
+            << "        vstack_push(fst);\n"
+            << "        vstack_push(snd);\n"
+            << "    }\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Elem> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    {\n"
+            << "        int i = vstack_pop();\n"
+            << "        void *p = (void *)vstack_pop();\n"
+            << "        vstack_push((size_t)Belem(p, i));\n"
+            << "    }\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_CJmpZ, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int target) {
+        out << "    if (UNBOX(vstack_pop()) == 0) goto " << c_label_name(target) << ";\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_CJmpNZ, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int target) {
+        out << "    if (UNBOX(vstack_pop()) != 0) goto " << c_label_name(target) << ";\n";
+    }
+};
+
+/* Self tail calls jump back to `begin` */
+template <unsigned char opcode>
+    requires(opcode == SINGLE(Opcode_Begin) || opcode == SINGLE(Opcode_CBegin))
+struct CEmitFunctor<opcode, int, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int, int locals_count) {
+        out << "    Frame frame;\n"
+            << "    frame_call(&frame, argc, is_closure);\n"
+            << "begin:\n"
+            << "    frame_alloc(&frame, " << locals_count << ");\n";
+    }
+};
+
+/* Captured values are read after the allocation, so they are up to date if it has moved them */
+template <>
+struct CEmitFunctor<Opcode_Closure, int, CaptureList> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int entry, CaptureList captured) {
+        ctx->closures.insert(entry);
+        out << "    {\n"
+            << "        size_t *closure = Bclosure(" << captured.size() << ", 0x" << std::hex << entry << std::dec << ");\n";
+        for (int i = 0; i < captured.size(); i++) {
+            out << "        closure[" << i + 1 << "] = " << c_location(captured[i].kind, captured[i].index) << ";\n";
+        }
+        out << "        vstack_push((size_t)closure);\n"
+            << "    }\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_CallC, const char *, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(const char *, int args_count) {
+        out << "    call_closure(" << args_count << ");\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Call, const char *, int, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(const char *return_ip, int offset, int args_count) {
+        bool is_tail = *return_ip == Opcode_End || *return_ip == Opcode_Ret;
+        if (is_tail && ctx->file->code_ptr + offset == ctx->function) {
+            out << "    frame_tail_call(&frame, " << args_count << ");\n"
+                << "    goto begin;\n";
+        } else {
+            out << "    " << c_function_name(offset) << "(" << args_count << ", 0);\n";
+        }
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Tag, const char *, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(const char *tag, int n) {
+        out << "    vstack_push(Btag((void *)vstack_pop(), tags[" << ctx->tag(tag) << "], BOX(" << n << ")));\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Array, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int n) {
+        out << "    vstack_push(Barray_patt((void *)vstack_pop(), BOX(" << n << ")));\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Fail, int, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int line, int col) {
+        out << "    Bmatch_failure((void *)vstack_pop(), (char *)" << c_string_literal(ctx->file_name) << ", "
+            << line << ", " << col << ");\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<Opcode_Line, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int) {}
+};
+
+#define EMIT_BINOP(binop, op, helper)                                   \
+    template <>                                                         \
+    struct CEmitFunctor<COMPOSED(HOpcode_Binop, binop)> {               \
+        std::ostream &out;                                              \
+        CEmitContext *ctx;                                              \
+                                                                        \
+        inline void operator()() {                                      \
+            out << "    BINOP(" #op ", " #helper ");\n";                \
+        }                                                               \
+    };
+
+EMIT_BINOP(Binop_Add, +, Ls__Infix_43)
+EMIT_BINOP(Binop_Sub, -, Ls__Infix_45)
+EMIT_BINOP(Binop_Mul, *, Ls__Infix_42)
+EMIT_BINOP(Binop_Div, /, Ls__Infix_47)
+EMIT_BINOP(Binop_Rem, %, Ls__Infix_37)
+EMIT_BINOP(Binop_LessThan, <, Ls__Infix_60)
+EMIT_BINOP(Binop_LessEqual, <=, Ls__Infix_6061)
+EMIT_BINOP(Binop_GreaterThan, >, Ls__Infix_62)
+EMIT_BINOP(Binop_GreaterEqual, >=, Ls__Infix_6261)
+EMIT_BINOP(Binop_Equal, ==, Ls__Infix_6161)
+EMIT_BINOP(Binop_NotEqual, !=, Ls__Infix_3361)
+EMIT_BINOP(Binop_And, &&, Ls__Infix_3838)
+EMIT_BINOP(Binop_Or, ||, Ls__Infix_3333)
+#undef EMIT_BINOP
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_Ld)
+struct CEmitFunctor<opcode, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int index) {
+        out << "    vstack_push(" << c_location(opcode & 0x0F, index) << ");\n";
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_LdA)
+struct CEmitFunctor<opcode, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int index) {
+        std::string location = c_location(opcode & 0x0F, index);
+        out << "    vstack_push((size_t)&" << location << ");\n"
+            << "    vstack_push((size_t)&" << location << ");\n";
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_St)
+struct CEmitFunctor<opcode, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int index) {
+        out << "    " << c_location(opcode & 0x0F, index) << " = vstack_top();\n";
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_StDrop)
+struct CEmitFunctor<opcode, int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int index) {
+        out << "    " << c_location(opcode & 0x0F, index) << " = vstack_pop();\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<COMPOSED(HOpcode_Patt, Pattern_String)> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    {\n"
+            << "        void *x = (void *)vstack_pop();\n"
+            << "        void *y = (void *)vstack_pop();\n"
+            << "        vstack_push(Bstring_patt(x, y));\n"
+            << "    }\n";
+    }
+};
+
+#define EMIT_TAG_PATTERN(pattern, function)                             \
+    template <>                                                         \
+    struct CEmitFunctor<COMPOSED(HOpcode_Patt, pattern)> {              \
+        std::ostream &out;                                              \
+        CEmitContext *ctx;                                              \
+                                                                        \
+        inline void operator()() {                                      \
+            out << "    vstack_push(" #function "((void *)vstack_pop()));\n"; \
+        }                                                               \
+    };
+
+EMIT_TAG_PATTERN(Pattern_StringTag, Bstring_tag_patt)
+EMIT_TAG_PATTERN(Pattern_ArrayTag, Barray_tag_patt)
+EMIT_TAG_PATTERN(Pattern_SExpTag, Bsexp_tag_patt)
+EMIT_TAG_PATTERN(Pattern_Boxed, Bboxed_patt)
+EMIT_TAG_PATTERN(Pattern_Unboxed, Bunboxed_patt)
+EMIT_TAG_PATTERN(Pattern_ClosureTag, Bclosure_tag_patt)
+#undef EMIT_TAG_PATTERN
+
+template <>
+struct CEmitFunctor<COMPOSED(HOpcode_LCall, LCall_Lread)> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    vstack_push(Lread());\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<COMPOSED(HOpcode_LCall, LCall_Lwrite)> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    vstack_push(Lwrite(vstack_pop()));\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<COMPOSED(HOpcode_LCall, LCall_Llength)> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    vstack_push(Llength((void *)vstack_pop()));\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<COMPOSED(HOpcode_LCall, LCall_Lstring)> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    vstack_push((size_t)Lstring((void *)vstack_pop()));\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<COMPOSED(HOpcode_LCall, LCall_Barray), int> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()(int n) {
+        out << "    vstack_push((size_t)Barray(" << n << "));\n";
+    }
+};
+
+template <>
+struct CEmitFunctor<COMPOSED(HOpcode_Stop, 0)> {
+    std::ostream &out;
+    CEmitContext *ctx;
+
+    inline void operator()() {
+        out << "    exit(0);\n";
+    }
+};
+
+#endif // FUNCTOR_C_EMIT_H
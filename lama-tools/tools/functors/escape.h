@@ -0,0 +1,277 @@
+#ifndef FUNCTOR_ESCAPE_H
+#define FUNCTOR_ESCAPE_H
+
+#include "../opcode.h"
+
+#include <vector>
+
+/*
+ * Abstract value of a stack slot or a local: offset of the SExp instruction
+ * which allocated it, or Unknown for anything else
+ */
+constexpr int Unknown = -1;
+
+struct EscapeState {
+    std::vector<int> stack;
+    std::vector<int> locals;
+
+    bool operator==(const EscapeState &) const = default;
+};
+
+struct EscapeContext {
+    int inst;                               /* Offset of the current instruction */
+    const std::vector<bool> *address_taken; /* Locals loaded by LdA, values stored there are not tracked */
+    std::vector<bool> *escaped;             /* SExp sites whose results may leave the frame, by offset */
+};
+
+inline void escape(EscapeContext *context, int value) {
+    if (value != Unknown) {
+        (*context->escaped)[value] = true;
+    }
+}
+
+inline int pop(EscapeState *state) {
+    int value = state->stack.back();
+    state->stack.pop_back();
+    return value;
+}
+
+inline void pop_escaping(EscapeState *state, EscapeContext *context, int n) {
+    for (int i = 0; i < n; i++) {
+        escape(context, pop(state));
+    }
+}
+
+inline void pop_unknown(EscapeState *state, int n) {
+    state->stack.resize(state->stack.size() - n);
+}
+
+inline bool is_tracked_local(EscapeContext *context, Location kind, int index) {
+    return kind == Location_Local && !(*context->address_taken)[index];
+}
+
+/*
+ * Tracks results of SExp through the operand stack and locals of a function.
+ * A result escapes when it is stored to a location other than a tracked local,
+ * put into another object, passed to a call or returned.
+ */
+template <unsigned char opcode, typename... Args>
+struct EscapeFunctor {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(Args...) {}
+};
+
+template <unsigned char opcode, typename... Args>
+    requires(opcode == Opcode_Const || opcode == Opcode_String || opcode == COMPOSED(HOpcode_LCall, LCall_Lread))
+struct EscapeFunctor<opcode, Args...> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(Args...) {
+        state->stack.push_back(Unknown);
+    }
+};
+
+template <unsigned char opcode, typename... Args>
+    requires((opcode >> 4) == HOpcode_Binop || opcode == COMPOSED(HOpcode_Patt, Pattern_String) || opcode == Opcode_Elem)
+struct EscapeFunctor<opcode, Args...> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(Args...) {
+        pop_unknown(state, 2);
+        state->stack.push_back(Unknown);
+    }
+};
+
+template <unsigned char opcode, typename... Args>
+    requires(((opcode >> 4) == HOpcode_Patt && (opcode & 0x0F) != Pattern_String) || opcode == Opcode_Tag || opcode == Opcode_Array || opcode == COMPOSED(HOpcode_LCall, LCall_Llength) || opcode == COMPOSED(HOpcode_LCall, LCall_Lwrite) || opcode == COMPOSED(HOpcode_LCall, LCall_Lstring))
+struct EscapeFunctor<opcode, Args...> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(Args...) {
+        pop_unknown(state, 1);
+        state->stack.push_back(Unknown);
+    }
+};
+
+template <unsigned char opcode, typename... Args>
+    requires(opcode == Opcode_Drop || opcode == Opcode_CJmpZ || opcode == Opcode_CJmpNZ || opcode == Opcode_Fail)
+struct EscapeFunctor<opcode, Args...> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(Args...) {
+        pop_unknown(state, 1);
+    }
+};
+
+template <unsigned char opcode>
+    requires(opcode == Opcode_End || opcode == Opcode_Ret)
+struct EscapeFunctor<opcode> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()() {
+        pop_escaping(state, context, 1);
+    }
+};
+
+template <>
+struct EscapeFunctor<Opcode_SExp, const char *, int> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(const char *, int n) {
+        pop_escaping(state, context, n);
+        state->stack.push_back(context->inst);
+    }
+};
+
+template <>
+struct EscapeFunctor<Opcode_StI> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()() {
+        int value = pop(state);
+        escape(context, value);
+        pop_unknown(state, 1);
+        state->stack.push_back(value);
+    }
+};
+
+template <>
+struct EscapeFunctor<Opcode_StA> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()() {
+        int value = pop(state);
+        escape(context, value);
+        pop_unknown(state, 2);
+        state->stack.push_back(value);
+    }
+};
+
+template <>
+struct EscapeFunctor<Opcode_Dup> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()() {
+        state->stack.push_back(state->stack.back());
+    }
+};
+
+template <>
+struct EscapeFunctor<Opcode_Swap> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()() {
+        std::swap(state->stack[state->stack.size() - 1], state->stack[state->stack.size() - 2]);
+    }
+};
+
+template <unsigned char opcode>
+    requires(opcode == Opcode_Begin || opcode == Opcode_CBegin)
+struct EscapeFunctor<opcode, int, int> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(int, int locals_count) {
+        state->stack.clear();
+        state->locals.assign(locals_count, Unknown);
+    }
+};
+
+template <>
+struct EscapeFunctor<Opcode_Closure, int, CaptureList> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(int, CaptureList capture) {
+        for (LocationEntry location : capture) {
+            if (is_tracked_local(context, location.kind, location.index)) {
+                escape(context, state->locals[location.index]);
+            }
+        }
+        state->stack.push_back(Unknown);
+    }
+};
+
+template <>
+struct EscapeFunctor<Opcode_CallC, const char *, int> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(const char *, int args_count) {
+        pop_escaping(state, context, args_count + 1);
+        state->stack.push_back(Unknown);
+    }
+};
+
+template <>
+struct EscapeFunctor<Opcode_Call, const char *, int, int> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(const char *, int, int args_count) {
+        pop_escaping(state, context, args_count);
+        state->stack.push_back(Unknown);
+    }
+};
+
+template <>
+struct EscapeFunctor<COMPOSED(HOpcode_LCall, LCall_Barray), int> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(int n) {
+        pop_escaping(state, context, n);
+        state->stack.push_back(Unknown);
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_Ld)
+struct EscapeFunctor<opcode, int> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(int index) {
+        Location kind = (Location)(opcode & 0x0F);
+        state->stack.push_back(is_tracked_local(context, kind, index) ? state->locals[index] : Unknown);
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_LdA)
+struct EscapeFunctor<opcode, int> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(int) {
+        state->stack.push_back(Unknown);
+        state->stack.push_back(Unknown);
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_St)
+struct EscapeFunctor<opcode, int> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(int index) {
+        Location kind = (Location)(opcode & 0x0F);
+        if (is_tracked_local(context, kind, index)) {
+            state->locals[index] = state->stack.back();
+        } else {
+            escape(context, state->stack.back());
+        }
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_StDrop)
+struct EscapeFunctor<opcode, int> {
+    EscapeState *state;
+    EscapeContext *context;
+    inline void operator()(int index) {
+        Location kind = (Location)(opcode & 0x0F);
+        int value = pop(state);
+        if (is_tracked_local(context, kind, index)) {
+            state->locals[index] = value;
+        } else {
+            escape(context, value);
+        }
+    }
+};
+
+#endif // FUNCTOR_ESCAPE_H
@@ -3,6 +3,7 @@
 
 #include "../error.h"
 #include "../opcode.h"
+#include "../text_buffer.h"
 
 #include <ostream>
 #include <vector>
@@ -22,6 +23,42 @@ inline const char *opcode_to_string() {
     }
 #undef BINOP_TO_STRING
 
+#define BINOP_INT_TO_STRING(opcode, op) \
+    if constexpr (lo == opcode) {       \
+        return "BINOP.int " #op;        \
+    }
+#define BINOP_ANY_TO_STRING(opcode, op) \
+    if constexpr (lo == opcode) {       \
+        return "BINOP.any " #op;        \
+    }
+
+    if constexpr (hi == HOpcode_BinopInt) {
+        BINOPS(BINOP_INT_TO_STRING)
+    }
+    if constexpr (hi == HOpcode_BinopAny) {
+        BINOPS(BINOP_ANY_TO_STRING)
+    }
+#undef BINOP_INT_TO_STRING
+#undef BINOP_ANY_TO_STRING
+
+#define CMP_JMP_Z_TO_STRING(opcode, op) \
+    if constexpr (lo == opcode) {       \
+        return "CMPJMPz " #op;          \
+    }
+#define CMP_JMP_NZ_TO_STRING(opcode, op) \
+    if constexpr (lo == opcode) {        \
+        return "CMPJMPnz " #op;          \
+    }
+
+    if constexpr (hi == HOpcode_CmpJmpZ) {
+        BINOPS(CMP_JMP_Z_TO_STRING)
+    }
+    if constexpr (hi == HOpcode_CmpJmpNZ) {
+        BINOPS(CMP_JMP_NZ_TO_STRING)
+    }
+#undef CMP_JMP_Z_TO_STRING
+#undef CMP_JMP_NZ_TO_STRING
+
 #define HOPCODE_TO_STRING(code, str) \
     if constexpr (hi == code) {      \
         return str;                  \
@@ -30,6 +67,7 @@ inline const char *opcode_to_string() {
     HOPCODE_TO_STRING(HOpcode_Ld, "LD")
     HOPCODE_TO_STRING(HOpcode_LdA, "LDA")
     HOPCODE_TO_STRING(HOpcode_St, "ST")
+    HOPCODE_TO_STRING(HOpcode_StDrop, "STDROP")
     HOPCODE_TO_STRING(HOpcode_Stop, "STOP")
 #undef HOPCODE_TO_STRING
 
@@ -86,98 +124,126 @@ inline const char *opcode_to_string() {
     FAIL(1, "Unexpected opcode: %d", (int)opcode);
 }
 
+/* Prints only the mnemonic, to group instructions by opcode */
 template <unsigned char opcode, typename... Args>
-struct PrinterFunctor {
+struct OpcodeNameFunctor {
     std::ostream &out;
+    inline void operator()(Args...) {
+        out << opcode_to_string<opcode>();
+    }
+};
+
+/*
+ * Prints an instruction with its arguments into a TextBuffer, which is much faster
+ * than iostreams for dumps of big files; write the buffer out to print into a stream.
+ */
+template <unsigned char opcode, typename... Args>
+struct PrinterFunctor {
+    TextBuffer *out;
+
+    inline void put_arg(int value) {
+        out->put_dec(value);
+    }
+    inline void put_arg(const char *value) {
+        out->put(value);
+    }
+
     inline void operator()(Args... args) {
-        out << opcode_to_string<opcode>() << "\t";
-        ((out << std::forward<Args>(args) << " "), ...);
+        out->put(opcode_to_string<opcode>());
+        out->put('\t');
+        ((put_arg(args), out->put(' ')), ...);
     }
 };
 
-#define PRINT_LOCATION(hi, location, str)                     \
-    template <>                                               \
-    struct PrinterFunctor<COMPOSED(hi, location), int> {      \
-        std::ostream &out;                                    \
-        inline void operator()(int index) {                   \
-            out << opcode_to_string<COMPOSED(hi, location)>() \
-                << "\t" str "(" << index << ")";              \
-        }                                                     \
+#define PRINT_LOCATION(hi, location, str)                             \
+    template <>                                                       \
+    struct PrinterFunctor<COMPOSED(hi, location), int> {              \
+        TextBuffer *out;                                              \
+        inline void operator()(int index) {                           \
+            out->put(opcode_to_string<COMPOSED(hi, location)>());     \
+            out->put("\t" str "(");                                   \
+            out->put_dec(index);                                      \
+            out->put(')');                                            \
+        }                                                             \
     };
 
 LOCATIONS(HOpcode_Ld, PRINT_LOCATION)
 LOCATIONS(HOpcode_LdA, PRINT_LOCATION)
 LOCATIONS(HOpcode_St, PRINT_LOCATION)
+LOCATIONS(HOpcode_StDrop, PRINT_LOCATION)
 #undef PRINT_LOCATION
 
-#define PRINT_OFFSET(opcode)                                  \
-    template <>                                               \
-    struct PrinterFunctor<SINGLE(opcode), int> {              \
-        std::ostream &out;                                    \
-        inline void operator()(int offset) {                  \
-            out << opcode_to_string<SINGLE(opcode)>() << "\t" \
-                << "0x" << std::hex << offset << std::dec;    \
-        }                                                     \
-    };
-
-PRINT_OFFSET(Opcode_Jmp)
-PRINT_OFFSET(Opcode_CJmpNZ)
-PRINT_OFFSET(Opcode_CJmpZ)
-#undef PRINT_OFFSET
+template <unsigned char opcode>
+    requires(opcode == SINGLE(Opcode_Jmp) || opcode == SINGLE(Opcode_CJmpZ) || opcode == SINGLE(Opcode_CJmpNZ) ||
+             (opcode >> 4) == HOpcode_CmpJmpZ || (opcode >> 4) == HOpcode_CmpJmpNZ)
+struct PrinterFunctor<opcode, int> {
+    TextBuffer *out;
+    inline void operator()(int offset) {
+        out->put(opcode_to_string<opcode>());
+        out->put("\t0x");
+        out->put_hex(offset);
+    }
+};
 
 template <>
 struct PrinterFunctor<SINGLE(Opcode_Call), const char *, int, int> {
-    std::ostream &out;
+    TextBuffer *out;
     inline void operator()(const char *, int offset, int argc) {
-        out << opcode_to_string<Opcode_Call>() << "\t"
-            << "0x" << std::hex << offset << std::dec << " "
-            << argc;
+        out->put(opcode_to_string<Opcode_Call>());
+        out->put("\t0x");
+        out->put_hex(offset);
+        out->put(' ');
+        out->put_dec(argc);
     }
 };
 
 template <>
-struct PrinterFunctor<SINGLE(Opcode_CallC), const char *, int, int> {
-    std::ostream &out;
+struct PrinterFunctor<SINGLE(Opcode_CallC), const char *, int> {
+    TextBuffer *out;
     inline void operator()(const char *, int argc) {
-        out << opcode_to_string<Opcode_CallC>() << "\t" << argc;
+        out->put(opcode_to_string<Opcode_CallC>());
+        out->put('\t');
+        out->put_dec(argc);
     }
 };
 
-#define PRINT_PATTERN(pattern, str)                                            \
-    template <>                                                                \
-    struct PrinterFunctor<COMPOSED(HOpcode_Patt, pattern)> {                   \
-        std::ostream &out;                                                     \
-        inline void operator()() {                                             \
-            out << opcode_to_string<COMPOSED(HOpcode_Patt, pattern)>() << "\t" \
-                << str;                                                        \
-        }                                                                      \
+#define PRINT_PATTERN(pattern, str)                                           \
+    template <>                                                               \
+    struct PrinterFunctor<COMPOSED(HOpcode_Patt, pattern)> {                  \
+        TextBuffer *out;                                                      \
+        inline void operator()() {                                            \
+            out->put(opcode_to_string<COMPOSED(HOpcode_Patt, pattern)>());    \
+            out->put("\t" str);                                               \
+        }                                                                     \
     };
 
 PATTERNS(PRINT_PATTERN)
 #undef PRINT_PATTERN
 
-#define PRINT_LCALL(lcall, str)                                        \
-    template <>                                                        \
-    struct PrinterFunctor<COMPOSED(HOpcode_LCall, lcall)> {            \
-        std::ostream &out;                                             \
-        inline void operator()() {                                     \
-            out << opcode_to_string<COMPOSED(HOpcode_LCall, lcall)>(); \
-        }                                                              \
-    };
-
-LCALLS(PRINT_LCALL)
-#undef PRINT_LCALL
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_LCall && (opcode & 0x0F) != LCall_Barray)
+struct PrinterFunctor<opcode> {
+    TextBuffer *out;
+    inline void operator()() {
+        out->put(opcode_to_string<opcode>());
+    }
+};
 
 template <>
-struct PrinterFunctor<SINGLE(Opcode_Closure), int, std::vector<LocationEntry>> {
+struct PrinterFunctor<SINGLE(Opcode_Closure), int, CaptureList> {
     static constexpr const char *locations[] = {"G", "L", "A", "C"};
 
-    std::ostream &out;
-    inline void operator()(int offset, std::vector<LocationEntry> args) {
-        out << opcode_to_string<SINGLE(Opcode_Closure)>() << " "
-            << std::hex << offset << std::dec << " ";
-        for (const auto &entry : args) {
-            out << locations[entry.kind] << "(" << entry.index << ")" << "\t";
+    TextBuffer *out;
+    inline void operator()(int offset, CaptureList args) {
+        out->put(opcode_to_string<SINGLE(Opcode_Closure)>());
+        out->put(' ');
+        out->put_hex(offset);
+        out->put(' ');
+        for (LocationEntry entry : args) {
+            out->put(locations[entry.kind]);
+            out->put('(');
+            out->put_dec(entry.index);
+            out->put(")\t");
         }
     }
 };
@@ -17,7 +17,8 @@ enum StackError {
 
 struct StackLayout {
     int globals;
-    int locals;
+    int locals; /* Locals of the frame and values on the operand stack above them */
+    int frame_locals; /* Locals of the frame only */
     int args;
     int captured;
     std::vector<int> *jumps;
@@ -27,22 +28,27 @@ struct StackLayout {
 inline void load_location(StackLayout *layout, const LocationEntry &location) {
     switch (location.kind) {
     case Location_Global:
-        if (location.index > layout->globals) {
+        if (location.index < 0 || location.index >= layout->globals) {
             FAIL(1, "Memory access failed: G(%d) is out of section (%d globals)",
                  location.index, layout->globals);
         }
         break;
     case Location_Local:
-        if (location.index > layout->locals) {
+        if (location.index < 0 || location.index >= layout->frame_locals) {
             FAIL(1, "Memory access failed: L(%d) is out of frame (%d locals)",
-                 location.index, layout->locals);
+                 location.index, layout->frame_locals);
         }
         break;
     case Location_Arg:
-        layout->args = std::max(layout->args, 1 + location.index);
+        if (location.index < 0 || location.index >= layout->args) {
+            FAIL(1, "Memory access failed: A(%d) is out of frame (%d args)",
+                 location.index, layout->args);
+        }
         break;
     case Location_Captured:
-        if (!layout->is_closure) {
+        if (location.index < 0) {
+            FAIL(1, "Memory access failed: C(%d) is invalid", location.index);
+        } else if (!layout->is_closure) {
             FAIL(1, "Memory access failed: C(%d) is invalid out of closure",
                  location.index);
         } else {
@@ -68,7 +74,7 @@ struct StackDepthFunctor<opcode, Args...> {
 };
 
 template <unsigned char opcode, typename... Args>
-    requires(opcode == Opcode_Const || opcode == Opcode_String || opcode == Opcode_SExp || opcode == Opcode_Dup)
+    requires(opcode == Opcode_Const || opcode == Opcode_String || opcode == Opcode_Dup)
 struct StackDepthFunctor<opcode, Args...> {
     StackLayout *layout;
     inline void operator()(Args...) {
@@ -76,6 +82,14 @@ struct StackDepthFunctor<opcode, Args...> {
     }
 };
 
+template <>
+struct StackDepthFunctor<Opcode_SExp, const char *, int> {
+    StackLayout *layout;
+    inline void operator()(const char *, int n) {
+        layout->locals += 1 - n;
+    }
+};
+
 template <unsigned char opcode>
     requires((opcode >> 4) == HOpcode_Ld)
 struct StackDepthFunctor<opcode, int> {
@@ -105,6 +119,16 @@ struct StackDepthFunctor<opcode, int> {
     }
 };
 
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_StDrop)
+struct StackDepthFunctor<opcode, int> {
+    StackLayout *layout;
+    inline void operator()(int index) {
+        load_location(layout, {(Location)(opcode & 0x0f), index});
+        layout->locals -= 1;
+    }
+};
+
 template <>
 struct StackDepthFunctor<Opcode_StI> {
     StackLayout *layout;
@@ -170,6 +194,7 @@ struct StackDepthFunctor<Opcode_Begin, int, int> {
         layout->args = args_count;
         layout->is_closure = false;
         layout->locals = locals_count;
+        layout->frame_locals = locals_count;
         layout->captured = 0;
     }
 };
@@ -181,15 +206,16 @@ struct StackDepthFunctor<Opcode_CBegin, int, int> {
         layout->args = args_count;
         layout->is_closure = true;
         layout->locals = locals_count;
+        layout->frame_locals = locals_count;
         layout->captured = 0;
     }
 };
 
 template <>
-struct StackDepthFunctor<Opcode_Closure, int, std::vector<LocationEntry>> {
+struct StackDepthFunctor<Opcode_Closure, int, CaptureList> {
     StackLayout *layout;
-    inline void operator()(int, std::vector<LocationEntry> capture) {
-        for (const LocationEntry &loc : capture) {
+    inline void operator()(int, CaptureList capture) {
+        for (LocationEntry loc : capture) {
             load_location(layout, loc);
         }
         layout->locals += 1;
@@ -205,14 +231,16 @@ struct StackDepthFunctor<Opcode_Line, int> {
 template <>
 struct StackDepthFunctor<Opcode_CallC, const char *, int> {
     StackLayout *layout;
-    inline void operator()(const char *, int) {}
+    inline void operator()(const char *, int args_count) {
+        layout->locals -= args_count;
+    }
 };
 
 template <>
 struct StackDepthFunctor<Opcode_Call, const char *, int, int> {
     StackLayout *layout;
-    inline void operator()(const char *, int, int) {
-        layout->locals += 1;
+    inline void operator()(const char *, int, int args_count) {
+        layout->locals += 1 - args_count;
     }
 };
 
@@ -235,9 +263,9 @@ struct StackDepthFunctor<Opcode_End> {
 };
 
 template <>
-struct StackDepthFunctor<Opcode_Fail> {
+struct StackDepthFunctor<Opcode_Fail, int, int> {
     StackLayout *layout;
-    inline void operator()() {
+    inline void operator()(int, int) {
         layout->locals -= 1;
     }
 };
@@ -268,8 +296,8 @@ struct StackDepthFunctor<COMPOSED(HOpcode_LCall, LCall_Lread)> {
 template <>
 struct StackDepthFunctor<COMPOSED(HOpcode_LCall, LCall_Barray), int> {
     StackLayout *layout;
-    inline void operator()(int) {
-        layout->locals += 1;
+    inline void operator()(int n) {
+        layout->locals += 1 - n;
     }
 };
 
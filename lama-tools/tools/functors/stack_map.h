@@ -0,0 +1,264 @@
+#ifndef FUNCTOR_STACK_MAP_H
+#define FUNCTOR_STACK_MAP_H
+
+#include "../opcode.h"
+
+#include <vector>
+
+/* What a stack slot or a local may hold */
+enum SlotKind : unsigned char {
+    Slot_Int,     /* Boxed integers only */
+    Slot_Address, /* An address pushed by LdA */
+    Slot_Value,   /* Any value, possibly a pointer */
+};
+
+struct SlotState {
+    std::vector<SlotKind> stack;
+    std::vector<SlotKind> locals;
+
+    bool operator==(const SlotState &) const = default;
+};
+
+inline void pop_slots(SlotState *state, int n) {
+    state->stack.resize(state->stack.size() - n);
+}
+
+inline SlotKind pop_slot(SlotState *state) {
+    SlotKind kind = state->stack.back();
+    state->stack.pop_back();
+    return kind;
+}
+
+/* Locals loaded by LdA may be stored through their addresses, they are always Slot_Value */
+inline bool is_plain_local(const std::vector<bool> *address_taken, Location kind, int index) {
+    return kind == Location_Local && !(*address_taken)[index];
+}
+
+/*
+ * Tracks kinds of the operand stack and locals of a function. Results of
+ * binops, patterns and other integer-valued instructions are Slot_Int, as well
+ * as locals before their first store (the interpreter fills them with BOX(0)).
+ */
+template <unsigned char opcode, typename... Args>
+struct SlotKindFunctor {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(Args...) {}
+};
+
+template <unsigned char opcode, typename... Args>
+    requires(opcode == Opcode_Const || opcode == COMPOSED(HOpcode_LCall, LCall_Lread))
+struct SlotKindFunctor<opcode, Args...> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(Args...) {
+        state->stack.push_back(Slot_Int);
+    }
+};
+
+template <unsigned char opcode, typename... Args>
+    requires(opcode == Opcode_String || opcode == Opcode_Closure)
+struct SlotKindFunctor<opcode, Args...> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(Args...) {
+        state->stack.push_back(Slot_Value);
+    }
+};
+
+template <unsigned char opcode, typename... Args>
+    requires((opcode >> 4) == HOpcode_Binop || opcode == COMPOSED(HOpcode_Patt, Pattern_String))
+struct SlotKindFunctor<opcode, Args...> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(Args...) {
+        pop_slots(state, 2);
+        state->stack.push_back(Slot_Int);
+    }
+};
+
+template <>
+struct SlotKindFunctor<Opcode_Elem> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()() {
+        pop_slots(state, 2);
+        state->stack.push_back(Slot_Value);
+    }
+};
+
+template <unsigned char opcode, typename... Args>
+    requires(((opcode >> 4) == HOpcode_Patt && (opcode & 0x0F) != Pattern_String) || opcode == Opcode_Tag || opcode == Opcode_Array || opcode == COMPOSED(HOpcode_LCall, LCall_Llength) || opcode == COMPOSED(HOpcode_LCall, LCall_Lwrite))
+struct SlotKindFunctor<opcode, Args...> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(Args...) {
+        pop_slots(state, 1);
+        state->stack.push_back(Slot_Int);
+    }
+};
+
+template <>
+struct SlotKindFunctor<COMPOSED(HOpcode_LCall, LCall_Lstring)> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()() {
+        pop_slots(state, 1);
+        state->stack.push_back(Slot_Value);
+    }
+};
+
+template <unsigned char opcode, typename... Args>
+    requires(opcode == Opcode_Drop || opcode == Opcode_CJmpZ || opcode == Opcode_CJmpNZ || opcode == Opcode_Fail)
+struct SlotKindFunctor<opcode, Args...> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(Args...) {
+        pop_slots(state, 1);
+    }
+};
+
+template <>
+struct SlotKindFunctor<Opcode_SExp, const char *, int> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(const char *, int n) {
+        pop_slots(state, n);
+        state->stack.push_back(Slot_Value);
+    }
+};
+
+template <>
+struct SlotKindFunctor<COMPOSED(HOpcode_LCall, LCall_Barray), int> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(int n) {
+        pop_slots(state, n);
+        state->stack.push_back(Slot_Value);
+    }
+};
+
+template <>
+struct SlotKindFunctor<Opcode_StI> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()() {
+        SlotKind value = pop_slot(state);
+        pop_slots(state, 1);
+        state->stack.push_back(value);
+    }
+};
+
+template <>
+struct SlotKindFunctor<Opcode_StA> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()() {
+        SlotKind value = pop_slot(state);
+        pop_slots(state, 2);
+        state->stack.push_back(value);
+    }
+};
+
+template <>
+struct SlotKindFunctor<Opcode_Dup> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()() {
+        state->stack.push_back(state->stack.back());
+    }
+};
+
+template <>
+struct SlotKindFunctor<Opcode_Swap> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()() {
+        std::swap(state->stack[state->stack.size() - 1], state->stack[state->stack.size() - 2]);
+    }
+};
+
+template <unsigned char opcode>
+    requires(opcode == Opcode_Begin || opcode == Opcode_CBegin)
+struct SlotKindFunctor<opcode, int, int> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(int, int locals_count) {
+        state->stack.clear();
+        state->locals.assign(locals_count, Slot_Int);
+        for (int i = 0; i < locals_count; i++) {
+            if ((*address_taken)[i]) {
+                state->locals[i] = Slot_Value;
+            }
+        }
+    }
+};
+
+template <>
+struct SlotKindFunctor<Opcode_CallC, const char *, int> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(const char *, int args_count) {
+        pop_slots(state, args_count + 1);
+        state->stack.push_back(Slot_Value);
+    }
+};
+
+template <>
+struct SlotKindFunctor<Opcode_Call, const char *, int, int> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(const char *, int, int args_count) {
+        pop_slots(state, args_count);
+        state->stack.push_back(Slot_Value);
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_Ld)
+struct SlotKindFunctor<opcode, int> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(int index) {
+        Location kind = (Location)(opcode & 0x0F);
+        state->stack.push_back(is_plain_local(address_taken, kind, index) ? state->locals[index] : Slot_Value);
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_LdA)
+struct SlotKindFunctor<opcode, int> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(int) {
+        state->stack.push_back(Slot_Address);
+        state->stack.push_back(Slot_Address);
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_St)
+struct SlotKindFunctor<opcode, int> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(int index) {
+        if (is_plain_local(address_taken, (Location)(opcode & 0x0F), index)) {
+            state->locals[index] = state->stack.back();
+        }
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_StDrop)
+struct SlotKindFunctor<opcode, int> {
+    SlotState *state;
+    const std::vector<bool> *address_taken;
+    inline void operator()(int index) {
+        SlotKind value = pop_slot(state);
+        if (is_plain_local(address_taken, (Location)(opcode & 0x0F), index)) {
+            state->locals[index] = value;
+        }
+    }
+};
+
+#endif // FUNCTOR_STACK_MAP_H
@@ -51,6 +51,18 @@ struct SuccessorsFunctor<Opcode_CJmpZ, int> {
     }
 };
 
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_CmpJmpZ || (opcode >> 4) == HOpcode_CmpJmpNZ)
+struct SuccessorsFunctor<opcode, int> {
+    const char *code_ptr;
+    const char *next;
+    std::vector<const char *> *successors;
+
+    void operator()(int target) {
+        *successors = {next, code_ptr + target};
+    }
+};
+
 template <>
 struct SuccessorsFunctor<Opcode_Call, const char *, int, int> {
     const char *code_ptr;
@@ -63,12 +75,12 @@ struct SuccessorsFunctor<Opcode_Call, const char *, int, int> {
 };
 
 template <>
-struct SuccessorsFunctor<Opcode_Closure, int, std::vector<LocationEntry>> {
+struct SuccessorsFunctor<Opcode_Closure, int, CaptureList> {
     const char *code_ptr;
     const char *next;
     std::vector<const char *> *successors;
 
-    void operator()(int offset, std::vector<LocationEntry>) {
+    void operator()(int offset, CaptureList) {
         *successors = {code_ptr + offset, next};
     }
 };
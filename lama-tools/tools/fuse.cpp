@@ -0,0 +1,42 @@
+#include "fuse.h"
+#include "bytefile.h"
+#include "cfg.h"
+#include "functors/default.h"
+#include "inst_reader.h"
+#include "opcode.h"
+
+#include <vector>
+
+static inline bool is_comparison(unsigned char opcode) {
+    return (opcode >> 4) == HOpcode_Binop &&
+           (opcode & 0x0F) >= Binop_LessThan && (opcode & 0x0F) <= Binop_NotEqual;
+}
+
+bytefile *fuse_compare_branches(const bytefile *file) {
+    std::vector<bool> jump, label;
+    mark_jumps(file, &jump, &label);
+
+    bytefile *fused = copy_bytefile(file);
+    const char *code_begin = file->code_ptr;
+    const char *code_end = file->code_ptr + get_code_size(file);
+    InstReader reader(file);
+
+    for (const char *ip = code_begin; ip != code_end;) {
+        const char *next = reader.read_inst<DefaultFunctor>(ip);
+        if (next == code_end || !is_comparison(*ip) || label[next - code_begin]) {
+            ip = next;
+            continue;
+        }
+
+        // the jump after it stays in place and supplies the target
+        unsigned char binop = *ip & 0x0F;
+        char *fused_ip = fused->code_ptr + (ip - code_begin);
+        if (*next == Opcode_CJmpZ) {
+            *fused_ip = COMPOSED(HOpcode_CmpJmpZ, binop);
+        } else if (*next == Opcode_CJmpNZ) {
+            *fused_ip = COMPOSED(HOpcode_CmpJmpNZ, binop);
+        }
+        ip = next;
+    }
+    return fused;
+}
@@ -0,0 +1,15 @@
+#ifndef FUSE_H
+#define FUSE_H
+
+#include "bytefile.h"
+
+/*
+ * Returns a copy of `file` in which each comparison followed by CJMPz or CJMPnz
+ * is a fused compare-and-branch, unless the jump is a target of another one;
+ * `file` itself is not changed. Offsets are kept, so results of analyses of `file`
+ * apply to the copy, but the copy is meant for the interpreter only: analyses
+ * expect plain bytecode.
+ */
+bytefile *fuse_compare_branches(const bytefile *file);
+
+#endif // FUSE_H
@@ -0,0 +1,437 @@
+#include "error.h"
+extern "C" {
+#include "../runtime/gc.h"
+}
+
+#include <algorithm>
+#include <errno.h>
+#include <iomanip>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Reads a heap snapshot written by gc_heap_snapshot and reports where the memory goes:
+ * shallow sizes by type and s-expression tag, and objects retaining the most memory.
+ * The retained size of an object is the total size of objects reachable only through it,
+ * i.e. of its subtree in the dominator tree of the graph rooted at all roots at once.
+ */
+
+namespace {
+
+struct CommandLine {
+    const char *input = nullptr;
+    size_t top = 20;
+};
+
+CommandLine parse_command_line(int argc, const char *argv[]) {
+    CommandLine cl;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            ASSERT(i + 1 < argc, 1, "-n expects a number of objects");
+            char *end;
+            cl.top = strtoul(argv[++i], &end, 10);
+            ASSERT(*end == '\0', 1, "Invalid number %s", argv[i]);
+        } else if (argv[i][0] == '-') {
+            FAIL(1, "Unknown option %s", argv[i]);
+        } else {
+            ASSERT(cl.input == nullptr, 1, "Only one input file is expected");
+            cl.input = argv[i];
+        }
+    }
+    ASSERT(cl.input != nullptr, 1, "Usage: %s <file.heap> [-n <count>]", argv[0]);
+    return cl;
+}
+
+struct Object {
+    uint64_t id;
+    unsigned char type;
+    unsigned char space;
+    uint32_t size;
+    uint32_t tag;
+    size_t refs_begin, refs_end; /* Range of Snapshot::refs */
+};
+
+struct Root {
+    unsigned char kind;
+    uint32_t slot;
+    uint64_t id;
+};
+
+struct Snapshot {
+    std::vector<Object> objects;
+    std::vector<uint64_t> refs; /* Ids of referenced objects, by object */
+    std::vector<Root> roots;
+};
+
+class SnapshotReader {
+public:
+    explicit SnapshotReader(const std::vector<char> &data) : data(data) {}
+
+    Snapshot read() {
+        ASSERT(data.size() >= 8 && memcmp(data.data(), HEAP_SNAPSHOT_MAGIC, 8) == 0, 1, "Not a heap snapshot");
+        pos = 8;
+        uint32_t version = read_u32();
+        ASSERT(version == HEAP_SNAPSHOT_VERSION, 1, "Unsupported snapshot version %u", version);
+        word_size = read_u32();
+        ASSERT(word_size == 4 || word_size == 8, 1, "Unsupported pointer size %u", word_size);
+
+        Snapshot snapshot;
+        for (unsigned char record = read_byte(); record != SNAPSHOT_END; record = read_byte()) {
+            if (record == SNAPSHOT_OBJECT) {
+                Object object;
+                object.type = read_byte();
+                object.space = read_byte();
+                object.id = read_word();
+                object.size = read_u32();
+                object.tag = read_u32();
+                uint32_t refs = read_u32();
+                object.refs_begin = snapshot.refs.size();
+                for (uint32_t i = 0; i < refs; i++) {
+                    snapshot.refs.push_back(read_word());
+                }
+                object.refs_end = snapshot.refs.size();
+                snapshot.objects.push_back(object);
+            } else if (record == SNAPSHOT_ROOT) {
+                Root root;
+                root.kind = read_byte();
+                root.slot = read_u32();
+                root.id = read_word();
+                snapshot.roots.push_back(root);
+            } else {
+                FAIL(1, "Unknown record %d at %zu", record, pos - 1);
+            }
+        }
+        return snapshot;
+    }
+
+private:
+    const std::vector<char> &data;
+    size_t pos = 0;
+    uint32_t word_size = 0;
+
+    void assert_can_read(size_t n) {
+        ASSERT(pos + n <= data.size(), 1, "Unexpected end of snapshot");
+    }
+
+    unsigned char read_byte() {
+        assert_can_read(1);
+        return data[pos++];
+    }
+
+    uint32_t read_u32() {
+        uint32_t value;
+        assert_can_read(sizeof(value));
+        memcpy(&value, &data[pos], sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+
+    uint64_t read_word() {
+        if (word_size == 4) {
+            return read_u32();
+        }
+        uint64_t value;
+        assert_can_read(sizeof(value));
+        memcpy(&value, &data[pos], sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+};
+
+std::vector<char> read_bytes(const char *fname) {
+    FILE *f = fopen(fname, "rb");
+    if (f == nullptr) {
+        FAIL(1, "%s\n", strerror(errno));
+    }
+    std::vector<char> data;
+    char chunk[1 << 16];
+    for (size_t n; (n = fread(chunk, 1, sizeof(chunk), f)) > 0;) {
+        data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(f);
+    return data;
+}
+
+/*
+ * The object graph with a virtual root (vertex 0) referencing all roots,
+ * objects are vertices from 1 in the order of the snapshot.
+ */
+struct Graph {
+    std::vector<size_t> begin; /* Edges of vertex v are succ[begin[v]..begin[v + 1]) */
+    std::vector<int> succ;
+};
+
+Graph build_graph(const Snapshot &snapshot) {
+    std::unordered_map<uint64_t, int> vertex;
+    vertex.reserve(snapshot.objects.size());
+    for (size_t i = 0; i < snapshot.objects.size(); i++) {
+        vertex[snapshot.objects[i].id] = i + 1;
+    }
+    // references to objects missing from the snapshot (e.g. stale stack slots) are dropped
+    auto add_edge = [&](Graph &g, uint64_t id) {
+        auto it = vertex.find(id);
+        if (it != vertex.end()) {
+            g.succ.push_back(it->second);
+        }
+    };
+
+    Graph g;
+    g.begin.push_back(0);
+    for (const Root &root : snapshot.roots) {
+        add_edge(g, root.id);
+    }
+    g.begin.push_back(g.succ.size());
+    for (const Object &object : snapshot.objects) {
+        for (size_t i = object.refs_begin; i < object.refs_end; i++) {
+            add_edge(g, snapshot.refs[i]);
+        }
+        g.begin.push_back(g.succ.size());
+    }
+    return g;
+}
+
+/*
+ * Immediate dominators by the Lengauer-Tarjan algorithm with path compression,
+ * -1 for vertices unreachable from the virtual root (and for the root itself).
+ * Recursion is replaced with explicit stacks: object graphs are deep.
+ */
+class Dominators {
+public:
+    explicit Dominators(const Graph &g) : g(g) {
+        size_t n = g.begin.size() - 1;
+        number.assign(n, -1);
+        dfs();
+
+        size_t reached = vertex.size();
+        std::vector<std::vector<int>> pred(reached);
+        for (size_t w = 0; w < reached; w++) {
+            int v = vertex[w];
+            for (size_t e = g.begin[v]; e < g.begin[v + 1]; e++) {
+                pred[number[g.succ[e]]].push_back(w);
+            }
+        }
+
+        semi.resize(reached);
+        label.resize(reached);
+        ancestor.assign(reached, -1);
+        std::vector<int> dom(reached, 0);
+        std::vector<std::vector<int>> bucket(reached);
+        for (size_t w = 0; w < reached; w++) {
+            semi[w] = label[w] = w;
+        }
+
+        for (int w = reached - 1; w > 0; w--) {
+            for (int v : pred[w]) {
+                semi[w] = std::min(semi[w], semi[eval(v)]);
+            }
+            bucket[semi[w]].push_back(w);
+            int p = parent[w];
+            ancestor[w] = p;
+            for (int v : bucket[p]) {
+                int u = eval(v);
+                dom[v] = semi[u] < semi[v] ? u : p;
+            }
+            bucket[p].clear();
+        }
+        for (size_t w = 1; w < reached; w++) {
+            if (dom[w] != semi[w]) {
+                dom[w] = dom[dom[w]];
+            }
+        }
+
+        idom.assign(n, -1);
+        for (size_t w = 1; w < reached; w++) {
+            idom[vertex[w]] = vertex[dom[w]];
+        }
+    }
+
+    std::vector<int> idom;
+    std::vector<int> vertex; /* Reached vertices in DFS preorder, dominators go first */
+
+private:
+    const Graph &g;
+    std::vector<int> number, parent; /* By vertex, by DFS number */
+    std::vector<int> semi, label, ancestor; /* By DFS number */
+
+    void dfs() {
+        std::vector<std::pair<int, size_t>> stack = {{0, g.begin[0]}};
+        number[0] = 0;
+        vertex.push_back(0);
+        parent.push_back(-1);
+        while (!stack.empty()) {
+            auto &[v, e] = stack.back();
+            if (e == g.begin[v + 1]) {
+                stack.pop_back();
+                continue;
+            }
+            int w = g.succ[e++];
+            if (number[w] < 0) {
+                number[w] = vertex.size();
+                vertex.push_back(w);
+                parent.push_back(number[v]);
+                stack.push_back({w, g.begin[w]});
+            }
+        }
+    }
+
+    int eval(int v) {
+        if (ancestor[v] < 0) {
+            return v;
+        }
+        compress(v);
+        return label[v];
+    }
+
+    void compress(int v) {
+        std::vector<int> path;
+        for (int u = v; ancestor[ancestor[u]] >= 0; u = ancestor[u]) {
+            path.push_back(u);
+        }
+        while (!path.empty()) {
+            int u = path.back();
+            path.pop_back();
+            int a = ancestor[u];
+            if (semi[label[a]] < semi[label[u]]) {
+                label[u] = label[a];
+            }
+            ancestor[u] = ancestor[a];
+        }
+    }
+};
+
+/* Same as de_hash of the runtime */
+std::string tag_name(uint32_t hash) {
+    static const char chars[] = "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789'";
+    std::string name;
+    for (; hash != 0; hash >>= 6) {
+        name.insert(name.begin(), chars[hash & 0x3F]);
+    }
+    return name;
+}
+
+std::string describe(const Object &object) {
+    switch (object.type) {
+    case ARRAY:
+        return "array";
+    case CLOSURE:
+        return "closure";
+    case STRING:
+        return "string";
+    case SEXP:
+        return "sexp " + tag_name(object.tag);
+    default:
+        return "unknown";
+    }
+}
+
+std::string describe(const Root &root) {
+    static const char *kinds[] = {"stack", "extra root", "global", "scoped"};
+    return std::string(root.kind < 4 ? kinds[root.kind] : "root") + " " + std::to_string(root.slot);
+}
+
+struct Group {
+    size_t count = 0;
+    uint64_t size = 0;
+};
+
+void print_groups(const Snapshot &snapshot, const std::vector<bool> &reachable, size_t top) {
+    std::unordered_map<std::string, Group> groups;
+    for (size_t i = 0; i < snapshot.objects.size(); i++) {
+        if (reachable[i + 1]) {
+            Group &group = groups[describe(snapshot.objects[i])];
+            group.count++;
+            group.size += snapshot.objects[i].size;
+        }
+    }
+    std::vector<std::pair<std::string, Group>> sorted(groups.begin(), groups.end());
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+        return a.second.size > b.second.size;
+    });
+
+    std::cout << "Live objects by type:" << std::endl;
+    std::cout << std::setw(12) << "count" << std::setw(14) << "bytes" << "  type" << std::endl;
+    for (size_t i = 0; i < sorted.size() && i < top; i++) {
+        std::cout << std::setw(12) << sorted[i].second.count << std::setw(14) << sorted[i].second.size << "  "
+                  << sorted[i].first << std::endl;
+    }
+}
+
+void print_retainers(const Snapshot &snapshot, const Dominators &dominators, size_t top) {
+    size_t n = snapshot.objects.size() + 1;
+    std::vector<uint64_t> retained(n, 0);
+    for (size_t i = 0; i < snapshot.objects.size(); i++) {
+        retained[i + 1] = snapshot.objects[i].size;
+    }
+    // a dominator precedes the vertices it dominates in DFS preorder
+    for (size_t k = dominators.vertex.size() - 1; k > 0; k--) {
+        int v = dominators.vertex[k];
+        retained[dominators.idom[v]] += retained[v];
+    }
+
+    // the first root referencing an object, objects dominated only by the virtual root
+    // but not referenced by roots are shared by several of them
+    std::unordered_map<uint64_t, const Root *> held_by;
+    for (const Root &root : snapshot.roots) {
+        held_by.emplace(root.id, &root);
+    }
+
+    std::vector<int> sorted(dominators.vertex.begin() + 1, dominators.vertex.end());
+    size_t count = std::min(top, sorted.size());
+    std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(), [&](int a, int b) {
+        return retained[a] > retained[b];
+    });
+
+    std::cout << "Top retainers:" << std::endl;
+    std::cout << std::setw(12) << "retained" << std::setw(12) << "shallow" << "  object" << std::endl;
+    for (size_t i = 0; i < count; i++) {
+        int v = sorted[i];
+        const Object &object = snapshot.objects[v - 1];
+        int top_dominator = v;
+        while (dominators.idom[top_dominator] != 0) {
+            top_dominator = dominators.idom[top_dominator];
+        }
+        auto root = held_by.find(snapshot.objects[top_dominator - 1].id);
+
+        std::cout << std::setw(12) << retained[v] << std::setw(12) << object.size << "  " << describe(object)
+                  << " at 0x" << std::hex << object.id << std::dec << ", held by "
+                  << (root != held_by.end() ? describe(*root->second) : "several roots");
+        if (top_dominator != v) {
+            std::cout << " through 0x" << std::hex << snapshot.objects[top_dominator - 1].id << std::dec;
+        }
+        std::cout << std::endl;
+    }
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]) {
+    CommandLine cl = parse_command_line(argc, argv);
+    std::vector<char> data = read_bytes(cl.input);
+    Snapshot snapshot = SnapshotReader(data).read();
+
+    Graph graph = build_graph(snapshot);
+    Dominators dominators(graph);
+
+    std::vector<bool> reachable(graph.begin.size() - 1, false);
+    for (int v : dominators.vertex) {
+        reachable[v] = true;
+    }
+    uint64_t total = 0, live = 0;
+    for (size_t i = 0; i < snapshot.objects.size(); i++) {
+        total += snapshot.objects[i].size;
+        live += reachable[i + 1] ? snapshot.objects[i].size : 0;
+    }
+
+    std::cout << "Objects: " << snapshot.objects.size() << ", " << total << " bytes" << std::endl;
+    std::cout << "Live: " << dominators.vertex.size() - 1 << ", " << live << " bytes" << std::endl;
+    std::cout << "Roots: " << snapshot.roots.size() << std::endl;
+    std::cout << std::endl;
+    print_groups(snapshot, reachable, cl.top);
+    std::cout << std::endl;
+    print_retainers(snapshot, dominators, cl.top);
+}
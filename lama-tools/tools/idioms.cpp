@@ -0,0 +1,50 @@
+#include "idioms.h"
+#include "bytefile.h"
+#include "functors/print_inst.h"
+#include "inst_reader.h"
+
+#include <algorithm>
+#include <vector>
+
+int compare_idioms(const Idiom &fst, const Idiom &snd) {
+    for (size_t i = 0; fst.begin + i != fst.end && snd.begin + i != snd.end; i++) {
+        if (fst.begin[i] != snd.begin[i])
+            return (int)(fst.begin[i]) - (int)(snd.begin[i]);
+    }
+    return (int)(fst.end - fst.begin) - (int)(snd.end - snd.begin);
+}
+
+void merge_idiom_groups(std::vector<IdiomGroup> *groups) {
+    std::sort(groups->begin(), groups->end(), [](const IdiomGroup &fst, const IdiomGroup &snd) {
+        return compare_idioms(fst.idiom, snd.idiom) < 0;
+    });
+
+    std::vector<IdiomGroup> merged;
+    for (const IdiomGroup &group : *groups) {
+        if (merged.empty() || compare_idioms(group.idiom, merged.back().idiom) != 0) {
+            merged.push_back(group);
+        } else {
+            merged.back().count += group.count;
+        }
+    }
+    *groups = std::move(merged);
+}
+
+void print_idiom_groups(const bytefile *file, std::vector<IdiomGroup> groups, std::ostream &out) {
+    std::sort(groups.begin(), groups.end(), [](const IdiomGroup &fst, const IdiomGroup &snd) {
+        return fst.count > snd.count;
+    });
+
+    InstReader reader(file);
+    size_t index = 0;
+    for (const auto &[idiom, count] : groups) {
+        out << "#" << ++index << ": " << count << " times";
+        for (const char *ip = idiom.begin; ip != idiom.end;) {
+            TextBuffer text;
+            ip = reader.read_inst<PrinterFunctor, TextBuffer *>(ip, &text);
+            out << "\n\t";
+            text.write(out);
+        }
+        out << "\n";
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef IDIOMS_H
+#define IDIOMS_H
+
+#include "bytefile.h"
+
+#include <ostream>
+#include <vector>
+
+/* A sequence of instructions occupying [begin, end) of the code section */
+struct Idiom {
+    const char *begin;
+    const char *end;
+};
+
+struct IdiomGroup {
+    Idiom idiom;
+    size_t count;
+};
+
+/* Orders idioms by their bytes, so equal idioms are adjacent */
+int compare_idioms(const Idiom &fst, const Idiom &snd);
+
+/* Merges groups of equal idioms, summing their counts */
+void merge_idiom_groups(std::vector<IdiomGroup> *groups);
+
+/* Prints groups from the most frequent one, in the format of bcstats */
+void print_idiom_groups(const bytefile *file, std::vector<IdiomGroup> groups, std::ostream &out);
+
+#endif // IDIOMS_H
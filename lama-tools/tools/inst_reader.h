@@ -41,10 +41,13 @@ private:
         return get_string(file, read_int());
     }
 
-    inline LocationEntry read_loc() {
-        Location kind = (Location)read_byte();
-        int index = read_int();
-        return LocationEntry{kind, index};
+    inline CaptureList read_captures() {
+        int n = read_int();
+        ASSERT(n >= 0, 1, "negative number of captured locations %d", n);
+        assert_can_read(n * CaptureList::entry_size);
+        CaptureList captured(ip, n);
+        ip += n * CaptureList::entry_size;
+        return captured;
     }
 
 public:
@@ -153,14 +156,8 @@ public:
 
         case Opcode_Closure: {
             int entry = read_int();
-            std::vector<LocationEntry> captured;
-            {
-                int n = read_int();
-                for (int i = 0; i < n; i++) {
-                    captured.push_back(read_loc());
-                }
-            }
-            (Functor<SINGLE(Opcode_Closure), int, std::vector<LocationEntry>>{args...})(entry, captured);
+            CaptureList captured = read_captures();
+            (Functor<SINGLE(Opcode_Closure), int, CaptureList>{args...})(entry, captured);
             break;
         }
 
@@ -210,6 +207,13 @@ public:
         (Functor<COMPOSED(HOpcode_Binop, Binop_Code)>{args...})(); \
         break;
 
+#define CASE_QUICK_BINOP(hi, Binop_Code)                \
+    case Binop_Code:                                    \
+        (Functor<COMPOSED(hi, Binop_Code)>{args...})(); \
+        break;
+#define CASE_BINOP_INT(Binop_Code, op) CASE_QUICK_BINOP(HOpcode_BinopInt, Binop_Code)
+#define CASE_BINOP_ANY(Binop_Code, op) CASE_QUICK_BINOP(HOpcode_BinopAny, Binop_Code)
+
             switch (h) {
             case HOpcode_Binop: {
                 switch (l) {
@@ -217,7 +221,22 @@ public:
                 }
                 break;
             }
+            case HOpcode_BinopInt: {
+                switch (l) {
+                    BINOPS(CASE_BINOP_INT)
+                }
+                break;
+            }
+            case HOpcode_BinopAny: {
+                switch (l) {
+                    BINOPS(CASE_BINOP_ANY)
+                }
+                break;
+            }
 #undef CASE_BINOP
+#undef CASE_BINOP_INT
+#undef CASE_BINOP_ANY
+#undef CASE_QUICK_BINOP
 
 #define CASE_LOCATION(hi, location, _)                               \
     case location:                                                   \
@@ -242,6 +261,12 @@ public:
                 }
                 break;
             }
+            case HOpcode_StDrop: {
+                switch (l) {
+                    LOCATIONS(HOpcode_StDrop, CASE_LOCATION)
+                }
+                break;
+            }
 #undef CASE_LOCATION
 
 #define CASE_PATTERN(pattern, _)                               \
@@ -288,6 +313,33 @@ public:
                 (Functor<COMPOSED(HOpcode_Stop, 0)>{args...})();
                 break;
             }
+
+#define CASE_CMP_JMP(hi, Binop_Code)                                  \
+    case Binop_Code: {                                                \
+        read_byte();                                                  \
+        int target = read_int();                                      \
+        (Functor<COMPOSED(hi, Binop_Code), int>{args...})(target);    \
+        break;                                                        \
+    }
+#define CASE_CMP_JMP_Z(Binop_Code, op) CASE_CMP_JMP(HOpcode_CmpJmpZ, Binop_Code)
+#define CASE_CMP_JMP_NZ(Binop_Code, op) CASE_CMP_JMP(HOpcode_CmpJmpNZ, Binop_Code)
+
+            // the fused jump keeps its opcode byte, so it can still be read by itself
+            case HOpcode_CmpJmpZ: {
+                switch (l) {
+                    BINOPS(CASE_CMP_JMP_Z)
+                }
+                break;
+            }
+            case HOpcode_CmpJmpNZ: {
+                switch (l) {
+                    BINOPS(CASE_CMP_JMP_NZ)
+                }
+                break;
+            }
+#undef CASE_CMP_JMP
+#undef CASE_CMP_JMP_Z
+#undef CASE_CMP_JMP_NZ
             default:
                 FAIL(1, "Unknown opcode %d\n", x);
             }
@@ -1,23 +1,55 @@
 #include "interprete.h"
 #include "../runtime/runtime_common.h"
+extern "C" {
+#include "../runtime/gc.h"
+}
 #include "bytefile.h"
 #include "error.h"
 #include "inst_reader.h"
 #include "opcode.h"
-
+#include "register_ir.h"
+#include "stack_map.h"
+
+#ifdef PROFILE_MODE
+#include "functors/default.h"
+#include "functors/print_inst.h"
+#include "cfg.h"
+#include "idioms.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#endif // PROFILE_MODE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
-#define VSTACK_SIZE 65536
-#define CSTACK_SIZE 65536
+/*
+ * The virtual stack grows down from the end of a lazily committed mapping.
+ * Overflow is caught by a guard area below it instead of checks on each push;
+ * the guard must be larger than the biggest possible frame (see FRAME_MAX_COUNT).
+ */
+#define VSTACK_GUARD_SIZE (1 << 19)
 
 namespace {
 
-extern "C" size_t *__gc_stack_top;
-extern "C" size_t *__gc_stack_bottom;
+extern "C" THREAD_LOCAL size_t *__gc_stack_top;
+extern "C" THREAD_LOCAL size_t *__gc_stack_bottom;
 
-static size_t __vstack_globals_count;
-static size_t __vstack[VSTACK_SIZE];
+static thread_local size_t __vstack_globals_count;
+static thread_local unsigned char *__vstack_global_cards; /* Root cards of globals, see gc_set_root_cards */
+static thread_local size_t *__vstack; /* Lowest usable slot, right above the guard area */
+static thread_local char *__vstack_mapping;
+static struct sigaction __vstack_prev_segv; /* Process-wide as the handler itself, set once */
+static std::once_flag __vstack_segv_installed;
 
 static inline size_t vstack_load(size_t *ptr) {
     ASSERT(ptr < __gc_stack_bottom, 1, "Virtual stack underflow");
@@ -25,19 +57,88 @@ static inline size_t vstack_load(size_t *ptr) {
     return *ptr;
 }
 
-static inline void vstack_init() {
-    __gc_stack_bottom = __vstack + VSTACK_SIZE;
+static void vstack_segv_handler(int signo, siginfo_t *info, void *extra) {
+    char *addr = (char *)info->si_addr;
+    if (__vstack_mapping <= addr && addr < (char *)__vstack) {
+        static const char message[] = "Virtual stack overflow\n";
+        write(STDERR_FILENO, message, sizeof(message) - 1);
+        _exit(1);
+    }
+
+    // not ours: pass to the handler installed before
+    if (__vstack_prev_segv.sa_flags & SA_SIGINFO) {
+        __vstack_prev_segv.sa_sigaction(signo, info, extra);
+    } else if (__vstack_prev_segv.sa_handler != SIG_DFL && __vstack_prev_segv.sa_handler != SIG_IGN) {
+        __vstack_prev_segv.sa_handler(signo);
+    } else {
+        // the faulting instruction is restarted and fails with the default action
+        sigaction(SIGSEGV, &__vstack_prev_segv, NULL);
+    }
+}
+
+/*
+ * Installed once for all threads: `__init` of the runtime installs its own handler
+ * only the first time as well, ours is put in front of it.
+ */
+static void vstack_install_segv_handler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_flags = SA_SIGINFO;
+    action.sa_sigaction = vstack_segv_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &__vstack_prev_segv);
+}
+
+static inline void vstack_init(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+
+    __vstack_mapping = (char *)mmap(NULL, VSTACK_GUARD_SIZE + size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    ASSERT(__vstack_mapping != MAP_FAILED, 1, "Cannot reserve %u bytes for virtual stack", size);
+    ASSERT(mprotect(__vstack_mapping, VSTACK_GUARD_SIZE, PROT_NONE) == 0, 1, "Cannot protect virtual stack guard");
+
+    __vstack = (size_t *)(__vstack_mapping + VSTACK_GUARD_SIZE);
+    __gc_stack_bottom = (size_t *)(__vstack_mapping + VSTACK_GUARD_SIZE + size);
     __gc_stack_top = __gc_stack_bottom - 1;
+
+    std::call_once(__vstack_segv_installed, vstack_install_segv_handler);
+}
+
+static inline void vstack_release() {
+    munmap(__vstack_mapping, (char *)__gc_stack_bottom - __vstack_mapping);
+    __vstack_mapping = nullptr;
+    __vstack = nullptr;
+    __vstack_globals_count = 0;
+    gc_set_root_cards(NULL, NULL, NULL);
+    free(__vstack_global_cards);
+    __vstack_global_cards = nullptr;
 }
 
+/* Globals are the deepest slots, the GC scans only their cards which may hold pointers */
 static inline void vstack_alloc_globals(size_t count) {
-    ASSERT(VSTACK_SIZE >= count, 1, "Cannot allocate memory for globals");
+    ASSERT(__gc_stack_bottom - __vstack > count, 1, "Cannot allocate memory for globals");
     __gc_stack_top -= count;
     __vstack_globals_count = count;
+
+    __vstack_global_cards = (unsigned char *)calloc((count >> ROOT_CARD_SHIFT) + 1, 1);
+    ASSERT(__vstack_global_cards != nullptr, 1, "Cannot allocate memory for cards of globals");
+    gc_set_root_cards(__gc_stack_bottom - count, __gc_stack_bottom, __vstack_global_cards);
+}
+
+/* Has to be called before a value is stored into a global */
+static inline void global_card_mark(size_t *slot) {
+    __vstack_global_cards[(slot - (__gc_stack_bottom - __vstack_globals_count)) >> ROOT_CARD_SHIFT] = 1;
+}
+
+/* Stores through addresses (from LdA) may write globals */
+static inline void store_barrier(size_t *addr) {
+    if (__gc_stack_bottom - __vstack_globals_count <= addr && addr < __gc_stack_bottom) {
+        global_card_mark(addr);
+    }
 }
 
 static inline void vstack_push(size_t value) {
-    ASSERT(__gc_stack_top > __vstack, 1, "Virtual stack overflow");
     *(__gc_stack_top--) = value;
 }
 
@@ -76,97 +177,403 @@ enum IpAdvance {
     Jump
 };
 
-struct {
+struct Registers;
+
+struct InterpreterState {
     const char *file_name;
-    const bytefile *file;
+    const bytefile *file; /* The code being run, see InterpreterOptions::code */
+    bool quickening;      /* Whether the code may be rewritten */
+    const char *inst;
     IpAdvance advance;
     const char *jump_target;
-} interpreter;
+    const std::vector<bool> *scoped_sexps;
+    const std::vector<bool> *tail_calls;
+    const StackMaps *stack_maps;
+    const Registers *regs; /* Registers of the dispatch loop while it runs */
+    bool stopped;
+    size_t executed;
+};
+
+thread_local InterpreterState interpreter;
+
+/*
+ * Interned string literals, indexed by offset in the string table.
+ * All executions of a literal share one string, a mutation of it is seen
+ * through each of them (see InterpreterOptions::intern_strings).
+ */
+struct LiteralPool {
+    bool enabled;
+    std::vector<void *> interned;
+};
+
+thread_local LiteralPool literals;
+
+#ifdef PROFILE_MODE
+/*
+ * Dynamic counts of executed instructions. A sequence is an execution of an
+ * instruction right after the one preceding it in the code, without a jump.
+ * Opcodes are taken from the unmodified file, so fused and quickened instructions
+ * are counted as they are in it, as bcstats sees them.
+ */
+struct Profile {
+    std::vector<size_t> executions;  /* By offset */
+    std::vector<size_t> sequences;   /* By offset of the second instruction */
+    std::vector<size_t> transitions; /* By (previous opcode << 8) | opcode */
+    const char *code;                /* Code of the unmodified file */
+    const char *prev;
+    const char *prev_end;
+    unsigned char prev_opcode;
+};
+
+thread_local Profile profile;
+
+static inline void profile_init(const bytefile *file) {
+    profile.executions.assign(get_code_size(file), 0);
+    profile.sequences.assign(get_code_size(file), 0);
+    profile.transitions.assign(1 << 16, 0);
+    profile.code = file->code_ptr;
+    profile.prev = nullptr;
+    profile.prev_end = nullptr;
+}
+
+static inline void profile_count(const char *ip, const char *next) {
+    size_t offset = ip - interpreter.file->code_ptr;
+    unsigned char opcode = profile.code[offset];
+    profile.executions[offset]++;
+    if (profile.prev != nullptr) {
+        profile.transitions[(profile.prev_opcode << 8) | opcode]++;
+        if (profile.prev_end == ip) {
+            profile.sequences[offset]++;
+        }
+    }
+    profile.prev = ip;
+    profile.prev_end = next;
+    profile.prev_opcode = opcode;
+}
+
+/* A fused comparison runs both the comparison and the jump after it, each is counted */
+static inline void profile_inst(const char *ip, const char *next) {
+    unsigned char h = (unsigned char)*ip >> 4;
+    if (h == HOpcode_CmpJmpZ || h == HOpcode_CmpJmpNZ) {
+        profile_count(ip, ip + 1);
+        profile_count(ip + 1, next);
+    } else {
+        profile_count(ip, next);
+    }
+}
+
+/*
+ * Writes idioms (single instructions and sequences of two), opcodes, opcode transitions
+ * and offsets in the format of bcstats, each section starting with its title.
+ */
+static void profile_dump(const bytefile *file, std::ostream &out) {
+    InstReader reader(file);
+    const char *code_begin = file->code_ptr;
+    const char *code_end = file->code_ptr + get_code_size(file);
+
+    std::vector<bool> jump, label;
+    mark_jumps(file, &jump, &label);
+
+    // instructions with equal bytes are grouped as bcstats does it
+    std::vector<IdiomGroup> idioms;
+    std::vector<size_t> opcodes(1 << 8, 0);
+    std::vector<const char *> samples(1 << 8, nullptr); /* An instruction for each opcode */
+    std::vector<std::pair<size_t, const char *>> offsets;
+    for (const char *ip = code_begin, *prev = nullptr; ip != code_end;) {
+        const char *next = reader.read_inst<DefaultFunctor>(ip);
+        size_t offset = ip - code_begin;
+        size_t count = profile.executions[offset];
+        if (count != 0) {
+            unsigned char opcode = *ip;
+            idioms.push_back({Idiom{ip, next}, count});
+            opcodes[opcode] += count;
+            samples[opcode] = ip;
+            offsets.push_back({count, ip});
+        }
+        if (prev != nullptr && !jump[prev - code_begin] && !label[offset] && profile.sequences[offset] != 0) {
+            idioms.push_back({Idiom{prev, next}, profile.sequences[offset]});
+        }
+        prev = ip;
+        ip = next;
+    }
+
+    merge_idiom_groups(&idioms);
+    out << "Idioms:\n";
+    print_idiom_groups(file, std::move(idioms), out);
+
+    std::vector<std::pair<size_t, int>> opcode_counts;
+    for (int opcode = 0; opcode < (1 << 8); opcode++) {
+        if (opcodes[opcode] != 0) {
+            opcode_counts.push_back({opcodes[opcode], opcode});
+        }
+    }
+    std::stable_sort(opcode_counts.begin(), opcode_counts.end(), [](const auto &fst, const auto &snd) {
+        return fst.first > snd.first;
+    });
+    out << "Opcodes:\n";
+    size_t index = 0;
+    for (const auto &[count, opcode] : opcode_counts) {
+        out << "#" << ++index << ": " << count << " times\n\t";
+        reader.read_inst<OpcodeNameFunctor, std::ostream &>(samples[opcode], out);
+        out << "\n";
+    }
+
+    std::vector<std::pair<size_t, int>> transitions;
+    for (int pair = 0; pair < (1 << 16); pair++) {
+        if (profile.transitions[pair] != 0) {
+            transitions.push_back({profile.transitions[pair], pair});
+        }
+    }
+    std::stable_sort(transitions.begin(), transitions.end(), [](const auto &fst, const auto &snd) {
+        return fst.first > snd.first;
+    });
+    out << "Transitions:\n";
+    index = 0;
+    for (const auto &[count, pair] : transitions) {
+        out << "#" << ++index << ": " << count << " times\n\t";
+        reader.read_inst<OpcodeNameFunctor, std::ostream &>(samples[pair >> 8], out);
+        out << "\n\t";
+        reader.read_inst<OpcodeNameFunctor, std::ostream &>(samples[pair & 0xFF], out);
+        out << "\n";
+    }
+
+    std::stable_sort(offsets.begin(), offsets.end(), [](const auto &fst, const auto &snd) {
+        return fst.first > snd.first;
+    });
+    out << "Offsets:\n";
+    index = 0;
+    for (const auto &[count, ip] : offsets) {
+        out << "#" << ++index << ": " << count << " times\n\t"
+            << "0x" << std::hex << ip - code_begin << std::dec << "\t";
+        TextBuffer text;
+        reader.read_inst<PrinterFunctor, TextBuffer *>(ip, &text);
+        text.write(out);
+        out << "\n";
+    }
+}
+#endif // PROFILE_MODE
+
+/*
+ * Frames live on the virtual stack right below the arguments:
+ *
+ *     A(0) ... A(n-1) | return ip | previous fp | region mark | meta | L(0) ... L(m-1) | operands
+ *                                                               ^ fp
+ *
+ * `meta` is a boxed word packing the closure flag and counts of locals and arguments.
+ * Registers of the current frame are kept by the dispatch loop and passed to functors.
+ */
+enum FrameSlot {
+    Frame_Meta = 0,
+    Frame_RegionMark = 1,
+    Frame_PrevFp = 2,
+    Frame_ReturnIp = 3,
+};
+
+#define FRAME_SIZE 4
+#define FRAME_MAX_COUNT 0x7FFF
+
+static_assert((FRAME_SIZE + FRAME_MAX_COUNT) * sizeof(size_t) < VSTACK_GUARD_SIZE,
+              "A frame may skip over the virtual stack guard");
+
+struct Registers {
+    size_t *fp;   /* Meta slot of the current frame */
+    size_t *args; /* A(0) of the current frame */
+};
+
+static inline size_t frame_meta(size_t args_count, size_t locals_count, bool is_closure) {
+    return (args_count << 17) | (locals_count << 2) | ((size_t)is_closure << 1) | 1;
+}
 
-typedef struct frame {
-    const char *return_ip;
-    bool is_closure;
-    size_t *base;
-    size_t args_count;
-    size_t locals_count;
-} frame;
+static inline size_t meta_args_count(size_t meta) {
+    return meta >> 17;
+}
 
-frame __cstack[CSTACK_SIZE];
-frame *__cstack_top;
-frame *__cstack_bottom;
+static inline size_t meta_locals_count(size_t meta) {
+    return (meta >> 2) & FRAME_MAX_COUNT;
+}
 
-static inline void cstack_init() {
-    __cstack_top = __cstack + CSTACK_SIZE - 1;
-    __cstack_bottom = __cstack + CSTACK_SIZE;
+static inline bool meta_is_closure(size_t meta) {
+    return (meta >> 1) & 1;
+}
 
-    // init main frame
-    __cstack_top->base = __gc_stack_top;
-    __cstack_top->return_ip = NULL;
+/* Pushes a frame for `args_count` arguments on top of the stack */
+static inline void frame_call(Registers *regs, const char *return_ip, size_t args_count, bool is_closure) {
+    ASSERT(args_count <= FRAME_MAX_COUNT, 1, "Too many arguments: %d", args_count);
+    ASSERT(__gc_stack_top + args_count + is_closure < __gc_stack_bottom, 1, "Virtual stack underflow");
+
+    size_t *args = __gc_stack_top + args_count;
+    vstack_push((size_t)return_ip);
+    vstack_push((size_t)regs->fp);
+    vstack_push(BOX(scoped_region_mark()));
+    vstack_push(frame_meta(args_count, 0, is_closure));
+    regs->fp = __gc_stack_top + 1;
+    regs->args = args;
 }
 
-static inline frame *cstack_call(const char *return_ip, size_t args_count, bool is_closure) {
-    ASSERT(__cstack_top > __cstack, 1, "Call stack overflow");
-    ASSERT(__gc_stack_top + args_count < __gc_stack_bottom, 1, "Virtual stack underflow");
+/* A call is in tail position if its result is returned right away, the verifier tells it */
+static inline bool is_tail_call() {
+    return interpreter.tail_calls != nullptr && (*interpreter.tail_calls)[interpreter.inst - interpreter.file->code_ptr];
+}
 
-    frame *top_frame = --__cstack_top;
-    top_frame->return_ip = return_ip;
-    top_frame->base = __gc_stack_top;
-    top_frame->is_closure = is_closure;
-    top_frame->args_count = args_count;
-    return top_frame;
+/*
+ * Replaces the current frame with a frame for `args_count` arguments on top of the stack.
+ * The new frame returns to the caller of the current one.
+ */
+static inline void frame_tail_call(Registers *regs, size_t args_count, bool is_closure) {
+    ASSERT(args_count <= FRAME_MAX_COUNT, 1, "Too many arguments: %d", args_count);
+    ASSERT(__gc_stack_top + args_count + is_closure < __gc_stack_bottom, 1, "Virtual stack underflow");
+
+    size_t *fp = regs->fp;
+    size_t return_ip = fp[Frame_ReturnIp];
+    size_t prev_fp = fp[Frame_PrevFp];
+    size_t region_mark = fp[Frame_RegionMark];
+    scoped_region_release(UNBOX(region_mark));
+
+    // move arguments (and the closure) over the current frame
+    size_t count = args_count + is_closure;
+    size_t *high = regs->args + meta_is_closure(fp[Frame_Meta]);
+    memmove(high - count + 1, __gc_stack_top + 1, count * sizeof(size_t));
+    __gc_stack_top = high - count;
+
+    vstack_push(return_ip);
+    vstack_push(prev_fp);
+    vstack_push(region_mark);
+    vstack_push(frame_meta(args_count, 0, is_closure));
+    regs->fp = __gc_stack_top + 1;
+    regs->args = high - is_closure;
 }
 
-static inline void cstack_alloc(size_t locals_count) {
-    ASSERT(__gc_stack_top - locals_count > __vstack, 1, "Virtual stack overflow");
+/*
+ * Locals start as BOX(0), so stack maps tell them from pointers before the first store.
+ * The verifier bounds indices of arguments by `args_count` of the function, the call
+ * has to pass as many.
+ */
+static inline void frame_alloc(Registers *regs, size_t args_count, size_t locals_count) {
+    ASSERT(locals_count <= FRAME_MAX_COUNT, 1, "Too many locals: %d", locals_count);
+    size_t meta = regs->fp[Frame_Meta];
+    ASSERT(meta_args_count(meta) == args_count, 1, "Function of %d arguments is called with %d",
+           args_count, meta_args_count(meta));
+    regs->fp[Frame_Meta] = frame_meta(meta_args_count(meta), locals_count, meta_is_closure(meta));
     __gc_stack_top -= locals_count;
-    __cstack_top->locals_count = locals_count;
+    for (size_t *slot = __gc_stack_top + 1; slot <= __gc_stack_top + locals_count; slot++) {
+        *slot = BOX(0);
+    }
 }
 
 /**
  * returns: return ip
  */
-static inline const char *cstack_end() {
+static inline const char *frame_end(Registers *regs) {
     size_t return_value = vstack_pop();
-    ASSERT(__cstack_top != __cstack_bottom, 1, "Call stack underflow");
-    ASSERT(__cstack_top->base + __cstack_top->args_count <= __gc_stack_bottom, 1, "Virtual stack underflow");
-    __gc_stack_top = __cstack_top->base + __cstack_top->args_count + __cstack_top->is_closure;
+    size_t *fp = regs->fp;
+    __gc_stack_top = regs->args + meta_is_closure(fp[Frame_Meta]);
+    scoped_region_release(UNBOX(fp[Frame_RegionMark]));
     vstack_push(return_value);
-    return (__cstack_top++)->return_ip;
+
+    regs->fp = (size_t *)fp[Frame_PrevFp];
+    if (regs->fp != nullptr) {
+        regs->args = regs->fp + FRAME_SIZE - 1 + meta_args_count(regs->fp[Frame_Meta]);
+    }
+    return (const char *)fp[Frame_ReturnIp];
+}
+
+/* The main function is entered without a call with zero arguments, its frame returns to nowhere */
+static inline void frame_init(Registers *regs, size_t args_count) {
+    for (size_t i = 0; i < args_count; i++) {
+        vstack_push(BOX(0));
+    }
+    regs->fp = nullptr;
+    frame_call(regs, nullptr, args_count, false);
+}
+
+static inline const StackMap *find_stack_map(const std::unordered_map<int, StackMap> &maps, const char *ip) {
+    auto it = maps.find(ip - interpreter.file->code_ptr);
+    return it == maps.end() ? nullptr : &it->second;
+}
+
+/*
+ * The stack scanner of the collector, see gc_set_stack_scanner. Frames are walked from
+ * the top one: locals and operands are visited by the stack map of the instruction
+ * the frame is stopped at (an allocation in the top frame, a call in the others),
+ * arguments and the closure are always visited. Slots without a map, or beyond it,
+ * and slots out of frames are visited all. Globals are scanned by their cards.
+ */
+static void vstack_scan_frames(gc_slot_visitor visit, void *context) {
+    size_t *top = __gc_stack_top + 1;
+    const Registers *regs = interpreter.regs;
+    const size_t *fp = regs != nullptr ? regs->fp : nullptr;
+    const StackMap *map = fp != nullptr ? find_stack_map(interpreter.stack_maps->allocations, interpreter.inst) : nullptr;
+
+    while (fp != nullptr) {
+        size_t meta = fp[Frame_Meta];
+        size_t *args = (size_t *)fp + FRAME_SIZE - 1 + meta_args_count(meta);
+        size_t index = 0;
+        for (size_t *slot = (size_t *)fp - 1; slot >= top; slot--, index++) {
+            if (map == nullptr || index >= map->size() || (*map)[index]) {
+                visit(slot, context);
+            }
+        }
+        top = args + meta_is_closure(meta) + 1;
+        for (size_t *slot = args - meta_args_count(meta) + 1; slot < top; slot++) {
+            visit(slot, context);
+        }
+
+        // the caller is stopped at the call returning to this frame's return address
+        const char *return_ip = (const char *)fp[Frame_ReturnIp];
+        fp = (const size_t *)fp[Frame_PrevFp];
+        if (fp != nullptr) {
+            map = find_stack_map(interpreter.stack_maps->calls, return_ip);
+        }
+    }
+
+    for (size_t *slot = top; slot < __gc_stack_bottom - __vstack_globals_count; slot++) {
+        visit(slot, context);
+    }
 }
 
-static inline size_t *loc(size_t location, int index) {
+/*
+ * Indices of globals, locals and arguments are bounded by the verifier for each function,
+ * so they are a single indexed load; the bounds are checked again only with DEBUG_MODE.
+ */
+static inline size_t *loc(const Registers *regs, size_t location, int index) {
     size_t *ptr = NULL;
-    size_t *closure_content;
-    size_t closure_size;
     switch (location) {
     case Location_Global:
+#ifdef DEBUG_MODE
         ASSERT(index < __vstack_globals_count, 1,
                "Memory access failed: G(%d) is out of section (%d globals)",
                index, __vstack_globals_count);
+#endif // DEBUG_MODE
         ptr = __gc_stack_bottom - 1 - index;
         break;
     case Location_Local:
-        ASSERT(index < __cstack_top->locals_count, 1,
+#ifdef DEBUG_MODE
+        ASSERT(index < meta_locals_count(regs->fp[Frame_Meta]), 1,
                "Memory access failed: L(%d) is out of frame (%d locals)",
-               index, __cstack_top->locals_count);
-        ptr = __cstack_top->base - index;
+               index, meta_locals_count(regs->fp[Frame_Meta]));
+#endif // DEBUG_MODE
+        ptr = regs->fp - 1 - index;
         break;
     case Location_Arg:
-        ASSERT(index < __cstack_top->args_count, 1,
+#ifdef DEBUG_MODE
+        ASSERT(index < meta_args_count(regs->fp[Frame_Meta]), 1,
                "Memory access failed: A(%d) is out of frame (%d args)",
-               index, __cstack_top->args_count);
-        ptr = __cstack_top->base + (__cstack_top->args_count - index);
+               index, meta_args_count(regs->fp[Frame_Meta]));
+#endif // DEBUG_MODE
+        ptr = regs->args - index;
         break;
-    case Location_Captured:
-        ASSERT(__cstack_top->is_closure, 1,
+    case Location_Captured: {
+        ASSERT(meta_is_closure(regs->fp[Frame_Meta]), 1,
                "Memory access failed: C(%d) is invalid out of closure",
                index);
-        closure_content = *(size_t **)(__cstack_top->base + __cstack_top->args_count + 1);
+        size_t *closure_content = *(size_t **)(regs->args + 1);
+        int closure_size = LEN(TO_DATA(closure_content)->data_header) - 1;
         ASSERT(index < closure_size, 1,
                "Memory access failed: C(%d) is out of captured (%d captured)",
                index, closure_size);
         ptr = closure_content + 1 + index;
         break;
+    }
     default:
         FAIL(1, "Unexpected location type %d\n", location);
     }
@@ -178,6 +585,20 @@ extern "C" int Lwrite(int n);
 extern "C" int Llength(void *p);
 extern "C" void *Lstring(void *p);
 
+extern "C" int Ls__Infix_43(void *p, void *q);
+extern "C" int Ls__Infix_45(void *p, void *q);
+extern "C" int Ls__Infix_42(void *p, void *q);
+extern "C" int Ls__Infix_47(void *p, void *q);
+extern "C" int Ls__Infix_37(void *p, void *q);
+extern "C" int Ls__Infix_60(void *p, void *q);
+extern "C" int Ls__Infix_6061(void *p, void *q);
+extern "C" int Ls__Infix_62(void *p, void *q);
+extern "C" int Ls__Infix_6261(void *p, void *q);
+extern "C" int Ls__Infix_6161(void *p, void *q);
+extern "C" int Ls__Infix_3361(void *p, void *q);
+extern "C" int Ls__Infix_3838(void *p, void *q);
+extern "C" int Ls__Infix_3333(void *p, void *q);
+
 extern "C" void *Bstring(void *p);
 extern "C" int LtagHash(const char *s);
 extern "C" void *Bsta(void *v, int i, void *x);
@@ -202,23 +623,30 @@ extern "C" void *alloc_closure(int);
 extern "C" void __init();
 extern "C" void __shutdown();
 
-static inline void *Barray(int n) {
+/*
+ * Elements are read from `n` stack slots going down from `first` after the allocation,
+ * the slots are left for the caller to release.
+ */
+static inline void *Barray(const size_t *first, int n) {
     data *r = (data *)alloc_array(n);
 
-    for (int i = n - 1; i >= 0; i--) {
-        ((int *)r->contents)[i] = vstack_pop();
+    for (int i = 0; i < n; i++) {
+        ((int *)r->contents)[i] = first[-i];
     }
 
     return r->contents;
 }
 
-static inline void *BSexp(int n, int tag) {
+static inline void *BSexp(const size_t *first, int n, int tag, bool scoped) {
     int fields_cnt = n;
-    data *r = (data *)alloc_sexp(fields_cnt);
+    data *r = scoped ? (data *)alloc_scoped_sexp(fields_cnt) : nullptr;
+    if (r == nullptr) {
+        r = (data *)alloc_sexp(fields_cnt);
+    }
     ((sexp *)r)->tag = 0;
 
-    for (int i = n; i > 0; i--) {
-        ((int *)r->contents)[i] = vstack_pop();
+    for (int i = 0; i < n; i++) {
+        ((int *)r->contents)[i + 1] = first[-i];
     }
 
     ((sexp *)r)->tag = tag;
@@ -226,19 +654,45 @@ static inline void *BSexp(int n, int tag) {
     return (int *)r->contents;
 }
 
-static inline void *Bclosure(int n, void *entry) {
-    data *r = (data *)alloc_closure(n + 1);
+/*
+ * Captured values are read after the allocation, so they are up to date
+ * if it has run the collector and moved them.
+ */
+static inline void *Bclosure(const Registers *regs, CaptureList captured, void *entry) {
+    data *r = (data *)alloc_closure(captured.size() + 1);
     ((void **)r->contents)[0] = entry;
 
-    for (int i = n; i >= 1; --i) {
-        ((int *)r->contents)[i] = vstack_pop();
+    size_t *content = (size_t *)r->contents + 1;
+    for (LocationEntry location : captured) {
+        *content++ = *loc(regs, location.kind, location.index);
     }
 
     return r->contents;
 }
 
+static inline void *intern_string(const char *ptr) {
+    size_t offset = ptr - interpreter.file->string_ptr;
+    void *&interned = literals.interned[offset];
+    if (interned == nullptr) [[unlikely]] {
+        int len = strlen(ptr);
+        data *r = (data *)alloc_immortal_string(len);
+        memcpy(r->contents, ptr, len + 1);
+        interned = r->contents;
+    }
+    return interned;
+}
+
+/*
+ * Literals are interned only in programs without reachable StA (see load_program),
+ * a store into one would change the literal for all its evaluations
+ */
+static inline void check_not_interned(void *x) {
+    ASSERT(!is_immortal_pointer((size_t *)x), 1, "Store into an interned string literal");
+}
+
 template <unsigned char opcode, typename... Args>
 struct InterpreterFunctor {
+    Registers *regs;
     inline void operator()(Args... args) {
         ::std::cout << "Interpreter for opcode " << (int)opcode << " not implemented" << ::std::endl;
     }
@@ -246,6 +700,7 @@ struct InterpreterFunctor {
 
 template <>
 struct InterpreterFunctor<Opcode_Const, int> {
+    Registers *regs;
     inline void operator()(int value) {
         vstack_push(BOX(value));
     }
@@ -253,33 +708,51 @@ struct InterpreterFunctor<Opcode_Const, int> {
 
 template <>
 struct InterpreterFunctor<Opcode_String, const char *> {
+    Registers *regs;
     inline void operator()(const char *ptr) {
-        vstack_push((size_t)Bstring((void *)ptr));
+        if (literals.enabled) {
+            vstack_push((size_t)intern_string(ptr));
+        } else {
+            vstack_push((size_t)Bstring((void *)ptr));
+        }
     }
 };
 
 template <>
 struct InterpreterFunctor<Opcode_SExp, const char *, int> {
+    Registers *regs;
     inline void operator()(const char *tag, int n) {
-        vstack_push((size_t)BSexp(n, UNBOX(LtagHash(tag))));
+        bool scoped = interpreter.scoped_sexps && (*interpreter.scoped_sexps)[interpreter.inst - interpreter.file->code_ptr];
+        void *sexp = BSexp(__gc_stack_top + n, n, UNBOX(LtagHash(tag)), scoped);
+        __gc_stack_top += n;
+        vstack_push((size_t)sexp);
     }
 };
 
 template <>
 struct InterpreterFunctor<Opcode_StI> {
+    Registers *regs;
     inline void operator()() {
         size_t v = vstack_pop();
-        *(size_t *)vstack_pop() = v;
+        size_t *addr = (size_t *)vstack_pop();
+        store_barrier(addr);
+        *addr = v;
         vstack_push(v);
     }
 };
 
 template <>
 struct InterpreterFunctor<Opcode_StA> {
+    Registers *regs;
     inline void operator()() {
         size_t *v = (size_t *)vstack_pop();
         size_t i = vstack_pop();
         size_t *x = (size_t *)vstack_pop();
+        if (literals.enabled) {
+            check_not_interned(x);
+        }
+        // with a boxed index x is an address
+        store_barrier(x);
         size_t *ptr = (size_t *)Bsta(v, i, x);
         vstack_push((size_t)ptr);
     }
@@ -287,6 +760,7 @@ struct InterpreterFunctor<Opcode_StA> {
 
 template <>
 struct InterpreterFunctor<Opcode_Jmp, int> {
+    Registers *regs;
     inline void operator()(int target) {
         const char *dst = interpreter.file->code_ptr + target;
         interpreter.advance = Jump;
@@ -296,22 +770,25 @@ struct InterpreterFunctor<Opcode_Jmp, int> {
 
 template <>
 struct InterpreterFunctor<Opcode_End> {
+    Registers *regs;
     inline void operator()() {
         interpreter.advance = Jump;
-        interpreter.jump_target = cstack_end();
+        interpreter.jump_target = frame_end(regs);
     }
 };
 
 template <>
 struct InterpreterFunctor<Opcode_Ret> {
+    Registers *regs;
     inline void operator()() {
         interpreter.advance = Jump;
-        interpreter.jump_target = cstack_end();
+        interpreter.jump_target = frame_end(regs);
     }
 };
 
 template <>
 struct InterpreterFunctor<Opcode_Drop> {
+    Registers *regs;
     inline void operator()() {
         vstack_pop();
     }
@@ -319,6 +796,7 @@ struct InterpreterFunctor<Opcode_Drop> {
 
 template <>
 struct InterpreterFunctor<Opcode_Dup> {
+    Registers *regs;
     inline void operator()() {
         vstack_push(vstack_top());
     }
@@ -326,6 +804,7 @@ struct InterpreterFunctor<Opcode_Dup> {
 
 template <>
 struct InterpreterFunctor<Opcode_Swap> {
+    Registers *regs;
     inline void operator()() {
         size_t fst = vstack_pop();
         size_t snd = vstack_pop();
@@ -336,6 +815,7 @@ struct InterpreterFunctor<Opcode_Swap> {
 
 template <>
 struct InterpreterFunctor<Opcode_Elem> {
+    Registers *regs;
     inline void operator()() {
         size_t i = vstack_pop();
         size_t *p = (size_t *)vstack_pop();
@@ -345,6 +825,7 @@ struct InterpreterFunctor<Opcode_Elem> {
 
 template <>
 struct InterpreterFunctor<Opcode_CJmpZ, int> {
+    Registers *regs;
     inline void operator()(int target) {
         const char *dst = interpreter.file->code_ptr + target;
         if (UNBOX(vstack_pop()) == 0) {
@@ -356,6 +837,7 @@ struct InterpreterFunctor<Opcode_CJmpZ, int> {
 
 template <>
 struct InterpreterFunctor<Opcode_CJmpNZ, int> {
+    Registers *regs;
     inline void operator()(int target) {
         const char *dst = interpreter.file->code_ptr + target;
         if (UNBOX(vstack_pop()) != 0) {
@@ -367,33 +849,38 @@ struct InterpreterFunctor<Opcode_CJmpNZ, int> {
 
 template <>
 struct InterpreterFunctor<Opcode_Begin, int, int> {
+    Registers *regs;
     inline void operator()(int args_count, int locals_count) {
-        cstack_alloc(locals_count);
+        frame_alloc(regs, args_count, locals_count);
     }
 };
 
 template <>
 struct InterpreterFunctor<Opcode_CBegin, int, int> {
+    Registers *regs;
     inline void operator()(int args_count, int locals_count) {
-        cstack_alloc(locals_count);
+        frame_alloc(regs, args_count, locals_count);
     }
 };
 
 template <>
-struct InterpreterFunctor<Opcode_Closure, int, ::std::vector<LocationEntry>> {
-    inline void operator()(int offset, ::std::vector<LocationEntry> locations) {
-        for (const auto &location : locations) {
-            vstack_push(*loc(location.kind, location.index));
-        }
-        vstack_push((size_t)Bclosure(locations.size(), (void *)offset));
+struct InterpreterFunctor<Opcode_Closure, int, CaptureList> {
+    Registers *regs;
+    inline void operator()(int offset, CaptureList captured) {
+        vstack_push((size_t)Bclosure(regs, captured, (void *)offset));
     }
 };
 
 template <>
 struct InterpreterFunctor<Opcode_CallC, const char *, int> {
+    Registers *regs;
     inline void operator()(const char *return_ip, int args_count) {
         const char *entry = interpreter.file->code_ptr + *(int *)vstack_kth_from_end(args_count);
-        cstack_call(return_ip, args_count, true);
+        if (is_tail_call()) {
+            frame_tail_call(regs, args_count, true);
+        } else {
+            frame_call(regs, return_ip, args_count, true);
+        }
         interpreter.advance = Jump;
         interpreter.jump_target = entry;
     }
@@ -401,9 +888,14 @@ struct InterpreterFunctor<Opcode_CallC, const char *, int> {
 
 template <>
 struct InterpreterFunctor<Opcode_Call, const char *, int, int> {
+    Registers *regs;
     inline void operator()(const char *return_ip, int offset, int args_count) {
         const char *dst = interpreter.file->code_ptr + offset;
-        cstack_call(return_ip, args_count, false);
+        if (is_tail_call()) {
+            frame_tail_call(regs, args_count, false);
+        } else {
+            frame_call(regs, return_ip, args_count, false);
+        }
         interpreter.advance = Jump;
         interpreter.jump_target = dst;
     }
@@ -411,6 +903,7 @@ struct InterpreterFunctor<Opcode_Call, const char *, int, int> {
 
 template <>
 struct InterpreterFunctor<Opcode_Tag, const char *, int> {
+    Registers *regs;
     inline void operator()(const char *s, int args) {
         size_t tag = Btag((void *)vstack_pop(), LtagHash((const char *)s), BOX(args));
         vstack_push(tag);
@@ -419,6 +912,7 @@ struct InterpreterFunctor<Opcode_Tag, const char *, int> {
 
 template <>
 struct InterpreterFunctor<Opcode_Array, int> {
+    Registers *regs;
     inline void operator()(int n) {
         size_t arr = (size_t)Barray_patt((void *)vstack_pop(), BOX(n));
         vstack_push(arr);
@@ -427,6 +921,7 @@ struct InterpreterFunctor<Opcode_Array, int> {
 
 template <>
 struct InterpreterFunctor<Opcode_Fail, int, int> {
+    Registers *regs;
     inline void operator()(int line, int col) {
         Bmatch_failure((void *)vstack_pop(), interpreter.file_name, line, col);
     }
@@ -434,34 +929,138 @@ struct InterpreterFunctor<Opcode_Fail, int, int> {
 
 template <>
 struct InterpreterFunctor<Opcode_Line, int> {
+    Registers *regs;
     inline void operator()(int line) {}
 };
 
+/*
+ * Binops are quickened in place on the first execution: to BinopInt if both operands
+ * are integers and to BinopAny otherwise. BinopInt falls back to BinopAny for good
+ * once it meets an operand of another type. Only the writable copy of the code is
+ * quickened (see InterpreterOptions::code), it may be shared by instances in several
+ * threads: stores are atomic and any of the variants computes the same result,
+ * so their order does not matter.
+ */
+static inline void quicken(unsigned char opcode) {
+    if (interpreter.quickening) {
+        std::atomic_ref<char>(*(char *)interpreter.inst).store(opcode, std::memory_order_relaxed);
+    }
+}
+
+template <unsigned char binop>
+static inline int compute_binop(int l, int r) {
+    int res;
+
+#define CASE_BINOP(Binop_Name, op) \
+    case Binop_Name:               \
+        res = l op r;              \
+        break;
+
+    switch (binop) {
+        BINOPS(CASE_BINOP)
+    }
+#undef CASE_BINOP
+    return res;
+}
+
+template <unsigned char binop>
+static inline size_t binop_int(size_t lhv, size_t rhv) {
+    return BOX(compute_binop<binop>(UNBOX(lhv), UNBOX(rhv)));
+}
+
+/* Operands are checked by the runtime implementations of infix operators */
+template <unsigned char binop>
+static inline size_t binop_any(size_t lhv, size_t rhv) {
+    static int (*const helpers[])(void *, void *) = {
+        nullptr,
+        Ls__Infix_43,
+        Ls__Infix_45,
+        Ls__Infix_42,
+        Ls__Infix_47,
+        Ls__Infix_37,
+        Ls__Infix_60,
+        Ls__Infix_6061,
+        Ls__Infix_62,
+        Ls__Infix_6261,
+        Ls__Infix_6161,
+        Ls__Infix_3361,
+        Ls__Infix_3838,
+        Ls__Infix_3333,
+    };
+    return helpers[binop]((void *)lhv, (void *)rhv);
+}
+
 template <unsigned char opcode>
     requires((opcode >> 4) == HOpcode_Binop)
 struct InterpreterFunctor<opcode> {
+    Registers *regs;
     inline void operator()() {
-        int rhv = UNBOX(vstack_pop());
-        int lhv = UNBOX(vstack_pop());
-        int res;
+        size_t rhv = vstack_pop();
+        size_t lhv = vstack_pop();
+        if (UNBOXED(lhv & rhv)) {
+            quicken(COMPOSED(HOpcode_BinopInt, opcode & 0x0F));
+            vstack_push(binop_int<opcode & 0x0F>(lhv, rhv));
+        } else {
+            quicken(COMPOSED(HOpcode_BinopAny, opcode & 0x0F));
+            vstack_push(binop_any<opcode & 0x0F>(lhv, rhv));
+        }
+    }
+};
 
-#define CASE_BINOP(Binop_Name, op) \
-    case Binop_Name:               \
-        res = lhv op rhv;          \
-        break;
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_BinopInt)
+struct InterpreterFunctor<opcode> {
+    Registers *regs;
+    inline void operator()() {
+        size_t rhv = vstack_pop();
+        size_t lhv = vstack_pop();
+        if (UNBOXED(lhv & rhv)) [[likely]] {
+            vstack_push(binop_int<opcode & 0x0F>(lhv, rhv));
+        } else {
+            quicken(COMPOSED(HOpcode_BinopAny, opcode & 0x0F));
+            vstack_push(binop_any<opcode & 0x0F>(lhv, rhv));
+        }
+    }
+};
 
-        switch (opcode & 0x0F) {
-            BINOPS(CASE_BINOP)
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_BinopAny)
+struct InterpreterFunctor<opcode> {
+    Registers *regs;
+    inline void operator()() {
+        size_t rhv = vstack_pop();
+        size_t lhv = vstack_pop();
+        vstack_push(binop_any<opcode & 0x0F>(lhv, rhv));
+    }
+};
+
+/* A comparison fused with the following conditional jump, the result is not pushed */
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_CmpJmpZ || (opcode >> 4) == HOpcode_CmpJmpNZ)
+struct InterpreterFunctor<opcode, int> {
+    Registers *regs;
+    inline void operator()(int target) {
+        size_t rhv = vstack_pop();
+        size_t lhv = vstack_pop();
+        int res;
+        if (UNBOXED(lhv & rhv)) [[likely]] {
+            res = compute_binop<opcode & 0x0F>(UNBOX(lhv), UNBOX(rhv));
+        } else {
+            res = UNBOX(binop_any<opcode & 0x0F>(lhv, rhv));
+        }
+        if ((res == 0) == ((opcode >> 4) == HOpcode_CmpJmpZ)) {
+            interpreter.advance = Jump;
+            interpreter.jump_target = interpreter.file->code_ptr + target;
         }
-        vstack_push(BOX(res));
     }
 };
 
 template <unsigned char opcode>
     requires((opcode >> 4) == HOpcode_Ld)
 struct InterpreterFunctor<opcode, int> {
+    Registers *regs;
     inline void operator()(int index) {
-        size_t *addr = loc(opcode & 0x0F, index);
+        size_t *addr = loc(regs, opcode & 0x0F, index);
         vstack_push(*addr);
     }
 };
@@ -469,8 +1068,9 @@ struct InterpreterFunctor<opcode, int> {
 template <unsigned char opcode>
     requires((opcode >> 4) == HOpcode_LdA)
 struct InterpreterFunctor<opcode, int> {
+    Registers *regs;
     inline void operator()(int index) {
-        size_t *addr = loc(opcode & 0x0F, index);
+        size_t *addr = loc(regs, opcode & 0x0F, index);
         vstack_push((size_t)addr);
         vstack_push((size_t)addr);
     }
@@ -479,122 +1079,441 @@ struct InterpreterFunctor<opcode, int> {
 template <unsigned char opcode>
     requires((opcode >> 4) == HOpcode_St)
 struct InterpreterFunctor<opcode, int> {
+    Registers *regs;
     inline void operator()(int index) {
-        *loc(opcode & 0x0F, index) = vstack_top();
+        size_t *addr = loc(regs, opcode & 0x0F, index);
+        if constexpr ((opcode & 0x0F) == Location_Global) {
+            global_card_mark(addr);
+        }
+        *addr = vstack_top();
     }
 };
 
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_StDrop)
+struct InterpreterFunctor<opcode, int> {
+    Registers *regs;
+    inline void operator()(int index) {
+        size_t *addr = loc(regs, opcode & 0x0F, index);
+        if constexpr ((opcode & 0x0F) == Location_Global) {
+            global_card_mark(addr);
+        }
+        *addr = vstack_pop();
+    }
+};
+
+/* `y` is only read by Pattern_String */
+static inline size_t match_pattern(int pattern, void *x, void *y) {
+    switch (pattern) {
+    case Pattern_String:
+        return Bstring_patt(x, y);
+    case Pattern_StringTag:
+        return Bstring_tag_patt(x);
+    case Pattern_ArrayTag:
+        return Barray_tag_patt(x);
+    case Pattern_SExpTag:
+        return Bsexp_tag_patt(x);
+    case Pattern_Boxed:
+        return Bboxed_patt(x);
+    case Pattern_Unboxed:
+        return Bunboxed_patt(x);
+    case Pattern_ClosureTag:
+        return Bclosure_tag_patt(x);
+    default:
+        FAIL(1, "Unexpected pattern: %d\n", pattern);
+    }
+}
+
+/* `x` is ignored by Lread */
+static inline size_t lcall(int function, size_t x) {
+    switch (function) {
+    case LCall_Lread:
+        return Lread();
+    case LCall_Lwrite:
+        return Lwrite(x);
+    case LCall_Llength:
+        return Llength((void *)x);
+    case LCall_Lstring:
+        return (size_t)Lstring((void *)x);
+    default:
+        FAIL(1, "Unknown LCall");
+    }
+}
+
 template <unsigned char opcode>
     requires((opcode >> 4) == HOpcode_Patt)
 struct InterpreterFunctor<opcode> {
+    Registers *regs;
     inline void operator()() {
         void *x = (void *)vstack_pop();
-        switch (opcode & 0x0F) {
-        case Pattern_String: {
-            void *y = (void *)vstack_pop();
-            vstack_push(Bstring_patt(x, y));
-            break;
-        }
-        case Pattern_StringTag: {
-            vstack_push(Bstring_tag_patt(x));
-            break;
-        }
-        case Pattern_ArrayTag: {
-            vstack_push(Barray_tag_patt(x));
-            break;
-        }
-        case Pattern_SExpTag: {
-            vstack_push(Bsexp_tag_patt(x));
-            break;
-        }
-        case Pattern_Boxed: {
-            vstack_push(Bboxed_patt(x));
-            break;
-        }
-        case Pattern_Unboxed: {
-            vstack_push(Bunboxed_patt(x));
-            break;
-        }
-        case Pattern_ClosureTag: {
-            vstack_push(Bclosure_tag_patt(x));
-            break;
-        }
-        default: {
-            FAIL(1, "Unexpected pattern: %d\n", (int)(opcode & 0x0F));
-        }
-        }
+        void *y = (opcode & 0x0F) == Pattern_String ? (void *)vstack_pop() : nullptr;
+        vstack_push(match_pattern(opcode & 0x0F, x, y));
     }
 };
 
 template <unsigned char opcode>
     requires((opcode >> 4) == HOpcode_LCall && (opcode & 0x0F) != LCall_Barray)
 struct InterpreterFunctor<opcode> {
+    Registers *regs;
     inline void operator()() {
-        switch (opcode & 0x0F) {
-        case LCall_Lread:
-            vstack_push(Lread());
-            break;
-        case LCall_Lwrite:
-            vstack_push(Lwrite(vstack_pop()));
-            break;
-        case LCall_Llength:
-            vstack_push(Llength((void *)vstack_pop()));
-            break;
-        case LCall_Lstring:
-            vstack_push((size_t)Lstring((void *)vstack_pop()));
-            break;
-        default:
-            FAIL(1, "Unknown LCall");
-        }
+        size_t x = (opcode & 0x0F) == LCall_Lread ? BOX(0) : vstack_pop();
+        vstack_push(lcall(opcode & 0x0F, x));
     }
 };
 
 template <>
 struct InterpreterFunctor<COMPOSED(HOpcode_LCall, LCall_Barray), int> {
+    Registers *regs;
     inline void operator()(int n) {
-        vstack_push((size_t)Barray(n));
+        void *array = Barray(__gc_stack_top + n, n);
+        __gc_stack_top += n;
+        vstack_push((size_t)array);
     }
 };
 
 template <unsigned char opcode>
     requires((opcode >> 4) == HOpcode_Stop)
 struct InterpreterFunctor<opcode> {
+    Registers *regs;
     inline void operator()() {
-        __shutdown();
-        exit(0);
+        interpreter.stopped = true;
+        interpreter.advance = Jump;
+        interpreter.jump_target = nullptr;
     }
 };
 
+/*
+ * Register code (see register_ir.h) runs in frames of the same layout: registers
+ * are the slots below the frame header, locals first, and the stack top is kept
+ * below the last register so the collector scans all of them.
+ * Returns the number of executed instructions.
+ */
+static size_t run_registers(const RegisterCode *code, const RFunction *function, Registers *regs) {
+#define R(r) (regs->fp[-1 - (r)])
+
+    const RInst *pc = function->code.data();
+    size_t executed = 0;
+    while (true) {
+        const RInst *inst = pc++;
+        executed++;
+
+        switch (inst->op) {
+        case ROp_Begin:
+            // the frame is marked to hold all registers as locals
+            frame_alloc(regs, inst->c, inst->a);
+            for (int r = 0; r < inst->a; r++) {
+                R(r) = BOX(0);
+            }
+            break;
+        case ROp_Const:
+            R(inst->a) = inst->imm;
+            break;
+        case ROp_String:
+            R(inst->a) = (size_t)(literals.enabled ? intern_string(inst->ptr) : Bstring((void *)inst->ptr));
+            break;
+        case ROp_Move:
+            R(inst->a) = R(inst->b);
+            break;
+        case ROp_Load:
+            R(inst->a) = *loc(regs, inst->sub, inst->b);
+            break;
+        case ROp_Store: {
+            size_t *addr = loc(regs, inst->sub, inst->b);
+            if (inst->sub == Location_Global) {
+                global_card_mark(addr);
+            }
+            *addr = R(inst->a);
+            break;
+        }
+        case ROp_LoadAddr:
+            R(inst->a) = R(inst->a + 1) = (size_t)loc(regs, inst->sub, inst->b);
+            break;
+        case ROp_StoreInd: {
+            size_t v = R(inst->c);
+            store_barrier((size_t *)R(inst->b));
+            *(size_t *)R(inst->b) = v;
+            R(inst->a) = v;
+            break;
+        }
+        case ROp_StoreElem: {
+            void *x = (void *)R(inst->a);
+            if (literals.enabled) {
+                check_not_interned(x);
+            }
+            store_barrier((size_t *)x);
+            R(inst->a) = (size_t)Bsta((void *)R(inst->a + 2), R(inst->a + 1), x);
+            break;
+        }
+        case ROp_Elem:
+            R(inst->a) = (size_t)Belem((void *)R(inst->b), R(inst->c));
+            break;
+        case ROp_Swap:
+            std::swap(R(inst->a), R(inst->b));
+            break;
+        case ROp_Jmp:
+            pc = inst + inst->a;
+            break;
+        case ROp_JmpZ:
+            if (UNBOX(R(inst->b)) == 0) {
+                pc = inst + inst->a;
+            }
+            break;
+        case ROp_JmpNZ:
+            if (UNBOX(R(inst->b)) != 0) {
+                pc = inst + inst->a;
+            }
+            break;
+        case ROp_Call:
+            __gc_stack_top = &R(inst->a + inst->b);
+            if (inst->sub) {
+                frame_tail_call(regs, inst->b, false);
+            } else {
+                frame_call(regs, (const char *)pc, inst->b, false);
+            }
+            pc = code->functions[inst->c].code.data();
+            break;
+        case ROp_CallC: {
+            int entry = *(int *)R(inst->a);
+            int index = code->index[entry];
+            ASSERT(index >= 0, 1, "Closure of 0x%.8x which is not a verified function", entry);
+            __gc_stack_top = &R(inst->a + 1 + inst->b);
+            if (inst->sub) {
+                frame_tail_call(regs, inst->b, true);
+            } else {
+                frame_call(regs, (const char *)pc, inst->b, true);
+            }
+            pc = code->functions[index].code.data();
+            break;
+        }
+        case ROp_Ret: {
+            vstack_push(R(inst->a));
+            const char *return_ip = frame_end(regs);
+            if (return_ip == nullptr) {
+                return executed;
+            }
+            // the result is in place of the arguments, registers below it keep the callee frame
+            size_t *top = &R(meta_locals_count(regs->fp[Frame_Meta]));
+            for (size_t *slot = __gc_stack_top; slot > top; slot--) {
+                *slot = BOX(0);
+            }
+            __gc_stack_top = top;
+            pc = (const RInst *)return_ip;
+            break;
+        }
+        case ROp_SExp:
+            R(inst->a) = (size_t)BSexp(&R(inst->a), inst->b, UNBOX(LtagHash(inst->ptr)), inst->sub);
+            break;
+        case ROp_Array:
+            R(inst->a) = (size_t)Barray(&R(inst->a), inst->b);
+            break;
+        case ROp_Closure:
+            R(inst->a) = (size_t)Bclosure(regs, CaptureList(inst->ptr, inst->c), (void *)inst->b);
+            break;
+        case ROp_Tag:
+            R(inst->a) = Btag((void *)R(inst->b), LtagHash(inst->ptr), BOX(inst->c));
+            break;
+        case ROp_ArrayPatt:
+            R(inst->a) = Barray_patt((void *)R(inst->b), BOX(inst->c));
+            break;
+        case ROp_Patt:
+            R(inst->a) = match_pattern(inst->sub, (void *)R(inst->b),
+                                       inst->sub == Pattern_String ? (void *)R(inst->c) : nullptr);
+            break;
+        case ROp_LCall:
+            R(inst->a) = lcall(inst->sub, inst->sub == LCall_Lread ? BOX(0) : R(inst->b));
+            break;
+        case ROp_Fail:
+            Bmatch_failure((void *)R(inst->a), interpreter.file_name, inst->b, inst->c);
+            break;
+        case ROp_Stop:
+            interpreter.stopped = true;
+            return executed;
+
+#define CASE_BINOP(Binop_Code, _)                                                    \
+    case (int)ROp_Binop + (int)Binop_Code: {                                         \
+        size_t lhv = R(inst->b), rhv = R(inst->c);                                   \
+        R(inst->a) = UNBOXED(lhv & rhv) ? binop_int<Binop_Code>(lhv, rhv)            \
+                                        : binop_any<Binop_Code>(lhv, rhv);           \
+        break;                                                                       \
+    }
+            BINOPS(CASE_BINOP)
+#undef CASE_BINOP
+
+        default:
+            FAIL(1, "Unknown register opcode %d", inst->op);
+        }
+    }
+
+#undef R
+}
+
+/* Writes a snapshot of the heap of the running instance, see gc_heap_snapshot */
+void write_heap_snapshot(const std::string &fname) {
+    int fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ASSERT(fd >= 0 && gc_heap_snapshot(fd) == 0, 1, "Cannot write heap snapshot %s: %s", fname.c_str(),
+           strerror(errno));
+    close(fd);
+}
+
 } // namespace
 
-void interprete(const char *file_name, const bytefile *file, const char *ip) {
-    size_t line = 0;
+/*
+ * Interpreter functions work with globals, so instance state is swapped
+ * into them for the duration of `run` and swapped back afterwards.
+ */
+struct LamaVM::State {
+    bool initialized = false;
+    gc_context gc{};
+    size_t *vstack = nullptr;
+    char *vstack_mapping = nullptr;
+    size_t vstack_globals_count = 0;
+    unsigned char *vstack_global_cards = nullptr;
+    InterpreterState interpreter{};
+    LiteralPool literals{};
+#ifdef PROFILE_MODE
+    Profile profile{};
+#endif // PROFILE_MODE
+
+    void swap() {
+        gc_context active;
+        gc_context_save(&active);
+        gc_context_restore(&gc);
+        gc = active;
+
+        std::swap(vstack, __vstack);
+        std::swap(vstack_mapping, __vstack_mapping);
+        std::swap(vstack_globals_count, __vstack_globals_count);
+        std::swap(vstack_global_cards, __vstack_global_cards);
+        std::swap(interpreter, ::interpreter);
+        std::swap(literals, ::literals);
+#ifdef PROFILE_MODE
+        std::swap(profile, ::profile);
+#endif // PROFILE_MODE
+    }
+};
 
+LamaVM::LamaVM(const char *file_name, const bytefile *file, const InterpreterOptions &options)
+    : file_name(file_name), file(file), options(options), state(new State) {}
+
+LamaVM::~LamaVM() {
+    reset();
+}
+
+void LamaVM::init() {
     __init();
-    vstack_init();
+    vstack_init(options.stack_size);
     vstack_alloc_globals(file->global_area_size);
-    cstack_init();
-
-    InstReader reader(file);
 
     interpreter.file_name = file_name;
-    interpreter.file = file;
+    interpreter.file = options.code != nullptr ? options.code : file;
+    interpreter.quickening = options.code != nullptr;
+    interpreter.scoped_sexps = options.scoped_sexps;
+    interpreter.tail_calls = options.tail_calls;
+    interpreter.stack_maps = options.stack_maps;
+    if (options.stack_maps != nullptr) {
+        gc_set_stack_scanner(vstack_scan_frames);
+    }
 
-    do {
-        if (ip == NULL) {
-            __shutdown();
-            break;
-        }
+    if (options.heap_snapshots) {
+        gc_set_snapshot_prefix(file_name);
+    }
 
+    literals.enabled = options.intern_strings;
+    if (literals.enabled) {
+        literals.interned.assign(file->stringtab_size, nullptr);
+    }
+#ifdef PROFILE_MODE
+    profile_init(file);
+#endif // PROFILE_MODE
+    state->initialized = true;
+}
+
+size_t LamaVM::run(const char *entrypoint) {
+    state->swap();
+    if (!state->initialized) {
+        init();
+    }
+    const bytefile *code = interpreter.file;
+    const char *ip = code->code_ptr + (entrypoint - file->code_ptr);
+
+    size_t *stack_top = __gc_stack_top;
+    size_t region_mark = scoped_region_mark();
+    Registers regs;
+    // the entrypoint is a Begin, its arguments follow the opcode
+    frame_init(&regs, *(const int *)(ip + 1));
+    interpreter.regs = &regs;
+
+    InstReader reader(code);
+    interpreter.stopped = false;
+    size_t executed = 0;
+
+    if (options.registers != nullptr) {
+        int index = options.registers->index[ip - code->code_ptr];
+        ASSERT(index >= 0, 1, "No register code for 0x%.8x", ip - code->code_ptr);
+        executed = run_registers(options.registers, &options.registers->functions[index], &regs);
+        ip = NULL;
+    }
+
+    while (ip != NULL) {
 #ifdef DEBUG_MODE
         dump_stack();
 #endif // DEBUG_MODE
-        CERR("Inst 0x%08x %d\n", (ip - file->code_ptr), (int)*ip);
-
-        ip = reader.read_inst<InterpreterFunctor>(ip);
+        CERR("Inst 0x%08x %d\n", (ip - code->code_ptr), (int)*ip);
+
+        interpreter.inst = ip;
+        ip = reader.read_inst<InterpreterFunctor>(ip, &regs);
+        executed++;
+#ifdef PROFILE_MODE
+        profile_inst(interpreter.inst, ip);
+#endif // PROFILE_MODE
         if (interpreter.advance == Jump) [[unlikely]] {
             ip = interpreter.jump_target;
             interpreter.advance = Normal;
         }
-    } while (1);
+    }
+
+    interpreter.executed += executed;
+    if (options.heap_snapshots) {
+        // the result is still on the stack, so it is a root of the snapshot
+        write_heap_snapshot(std::string(file_name) + ".heap");
+    }
+    size_t result = interpreter.stopped ? BOX(0) : vstack_pop();
+    // the program might have stopped inside of a call
+    __gc_stack_top = stack_top;
+    scoped_region_release(region_mark);
+    interpreter.regs = nullptr;
+    state->swap();
+    return result;
+}
+
+void LamaVM::reset() {
+    if (!state->initialized) {
+        return;
+    }
+    state->swap();
+#ifdef PROFILE_MODE
+    std::ofstream out(std::string(file_name) + ".profile");
+    profile_dump(file, out);
+    profile = Profile{};
+#endif // PROFILE_MODE
+    vstack_release();
+    __shutdown();
+    literals = LiteralPool{};
+    interpreter = InterpreterState{};
+    state->initialized = false;
+    state->swap();
+}
+
+InterpreterStats LamaVM::stats() const {
+    // state of an instance which is not running is kept in `state`
+    return InterpreterStats{
+        .instructions = state->interpreter.executed,
+        .gc_cycles = state->gc.gc_cycles,
+    };
+}
+
+InterpreterStats interprete(const char *file_name, const bytefile *file, const char *ip, const InterpreterOptions &options) {
+    LamaVM vm(file_name, file, options);
+    vm.run(ip);
+    return vm.stats();
 }
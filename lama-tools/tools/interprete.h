@@ -2,10 +2,118 @@
 #define INTERPRETE_H
 
 #include "bytefile.h"
+#include "register_ir.h"
+#include "stack_map.h"
 
-void interprete(
+#include <memory>
+
+struct InterpreterOptions {
+    /*
+     * Materialize each string literal once in the immortal area and push the same
+     * pointer on each execution instead of copying the literal into the heap.
+     * This is not Lama semantics, which gives a fresh string per evaluation:
+     * a string stored into by StA would change the literal for all its executions,
+     * so such a store fails. It is meant only for programs which never store into a string.
+     */
+    bool intern_strings;
+
+    /*
+     * SExp instructions (flags by code offset) whose results never leave the frame;
+     * they are allocated in the scoped region released at the end of the frame.
+     * nullptr disables scoped allocation.
+     */
+    const std::vector<bool> *scoped_sexps;
+
+    /*
+     * Call and CallC instructions (flags by code offset) in tail position, see
+     * VerificationInfo::tail_calls: they reuse the frame of the caller.
+     * nullptr makes all calls push new frames.
+     */
+    const std::vector<bool> *tail_calls;
+
+    /* Size of the virtual stack in bytes, it is committed lazily */
+    size_t stack_size;
+
+    /*
+     * Register form of the verified functions to run instead of the bytecode,
+     * `scoped_sexps` is compiled into it. nullptr runs the bytecode.
+     */
+    const RegisterCode *registers;
+
+    /*
+     * Write a heap snapshot into `<file>.heap` when the run finishes, and ones requested
+     * by gc_request_heap_snapshot during the run into `<file>.<pid>.<number>.heap`.
+     */
+    bool heap_snapshots;
+
+    /*
+     * Stack maps of the bytecode (see compute_stack_maps): the collector visits only
+     * slots of frames which may hold pointers. nullptr scans the whole stack, as it
+     * is done for register code.
+     */
+    const StackMaps *stack_maps;
+
+    /*
+     * Writable copy of the file to run instead of it, with the same offsets (see
+     * fuse_compare_branches): binops are quickened in place in it. It may be shared by
+     * instances in any threads. nullptr runs the file itself without quickening.
+     */
+    bytefile *code;
+};
+
+#define DEFAULT_STACK_SIZE (64 << 20)
+
+/* Counters accumulated since the instance was (re)initialized */
+struct InterpreterStats {
+    size_t instructions; /* Executed bytecode (or register code) instructions */
+    size_t gc_cycles;
+};
+
+/*
+ * An independent instance of the interpreter with its own stack, globals and heap.
+ * The bytefile (and the code to run, see InterpreterOptions::code) is shared and must outlive the instance.
+ * All the runtime state is thread-local: an instance must be used by one thread at a time,
+ * instances used by different threads run in parallel.
+ * Errors of a program (runtime failures, failed checks, stack overflow) are not reported
+ * per instance: they exit the process, which ends all instances running in it.
+ */
+class LamaVM {
+public:
+    LamaVM(const char *file_name, const bytefile *file, const InterpreterOptions &options);
+    ~LamaVM();
+
+    LamaVM(const LamaVM &) = delete;
+    LamaVM &operator=(const LamaVM &) = delete;
+
+    /*
+     * Runs the function starting at `entrypoint` without arguments.
+     * Returns the value it returns (BOX(0) if the program stops),
+     * a pointer result is valid until the next `run` or `reset`.
+     * Globals and heap are kept between runs.
+     */
+    size_t run(const char *entrypoint);
+
+    /* Releases the stack, globals and heap, the next run starts from scratch */
+    void reset();
+
+    InterpreterStats stats() const;
+
+private:
+    struct State;
+
+    const char *file_name;
+    const bytefile *file;
+    InterpreterOptions options;
+    std::unique_ptr<State> state;
+
+    void init();
+};
+
+/* Runs a program once in a fresh instance */
+InterpreterStats interprete(
     const char *file_name,
     const bytefile *file,
-    const char *ip);
+    const char *ip,
+    const InterpreterOptions &options);
 
 #endif // INTERPRETE_H
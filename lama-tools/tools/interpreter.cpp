@@ -1,10 +1,23 @@
+#include "../runtime/runtime_common.h"
+extern "C" {
+#include "../runtime/gc.h"
+}
 #include "bytefile.h"
 #include "error.h"
+#include "escape.h"
+#include "fuse.h"
 #include "interprete.h"
+#include "link.h"
+#include "optimize.h"
+#include "register_ir.h"
+#include "stack_map.h"
 #include "verify.h"
 
 #include <chrono>
 #include <iostream>
+#include <signal.h>
+#include <thread>
+#include <vector>
 
 namespace {
 
@@ -16,30 +29,208 @@ auto measure_time(F procedure) {
     return std::chrono::duration<double, std::milli>(end - begin);
 }
 
-} // namespace
+enum class Choice {
+    Auto,
+    On,
+    Off,
+};
 
-int main(int argc, const char *argv[]) {
-    const char *file_name = argv[1];
-    const bytefile *file = read_file(file_name);
+struct CommandLine {
+    std::vector<const char *> file_names;
+    Choice intern_strings = Choice::Auto;
+    bool escape_analysis = true;
+    bool stack_maps = true;
+    bool link = false;
+    bool optimize = false;
+    bool registers = false;
+    size_t stack_size = DEFAULT_STACK_SIZE;
+    bool stats = false;
+    bool heap_snapshots = false;
+};
+
+CommandLine parse_command_line(int argc, const char *argv[]) {
+    CommandLine cl;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--intern-strings") == 0) {
+            cl.intern_strings = Choice::On;
+        } else if (strcmp(argv[i], "--no-intern-strings") == 0) {
+            cl.intern_strings = Choice::Off;
+        } else if (strcmp(argv[i], "--link") == 0) {
+            cl.link = true;
+        } else if (strcmp(argv[i], "-O") == 0) {
+            cl.optimize = true;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            cl.registers = true;
+        } else if (strcmp(argv[i], "--no-escape-analysis") == 0) {
+            cl.escape_analysis = false;
+        } else if (strcmp(argv[i], "--no-stack-maps") == 0) {
+            cl.stack_maps = false;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            cl.stats = true;
+        } else if (strcmp(argv[i], "--heap-snapshot") == 0) {
+            cl.heap_snapshots = true;
+        } else if (strcmp(argv[i], "--stack-size") == 0) {
+            ASSERT(i + 1 < argc, 1, "--stack-size expects size in megabytes");
+            char *end;
+            unsigned long megabytes = strtoul(argv[++i], &end, 10);
+            ASSERT(*end == '\0' && megabytes > 0, 1, "Invalid stack size %s", argv[i]);
+            cl.stack_size = megabytes << 20;
+        } else if (argv[i][0] == '-') {
+            FAIL(1, "Unknown option %s", argv[i]);
+        } else {
+            cl.file_names.push_back(argv[i]);
+        }
+    }
+    ASSERT(!cl.file_names.empty(), 1, "Usage: %s [--intern-strings | --no-intern-strings] [--link] [-O] [--registers] [--no-escape-analysis] [--no-stack-maps] [--stack-size <MB>] [--stats] [--heap-snapshot] <file>...", argv[0]);
+    return cl;
+}
+
+/* A loaded and verified program ready to run */
+struct Program {
+    const char *file_name;
+    const bytefile *file;
+    const char *main;
+    std::vector<bool> scoped_sexps;
+    std::vector<bool> tail_calls;
+    RegisterCode registers;
+    StackMaps stack_maps;
+    bytefile *code; /* Fused and quickened copy of `file`, shared by its instances */
+    InterpreterOptions options;
+    InterpreterStats stats;
+};
+
+void load_program(const CommandLine &cl, const char *file_name, const bytefile *file, Program *program) {
+    program->file_name = file_name;
+    program->file = file;
+    program->code = nullptr;
 
     auto entrypoints = get_entrypoints(file);
 
-    auto verification_time = measure_time([=]() {
-        verify_reachable_instructions(file, entrypoints);
+    VerificationInfo info;
+    auto verification_time = measure_time([&]() {
+        info = verify_reachable_instructions(file, entrypoints);
     });
     std::cerr << "Verification time: " << verification_time << std::endl;
 
-    const char *ip = nullptr;
+    if (cl.optimize) {
+        auto optimization_time = measure_time([&]() {
+            file = optimize(file);
+            // the optimizer keeps semantics but its output is checked as any other input
+            info = verify_reachable_instructions(file, get_entrypoints(file));
+        });
+        std::cerr << "Optimization time: " << optimization_time << std::endl;
+        program->file = file;
+    }
+
+    program->tail_calls = info.tail_calls;
+
+    if (cl.escape_analysis) {
+        auto analysis_time = measure_time([&]() {
+            program->scoped_sexps = find_scoped_allocations(file, info.functions);
+        });
+        std::cerr << "Escape analysis time: " << analysis_time << std::endl;
+    }
+
+    if (cl.registers) {
+        auto compilation_time = measure_time([&]() {
+            program->registers = compile_registers(file, info.functions, program->tail_calls,
+                                                   cl.escape_analysis ? &program->scoped_sexps : nullptr);
+        });
+        std::cerr << "Register compilation time: " << compilation_time << std::endl;
+    } else {
+        if (cl.stack_maps) {
+            auto maps_time = measure_time([&]() {
+                program->stack_maps = compute_stack_maps(file, info.functions);
+            });
+            std::cerr << "Stack maps time: " << maps_time << std::endl;
+        }
+        // the analyses above have read the plain code, their results apply to the fused copy
+        program->code = fuse_compare_branches(file);
+    }
+
+    // literals may be shared only if no string can be mutated, i.e. no StA is reachable
+    // in the whole program: then they are interned by default
+    ASSERT(cl.intern_strings != Choice::On || !info.has_aggregate_stores, 1,
+           "--intern-strings: %s stores into arrays or strings, literals can not be shared", file_name);
+    program->options = InterpreterOptions{
+        .intern_strings = cl.intern_strings == Choice::Auto ? !info.has_aggregate_stores
+                                                            : cl.intern_strings == Choice::On,
+        .scoped_sexps = cl.escape_analysis ? &program->scoped_sexps : nullptr,
+        .tail_calls = &program->tail_calls,
+        .stack_size = cl.stack_size,
+        .registers = cl.registers ? &program->registers : nullptr,
+        .heap_snapshots = cl.heap_snapshots,
+        // register code has frames of its own layout
+        .stack_maps = cl.stack_maps && !cl.registers ? &program->stack_maps : nullptr,
+        .code = program->code,
+    };
+
+    program->main = nullptr;
     for (int i = 0; i < file->public_symbols_number; i++) {
         if (strcmp(get_public_name(file, i), "main") == 0) {
-            ip = file->code_ptr + get_public_offset(file, i);
+            program->main = file->code_ptr + get_public_offset(file, i);
             break;
         }
     }
-    ASSERT(ip != nullptr, 1, "main symbol not found");
+    ASSERT(program->main != nullptr, 1, "main symbol not found in %s", file_name);
+}
+
+void request_heap_snapshot(int) {
+    gc_request_heap_snapshot();
+}
+
+} // namespace
+
+/*
+ * Several files are run in parallel, each one in its own thread with its own
+ * stack and heap, unless they are linked into one program with --link.
+ * A program failing at runtime exits the process, so the others are stopped too.
+ */
+int main(int argc, const char *argv[]) {
+    CommandLine cl = parse_command_line(argc, argv);
+    if (cl.heap_snapshots) {
+        signal(SIGUSR1, request_heap_snapshot);
+    }
+
+    std::vector<Program> programs;
+    if (cl.link) {
+        std::vector<const bytefile *> units;
+        for (const char *file_name : cl.file_names) {
+            const bytefile *unit = read_file(file_name);
+            verify_reachable_instructions(unit, get_entrypoints(unit));
+            units.push_back(unit);
+        }
+        programs.resize(1);
+        load_program(cl, cl.file_names[0], link_units(units), &programs[0]);
+    } else {
+        programs.resize(cl.file_names.size());
+        for (size_t i = 0; i < programs.size(); i++) {
+            load_program(cl, cl.file_names[i], read_file(cl.file_names[i]), &programs[i]);
+        }
+    }
 
-    auto execution_time = measure_time([=]() {
-        interprete(file_name, file, ip);
+    auto execution_time = measure_time([&]() {
+        if (programs.size() == 1) {
+            Program &p = programs[0];
+            p.stats = interprete(p.file_name, p.file, p.main, p.options);
+            return;
+        }
+        std::vector<std::thread> threads;
+        for (Program &p : programs) {
+            threads.emplace_back([&p]() {
+                p.stats = interprete(p.file_name, p.file, p.main, p.options);
+            });
+        }
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
     });
     std::cerr << "Execution time: " << execution_time << std::endl;
+
+    if (cl.stats) {
+        for (const Program &p : programs) {
+            std::cerr << "Instructions: " << p.stats.instructions << std::endl;
+            std::cerr << "GC cycles: " << p.stats.gc_cycles << std::endl;
+        }
+    }
 }
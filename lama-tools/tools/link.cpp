@@ -0,0 +1,146 @@
+#include "link.h"
+#include "bytefile.h"
+#include "error.h"
+#include "functors/default.h"
+#include "inst_reader.h"
+#include "opcode.h"
+#include "string_table.h"
+
+#include <string.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+
+/* Jmp, CJmpZ, CJmpNZ, Call and Closure have the referenced offset as the first operand */
+bool has_target(unsigned char opcode) {
+    return opcode == Opcode_Jmp || opcode == Opcode_CJmpZ || opcode == Opcode_CJmpNZ ||
+           opcode == Opcode_Call || opcode == Opcode_Closure;
+}
+
+/* String, SExp and Tag have the string as the first operand */
+bool has_string(unsigned char opcode) {
+    return opcode == Opcode_String || opcode == Opcode_SExp || opcode == Opcode_Tag;
+}
+
+/* Ld, LdA, St and StDrop of a global have its index as the operand */
+bool has_global(unsigned char opcode) {
+    unsigned char hi = opcode >> 4;
+    return (hi == HOpcode_Ld || hi == HOpcode_LdA || hi == HOpcode_St || hi == HOpcode_StDrop) &&
+           (opcode & 0xF) == Location_Global;
+}
+
+int get_int(const char *p) {
+    int value;
+    memcpy(&value, p, sizeof(int));
+    return value;
+}
+
+void set_int(char *p, int value) {
+    memcpy(p, &value, sizeof(int));
+}
+
+void add_int(char *p, int delta) {
+    set_int(p, get_int(p) + delta);
+}
+
+void emit(std::vector<char> &code, unsigned char opcode) {
+    code.push_back(opcode);
+}
+
+void emit(std::vector<char> &code, unsigned char opcode, int operand) {
+    code.push_back(opcode);
+    code.insert(code.end(), sizeof(int), 0);
+    set_int(&code[code.size() - sizeof(int)], operand);
+}
+
+void emit(std::vector<char> &code, unsigned char opcode, int first, int second) {
+    emit(code, opcode, first);
+    code.insert(code.end(), sizeof(int), 0);
+    set_int(&code[code.size() - sizeof(int)], second);
+}
+
+/* Appends the code of a unit placed at `code_base` with globals from `global_base` */
+void relocate(const bytefile *unit, int code_base, int global_base, StringTable &strings, std::vector<char> &code) {
+    InstReader reader(unit);
+    const char *code_end = unit->code_ptr + get_code_size(unit);
+    for (const char *ip = unit->code_ptr; ip != code_end;) {
+        const char *next = reader.read_inst<DefaultFunctor>(ip);
+        size_t begin = code.size();
+        code.insert(code.end(), ip, next);
+        char *inst = &code[begin];
+
+        unsigned char opcode = *ip;
+        if (has_target(opcode)) {
+            add_int(inst + 1, code_base);
+        } else if (has_string(opcode)) {
+            set_int(inst + 1, strings.add(get_string(unit, get_int(ip + 1))));
+        } else if (has_global(opcode)) {
+            add_int(inst + 1, global_base);
+        }
+        if (opcode == Opcode_Closure) {
+            // entry, count of captured locations, then the locations
+            int count = get_int(ip + 1 + sizeof(int));
+            char *entry = inst + 1 + 2 * sizeof(int);
+            for (int i = 0; i < count; i++, entry += CaptureList::entry_size) {
+                if (*entry == Location_Global) {
+                    add_int(entry + 1, global_base);
+                }
+            }
+        }
+        ip = next;
+    }
+}
+
+} // namespace
+
+const bytefile *link_units(const std::vector<const bytefile *> &units) {
+    ASSERT(!units.empty(), 1, "Nothing to link");
+
+    StringTable strings;
+    std::vector<int> publics;
+    std::vector<char> code;
+    std::vector<int> mains;
+    std::unordered_set<std::string> names;
+    int globals = 0;
+
+    for (const bytefile *unit : units) {
+        int code_base = code.size();
+        relocate(unit, code_base, globals, strings, code);
+        globals += unit->global_area_size;
+
+        for (int i = 0; i < unit->public_symbols_number; i++) {
+            const char *name = get_public_name(unit, i);
+            int offset = code_base + get_public_offset(unit, i);
+            if (strcmp(name, "main") == 0) {
+                mains.push_back(offset);
+                continue;
+            }
+            ASSERT(names.insert(name).second, 1, "Public symbol %s is defined by several units", name);
+            publics.push_back(strings.add(name));
+            publics.push_back(offset);
+        }
+    }
+
+    if (mains.size() == 1) {
+        publics.push_back(strings.add("main"));
+        publics.push_back(mains[0]);
+    } else if (mains.size() > 1) {
+        // units are initialized in order with the arguments of main, the value of the last main is the result
+        publics.push_back(strings.add("main"));
+        publics.push_back(code.size());
+        emit(code, Opcode_Begin, 2, 0);
+        for (size_t i = 0; i < mains.size(); i++) {
+            if (i > 0) {
+                emit(code, Opcode_Drop);
+            }
+            emit(code, COMPOSED(HOpcode_Ld, Location_Arg), 0);
+            emit(code, COMPOSED(HOpcode_Ld, Location_Arg), 1);
+            emit(code, Opcode_Call, mains[i], 2);
+        }
+        emit(code, Opcode_End);
+    }
+
+    return make_bytefile(globals, publics, strings.strings, code);
+}
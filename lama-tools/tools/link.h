@@ -0,0 +1,16 @@
+#ifndef LINK_H
+#define LINK_H
+
+#include "bytefile.h"
+
+#include <vector>
+
+/*
+ * Links units into one file: string tables are merged with equal strings stored once,
+ * code is concatenated with offsets relocated, global areas are laid out one after another.
+ * Public symbols are kept, except for `main` of each unit: the result has its own `main`
+ * running the units' ones in order. The result has to be verified again.
+ */
+const bytefile *link_units(const std::vector<const bytefile *> &units);
+
+#endif // LINK_H
@@ -1,6 +1,9 @@
 #ifndef OPCODE_H
 #define OPCODE_H
 
+#include <cstddef>
+#include <cstring>
+
 enum HOpcode {
     HOpcode_Binop = 0,
     HOpcode_Ld = 2,
@@ -8,6 +11,13 @@ enum HOpcode {
     HOpcode_St = 4,
     HOpcode_Patt = 6,
     HOpcode_LCall = 7,
+    HOpcode_StDrop = 8, /* ST immediately followed by DROP, produced by the optimizer */
+    /* Binops quickened by the interpreter on execution, never stored in files */
+    HOpcode_BinopInt = 9,  /* Both operands were unboxed integers */
+    HOpcode_BinopAny = 10, /* Operands of any type, checked as the runtime does it */
+    /* Comparisons fused with the following CJmpZ or CJmpNZ, see fuse_compare_branches */
+    HOpcode_CmpJmpZ = 11,
+    HOpcode_CmpJmpNZ = 12,
     HOpcode_Stop = 15,
 };
 
@@ -105,6 +115,58 @@ struct LocationEntry {
     int index;
 };
 
+/*
+ * Captured locations of a Closure instruction, read in place from the code:
+ * each one is a kind byte followed by an int index.
+ */
+class CaptureList {
+public:
+    static constexpr size_t entry_size = sizeof(char) + sizeof(int);
+
+    class iterator {
+    public:
+        iterator(const char *ptr) : ptr(ptr) {}
+
+        inline LocationEntry operator*() const {
+            int index;
+            memcpy(&index, ptr + 1, sizeof(int));
+            return LocationEntry{(Location)*ptr, index};
+        }
+        inline iterator &operator++() {
+            ptr += entry_size;
+            return *this;
+        }
+        inline bool operator!=(const iterator &other) const {
+            return ptr != other.ptr;
+        }
+
+    private:
+        const char *ptr;
+    };
+
+    CaptureList(const char *entries, int count) : entries(entries), count(count) {}
+
+    inline int size() const {
+        return count;
+    }
+    inline LocationEntry operator[](int i) const {
+        return *iterator(entries + i * entry_size);
+    }
+    inline const char *data() const {
+        return entries;
+    }
+    inline iterator begin() const {
+        return iterator(entries);
+    }
+    inline iterator end() const {
+        return iterator(entries + count * entry_size);
+    }
+
+private:
+    const char *entries;
+    int count;
+};
+
 #define LCALLS(MACRO)               \
     MACRO(LCall_Lread, "Lread")     \
     MACRO(LCall_Lwrite, "Lwrite")   \
@@ -0,0 +1,562 @@
+#include "optimize.h"
+#include "bytefile.h"
+#include "cfg.h"
+#include "error.h"
+#include "functors/default.h"
+#include "functors/stack_depth.h"
+#include "functors/successors.h"
+#include "inst_reader.h"
+#include "opcode.h"
+
+#include <algorithm>
+#include <queue>
+#include <stdint.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+/* Each round re-reads the result, so code made unreachable by a round is removed by the next one */
+#define MAX_OPTIMIZATION_ROUNDS 8
+
+/* Functions with bodies up to this size in bytes are inlined */
+#define INLINE_MAX_SIZE 64
+
+/* Inlining may grow the code by a quarter, but small programs may always grow by that much */
+#define INLINE_GROWTH_DIVISOR 4
+#define INLINE_MIN_GROWTH 1024
+
+namespace {
+
+/*
+ * An instruction of the code being rewritten. Code references are kept as indices
+ * of instructions, so instructions can be removed and replaced before offsets are assigned.
+ * A reference to a removed instruction means the first instruction left after it.
+ */
+struct Inst {
+    std::vector<char> bytes;
+    int target; /* Instruction referenced by a jump, call or closure, -1 if none */
+    bool removed;
+    int offset; /* In the decoded file, -1 for instructions made by the optimizer */
+};
+
+struct Code {
+    std::vector<Inst> insts;
+    std::vector<int> publics; /* Pairs of name and instruction index */
+};
+
+static inline unsigned char opcode(const Inst &inst) {
+    return inst.bytes[0];
+}
+
+/* Jmp, CJmpZ, CJmpNZ, Call and Closure have the referenced offset as the first operand */
+static inline bool has_target(unsigned char opcode) {
+    return opcode == Opcode_Jmp || opcode == Opcode_CJmpZ || opcode == Opcode_CJmpNZ ||
+           opcode == Opcode_Call || opcode == Opcode_Closure;
+}
+
+static inline int get_operand(const Inst &inst) {
+    int value;
+    memcpy(&value, inst.bytes.data() + 1, sizeof(int));
+    return value;
+}
+
+static inline void set_operand(Inst &inst, int value) {
+    memcpy(inst.bytes.data() + 1, &value, sizeof(int));
+}
+
+static inline Inst make_inst(unsigned char opcode, int operand, int target) {
+    Inst inst{std::vector<char>(1 + sizeof(int)), target, false, -1};
+    inst.bytes[0] = opcode;
+    set_operand(inst, operand);
+    return inst;
+}
+
+static Code decode(const bytefile *file) {
+    std::vector<bool> reachable = mark_reachable_instructions(file, get_entrypoints(file));
+    InstReader reader(file);
+    Code code;
+
+    std::unordered_map<int, int> index;
+    const char *code_end = file->code_ptr + get_code_size(file);
+    for (const char *ip = file->code_ptr; ip != code_end;) {
+        const char *next = reader.read_inst<DefaultFunctor>(ip);
+        // the verifier finds the end of a function by its End, so it is never removed
+        if (reachable[ip - file->code_ptr] || *ip == Opcode_End) {
+            index[ip - file->code_ptr] = code.insts.size();
+            code.insts.push_back(Inst{std::vector<char>(ip, next), -1, false, (int)(ip - file->code_ptr)});
+        }
+        ip = next;
+    }
+
+    for (Inst &inst : code.insts) {
+        if (has_target(opcode(inst))) {
+            inst.target = index.at(get_operand(inst));
+        }
+    }
+    for (int i = 0; i < file->public_symbols_number; i++) {
+        code.publics.push_back(file->public_ptr[i * 2]);
+        code.publics.push_back(index.at(get_public_offset(file, i)));
+    }
+    return code;
+}
+
+static const bytefile *encode(const bytefile *base, const Code &code) {
+    // a removed instruction gets the offset of the first instruction left after it
+    std::vector<int> offsets(code.insts.size() + 1);
+    int offset = 0;
+    for (size_t i = 0; i < code.insts.size(); i++) {
+        offsets[i] = offset;
+        if (!code.insts[i].removed) {
+            offset += code.insts[i].bytes.size();
+        }
+    }
+    offsets[code.insts.size()] = offset;
+
+    std::vector<char> bytes;
+    for (const Inst &inst : code.insts) {
+        if (inst.removed) {
+            continue;
+        }
+        Inst copy = inst;
+        if (copy.target >= 0) {
+            set_operand(copy, offsets[copy.target]);
+        }
+        bytes.insert(bytes.end(), copy.bytes.begin(), copy.bytes.end());
+    }
+
+    std::vector<int> publics = code.publics;
+    for (size_t i = 1; i < publics.size(); i += 2) {
+        publics[i] = offsets[publics[i]];
+    }
+    return make_bytefile(base, publics, bytes);
+}
+
+/*
+ * Replaces calls of small functions by their bodies. Arguments are stored into locals
+ * added to the caller, callee locals get locals after them; all inlined bodies of a caller
+ * share these locals since they never run at the same time. End and Ret become jumps
+ * to the instruction after the call. Only bodies of the original code are inlined,
+ * so inlining does not recurse.
+ */
+class Inliner {
+public:
+    Inliner(const bytefile *file, Code *code) : file(file), code(code), insts(code->insts) {}
+
+    /* Returns whether some call has been inlined */
+    bool run() {
+        find_functions();
+        std::vector<int> sites = choose_sites();
+        if (sites.empty()) {
+            return false;
+        }
+        rebuild(sites);
+        return true;
+    }
+
+private:
+    struct Callee {
+        int begin; /* Index of Begin */
+        int end;   /* Index of the End of the body */
+        int args;
+        int locals;
+        int size; /* Bytes of the body without Begin and End */
+        bool inlinable;
+    };
+
+    const bytefile *file;
+    Code *code;
+    std::vector<Inst> &insts;
+    std::unordered_map<int, Callee> callees; /* By index of Begin */
+    std::vector<int> function;               /* Index of Begin of the function of each instruction */
+
+    static int get_int(const Inst &inst, int k) {
+        int value;
+        memcpy(&value, inst.bytes.data() + 1 + k * sizeof(int), sizeof(int));
+        return value;
+    }
+
+    static void set_int(Inst &inst, int k, int value) {
+        memcpy(inst.bytes.data() + 1 + k * sizeof(int), &value, sizeof(int));
+    }
+
+    void find_functions() {
+        function.assign(insts.size(), -1);
+        for (int i = 0; i < (int)insts.size(); i++) {
+            unsigned char op = opcode(insts[i]);
+            if (op == Opcode_Begin || op == Opcode_CBegin) {
+                int end = i;
+                while (opcode(insts[end]) != Opcode_End) {
+                    end++;
+                }
+                Callee callee{
+                    .begin = i,
+                    .end = end,
+                    .args = get_int(insts[i], 0),
+                    .locals = get_int(insts[i], 1),
+                    .size = 0,
+                    .inlinable = op == Opcode_Begin,
+                };
+                for (int j = i; j <= end; j++) {
+                    function[j] = i;
+                    if (j != i && j != end) {
+                        callee.size += insts[j].bytes.size();
+                    }
+                    // captured locations would have to be remapped too
+                    callee.inlinable &= opcode(insts[j]) != Opcode_Closure;
+                }
+                callee.inlinable &= callee.size <= INLINE_MAX_SIZE && returns_one_value(i);
+                callees[i] = callee;
+                i = end;
+            }
+        }
+    }
+
+    /*
+     * A frame drops values left under the result, an inlined body can not.
+     * Relies on StackDepthFunctor counting operands exactly; a body whose depths
+     * disagree where paths join is not inlined.
+     */
+    bool returns_one_value(int begin) {
+        std::vector<int> jumps;
+        StackLayout layout{
+            .globals = file->global_area_size,
+            .locals = 0,
+            .frame_locals = 0,
+            .args = 0,
+            .captured = 0,
+            .jumps = &jumps,
+            .is_closure = false,
+        };
+        InstReader reader(file);
+        const char *begin_ip = file->code_ptr + insts[begin].offset;
+        int locals_count = get_int(insts[begin], 1);
+
+        std::unordered_map<const char *, int> depths; /* Operand stack depth before each visited instruction */
+        std::queue<std::pair<const char *, StackLayout>> q;
+        q.push({begin_ip, layout});
+        depths[begin_ip] = 0;
+        while (!q.empty()) {
+            auto [ip, layout] = q.front();
+            q.pop();
+            int depth = layout.locals - (ip == begin_ip ? 0 : locals_count);
+            if ((*ip == Opcode_End || *ip == Opcode_Ret) && depth != 1) {
+                return false;
+            }
+
+            const char *next = reader.read_inst<StackDepthFunctor>(ip, &layout);
+            std::vector<const char *> successors;
+            reader.read_inst<SuccessorsFunctor>(ip, file->code_ptr, next, &successors);
+            for (const char *s : successors) {
+                if (s != next && (*ip == Opcode_Call || *ip == Opcode_Closure)) {
+                    continue;
+                }
+                int successor_depth = layout.locals - locals_count;
+                auto it = depths.find(s);
+                if (it == depths.end()) {
+                    depths[s] = successor_depth;
+                    q.push({s, layout});
+                } else if (it->second != successor_depth) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    const Callee *inlinable_callee(int i) const {
+        if (opcode(insts[i]) != Opcode_Call) {
+            return nullptr;
+        }
+        auto it = callees.find(insts[i].target);
+        if (it == callees.end() || !it->second.inlinable || it->second.begin == function[i] ||
+            it->second.args != get_int(insts[i], 1)) {
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    /* Call sites of the smallest callees first, while the growth budget lasts */
+    std::vector<int> choose_sites() {
+        std::vector<int> sites;
+        int code_size = 0;
+        for (int i = 0; i < (int)insts.size(); i++) {
+            code_size += insts[i].bytes.size();
+            if (inlinable_callee(i) != nullptr) {
+                sites.push_back(i);
+            }
+        }
+        std::stable_sort(sites.begin(), sites.end(), [this](int a, int b) {
+            return inlinable_callee(a)->size < inlinable_callee(b)->size;
+        });
+
+        int budget = std::max(code_size / INLINE_GROWTH_DIVISOR, INLINE_MIN_GROWTH);
+        std::vector<int> chosen;
+        for (int site : sites) {
+            const Callee *callee = inlinable_callee(site);
+            int growth = callee->size + callee->args * (int)(1 + sizeof(int)) - (int)insts[site].bytes.size();
+            if (growth <= budget) {
+                budget -= growth;
+                chosen.push_back(site);
+            }
+        }
+        std::sort(chosen.begin(), chosen.end());
+        return chosen;
+    }
+
+    static Inst relocate_location(const Inst &inst, int args_base, int locals_base) {
+        Inst copy = inst;
+        unsigned char op = opcode(inst);
+        unsigned char hi = op >> 4, location = op & 0x0F;
+        if ((hi == HOpcode_Ld || hi == HOpcode_LdA || hi == HOpcode_St || hi == HOpcode_StDrop) &&
+            (location == Location_Arg || location == Location_Local)) {
+            int base = location == Location_Arg ? args_base : locals_base;
+            copy.bytes[0] = COMPOSED(hi, Location_Local);
+            set_operand(copy, base + get_operand(inst));
+        }
+        return copy;
+    }
+
+    void rebuild(const std::vector<int> &sites) {
+        std::vector<Inst> result;
+        std::vector<bool> relocated; /* Whether the target is already an index in the result */
+        std::vector<int> index(insts.size() + 1);
+
+        // locals added to each caller
+        std::unordered_map<int, int> extra_locals;
+        for (int site : sites) {
+            const Callee *callee = inlinable_callee(site);
+            int &extra = extra_locals[function[site]];
+            extra = std::max(extra, callee->args + callee->locals);
+        }
+
+        size_t next_site = 0;
+        for (int i = 0; i < (int)insts.size(); i++) {
+            index[i] = result.size();
+            if (next_site == sites.size() || sites[next_site] != i) {
+                result.push_back(insts[i]);
+                relocated.push_back(false);
+                continue;
+            }
+            next_site++;
+
+            const Callee *callee = inlinable_callee(i);
+            int args_base = get_int(insts[function[i]], 1);
+            int locals_base = args_base + callee->args;
+
+            // the last argument is on top
+            for (int a = callee->args - 1; a >= 0; a--) {
+                result.push_back(make_inst(COMPOSED(HOpcode_StDrop, Location_Local), args_base + a, -1));
+                relocated.push_back(false);
+            }
+
+            int body = result.size() - (callee->begin + 1);
+            for (int j = callee->begin + 1; j <= callee->end; j++) {
+                const Inst &inst = insts[j];
+                unsigned char op = opcode(inst);
+                if (op == Opcode_End || op == Opcode_Ret) {
+                    result.push_back(make_inst(Opcode_Jmp, 0, i + 1));
+                    relocated.push_back(false);
+                    continue;
+                }
+                result.push_back(relocate_location(inst, args_base, locals_base));
+                // jumps stay in the body, calls go to the original functions
+                bool internal = op != Opcode_Call && inst.target >= 0;
+                if (internal) {
+                    result.back().target = inst.target + body;
+                }
+                relocated.push_back(internal);
+            }
+        }
+        index[insts.size()] = result.size();
+
+        for (size_t k = 0; k < result.size(); k++) {
+            if (result[k].target >= 0 && !relocated[k]) {
+                result[k].target = index[result[k].target];
+            }
+        }
+        for (auto [begin, extra] : extra_locals) {
+            Inst &inst = result[index[begin]];
+            set_int(inst, 1, get_int(inst, 1) + extra);
+        }
+        for (size_t i = 1; i < code->publics.size(); i += 2) {
+            code->publics[i] = index[code->publics[i]];
+        }
+        insts = std::move(result);
+    }
+};
+
+class Rewriter {
+public:
+    Rewriter(Code *code) : insts(code->insts), publics(code->publics) {}
+
+    /* Returns whether the code has changed */
+    bool run() {
+        bool changed = thread_jumps();
+        mark_labels();
+        for (int i = live(0); i < size(); i = live(i + 1)) {
+            // a folded constant may start another sequence
+            while (!insts[i].removed && fold(i)) {
+                changed = true;
+            }
+        }
+        changed |= remove_jumps_to_next();
+        return changed;
+    }
+
+private:
+    std::vector<Inst> &insts;
+    const std::vector<int> &publics;
+    std::vector<bool> label;
+
+    int size() const {
+        return insts.size();
+    }
+
+    /* The first instruction left starting from `i` */
+    int live(int i) const {
+        while (i < size() && insts[i].removed) {
+            i++;
+        }
+        return i;
+    }
+
+    void mark_labels() {
+        label.assign(size() + 1, false);
+        for (const Inst &inst : insts) {
+            if (!inst.removed && inst.target >= 0) {
+                label[live(inst.target)] = true;
+            }
+        }
+        for (size_t i = 1; i < publics.size(); i += 2) {
+            label[live(publics[i])] = true;
+        }
+    }
+
+    /* A jump to an unconditional jump goes directly to its target */
+    bool thread_jumps() {
+        bool changed = false;
+        for (Inst &inst : insts) {
+            unsigned char op = opcode(inst);
+            if (inst.removed || (op != Opcode_Jmp && op != Opcode_CJmpZ && op != Opcode_CJmpNZ)) {
+                continue;
+            }
+            int target = live(inst.target);
+            // the bound stops on cycles of jumps
+            for (int steps = 0; steps < size() && opcode(insts[target]) == Opcode_Jmp; steps++) {
+                target = live(insts[target].target);
+            }
+            if (target != live(inst.target)) {
+                inst.target = target;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    bool remove_jumps_to_next() {
+        bool changed = false;
+        for (int i = live(0); i < size(); i = live(i + 1)) {
+            if (opcode(insts[i]) == Opcode_Jmp && live(insts[i].target) == live(i + 1)) {
+                insts[i].removed = true;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    /* Rewrites the sequence starting at `i`, instructions after the first one must not be labels */
+    bool fold(int i) {
+        int j = live(i + 1);
+        if (j == size() || label[j]) {
+            return false;
+        }
+        Inst &fst = insts[i], &snd = insts[j];
+
+        // pushes dropped right away
+        if (opcode(snd) == Opcode_Drop &&
+            (opcode(fst) == Opcode_Const || opcode(fst) == Opcode_Dup || (opcode(fst) >> 4) == HOpcode_Ld)) {
+            fst.removed = snd.removed = true;
+            return true;
+        }
+
+        if (opcode(snd) == Opcode_Drop && (opcode(fst) >> 4) == HOpcode_St) {
+            fst.bytes[0] = COMPOSED(HOpcode_StDrop, opcode(fst) & 0x0F);
+            snd.removed = true;
+            return true;
+        }
+
+        if (opcode(fst) == Opcode_Const && (opcode(snd) == Opcode_CJmpZ || opcode(snd) == Opcode_CJmpNZ)) {
+            bool zero = unbox(get_operand(fst)) == 0;
+            if (zero == (opcode(snd) == Opcode_CJmpZ)) {
+                fst = make_inst(Opcode_Jmp, 0, snd.target);
+            } else {
+                fst.removed = true;
+            }
+            snd.removed = true;
+            return true;
+        }
+
+        int k = live(j + 1);
+        if (k == size() || label[k]) {
+            return false;
+        }
+        Inst &thd = insts[k];
+
+        int result;
+        if (opcode(fst) == Opcode_Const && opcode(snd) == Opcode_Const && (opcode(thd) >> 4) == HOpcode_Binop &&
+            evaluate(opcode(thd) & 0x0F, unbox(get_operand(fst)), unbox(get_operand(snd)), &result)) {
+            set_operand(fst, result);
+            snd.removed = thd.removed = true;
+            return true;
+        }
+        return false;
+    }
+
+    /* The value a constant has after boxing and unboxing, which drops its highest bit */
+    static int unbox(int value) {
+        return (int)((uint32_t)value << 1) >> 1;
+    }
+
+    /* Computes a binary operation as the interpreter does, fails on division by zero */
+    static bool evaluate(int binop, int lhv, int rhv, int *result) {
+        int64_t l = lhv, r = rhv;
+        if ((binop == Binop_Div || binop == Binop_Rem) && r == 0) {
+            return false;
+        }
+
+#define CASE_BINOP(Binop_Name, op)   \
+    case Binop_Name:                 \
+        *result = (int32_t)(l op r); \
+        return true;
+
+        switch (binop) {
+            BINOPS(CASE_BINOP)
+        }
+#undef CASE_BINOP
+        return false;
+    }
+};
+
+} // namespace
+
+const bytefile *optimize(const bytefile *file) {
+    const bytefile *original = file;
+    for (int round = 0; round < MAX_OPTIMIZATION_ROUNDS; round++) {
+        Code code = decode(file);
+        // inlined bodies are cleaned up by the following rounds
+        bool changed = round == 0 && Inliner(file, &code).run();
+        changed |= Rewriter(&code).run();
+        const bytefile *optimized = encode(file, code);
+
+        bool done = !changed && optimized->size == file->size;
+        if (file != original) {
+            free(file->global_ptr);
+            free((void *)file);
+        }
+        file = optimized;
+        if (done) {
+            break;
+        }
+    }
+    return file;
+}
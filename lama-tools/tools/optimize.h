@@ -0,0 +1,14 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "bytefile.h"
+
+/*
+ * Rewrites verified bytecode into an equivalent new file: inlines calls of small functions,
+ * folds constant expressions and branches, threads jumps, fuses ST followed by DROP into STDROP,
+ * removes pushes dropped right away and unreachable instructions.
+ * Public symbols are kept, the result has to be verified again.
+ */
+const bytefile *optimize(const bytefile *file);
+
+#endif // OPTIMIZE_H
@@ -0,0 +1,535 @@
+#include "register_ir.h"
+#include "../runtime/runtime_common.h"
+#include "bytefile.h"
+#include "error.h"
+#include "functors/default.h"
+#include "functors/stack_depth.h"
+#include "functors/successors.h"
+#include "inst_reader.h"
+#include "opcode.h"
+
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+class FunctionCompiler;
+
+template <unsigned char opcode, typename... Args>
+struct RegisterFunctor {
+    FunctionCompiler *compiler;
+    inline void operator()(Args...);
+};
+
+class FunctionCompiler {
+public:
+    FunctionCompiler(const bytefile *file, const RegisterCode *code, const std::vector<bool> &tail_calls,
+                     const std::vector<bool> *scoped_sexps)
+        : file(file), code(code), tail_calls(tail_calls), scoped_sexps(scoped_sexps) {}
+
+    RFunction compile(const char *begin) {
+        compute_heights(begin);
+        function = RFunction{.begin = begin, .locals = 0, .frame_size = 0};
+
+        InstReader reader(file);
+        bool after_terminator = false; /* The instruction is only entered by jumps */
+        for (const char *ip = begin;; ip = next) {
+            next = reader.read_inst<DefaultFunctor>(ip);
+            offset = ip - file->code_ptr;
+            auto height = heights.find(offset);
+            if (height != heights.end()) {
+                // a jump target is entered with all operands in their own registers
+                if (targets.count(offset) != 0 && !after_terminator) {
+                    materialize_all();
+                }
+                if (targets.count(offset) != 0 || after_terminator) {
+                    reset_stack(height->second);
+                }
+                starts[offset] = function.code.size();
+                reader.read_inst<RegisterFunctor, FunctionCompiler *>(ip, this);
+                after_terminator = is_terminator(*ip);
+            }
+            if (*ip == Opcode_End) {
+                break;
+            }
+        }
+
+        for (auto [index, target] : fixups) {
+            function.code[index].a = starts.at(target) - index;
+        }
+        return std::move(function);
+    }
+
+    const bytefile *file;
+    const RegisterCode *code;
+    const std::vector<bool> &tail_calls;
+    const std::vector<bool> *scoped_sexps;
+    RFunction function;
+    const char *next;
+    int offset;
+
+    int push() {
+        int r = function.locals + stack.size();
+        stack.push_back(r);
+        return r;
+    }
+
+    void push_local(int r) {
+        stack.push_back(r);
+        result = -1;
+    }
+
+    void drop() {
+        pop();
+        result = -1;
+    }
+
+    int pop() {
+        ASSERT(!stack.empty(), 1, "Stack underflow at offset 0x%.8x", offset);
+        int r = stack.back();
+        stack.pop_back();
+        return r;
+    }
+
+    int top() const {
+        return stack.back();
+    }
+
+    /* Register of the deepest of `n` operands on top of the stack */
+    int base(int n) const {
+        return function.locals + stack.size() - n;
+    }
+
+    /* Puts `n` operands on top of the stack into their own registers */
+    void materialize_top(int n) {
+        for (size_t k = stack.size() - n; k < stack.size(); k++) {
+            int r = function.locals + k;
+            if (stack[k] != r) {
+                emit(RInst{.op = ROp_Move, .a = r, .b = stack[k]});
+                stack[k] = r;
+            }
+        }
+    }
+
+    void materialize_all() {
+        materialize_top(stack.size());
+    }
+
+    /* Operands still read from local `r` get their own registers before it changes */
+    void materialize_local(int r) {
+        for (size_t k = 0; k < stack.size(); k++) {
+            if (stack[k] == r) {
+                emit(RInst{.op = ROp_Move, .a = (int)(function.locals + k), .b = r});
+                stack[k] = function.locals + k;
+            }
+        }
+    }
+
+    void emit(const RInst &inst) {
+        function.code.push_back(inst);
+        result = -1;
+    }
+
+    /* An instruction which only writes its result to R(a), so it can write a local instead */
+    void emit_result(const RInst &inst) {
+        emit(inst);
+        result = function.code.size() - 1;
+    }
+
+    void emit_jump(RInst inst, int target) {
+        fixups.push_back({(int)function.code.size(), target});
+        emit(inst);
+    }
+
+    void store_local(int r) {
+        int src = top();
+        if (src == r) {
+            return;
+        }
+        stack.pop_back();
+        bool referenced = std::find(stack.begin(), stack.end(), r) != stack.end();
+        stack.push_back(src);
+
+        if (!referenced && result >= 0 && function.code[result].a == src) {
+            function.code[result].a = r;
+            stack.back() = r;
+            result = -1;
+            return;
+        }
+        materialize_local(r);
+        emit(RInst{.op = ROp_Move, .a = r, .b = src});
+    }
+
+    void begin(int args_count, int locals_count) {
+        function.locals = locals_count;
+        function.frame_size = locals_count + max_depth;
+        emit(RInst{.op = ROp_Begin, .a = function.frame_size, .b = locals_count, .c = args_count});
+    }
+
+    bool is_tail_call() const {
+        return tail_calls[offset];
+    }
+
+    int function_index(int target) const {
+        int index = code->index[target];
+        ASSERT(index >= 0, 1, "Call of 0x%.8x which is not a verified function", target);
+        return index;
+    }
+
+    bool is_scoped() const {
+        return scoped_sexps != nullptr && (*scoped_sexps)[offset];
+    }
+
+private:
+    std::unordered_map<int, int> heights; /* Operand stack depth before each reachable instruction */
+    std::unordered_map<int, int> targets; /* Jump targets, as keys */
+    std::unordered_map<int, int> starts;  /* First register instruction of each bytecode instruction */
+    std::vector<std::pair<int, int>> fixups;
+    std::vector<int> stack; /* Register of each operand */
+    int max_depth = 0;
+    int result = -1; /* Last instruction if its result can be retargeted */
+
+    static bool is_terminator(unsigned char opcode) {
+        return opcode == Opcode_Jmp || opcode == Opcode_End || opcode == Opcode_Ret ||
+               opcode == Opcode_Fail || opcode == COMPOSED(HOpcode_Stop, 0);
+    }
+
+    void reset_stack(int depth) {
+        stack.clear();
+        for (int k = 0; k < depth; k++) {
+            stack.push_back(function.locals + k);
+        }
+        result = -1;
+    }
+
+    /* Depths as the verifier computes them, they have to agree on all paths */
+    void compute_heights(const char *begin) {
+        std::vector<int> jumps;
+        StackLayout layout{
+            .globals = file->global_area_size,
+            .locals = 0,
+            .frame_locals = 0,
+            .args = 0,
+            .captured = 0,
+            .jumps = &jumps,
+            .is_closure = *begin == Opcode_CBegin,
+        };
+        InstReader reader(file);
+        int locals_count = 0;
+
+        std::queue<std::pair<const char *, StackLayout>> q;
+        q.push({begin, layout});
+        heights[begin - file->code_ptr] = 0;
+        while (!q.empty()) {
+            auto [ip, layout] = q.front();
+            q.pop();
+
+            const char *next = reader.read_inst<StackDepthFunctor>(ip, &layout);
+            if (ip == begin) {
+                locals_count = layout.locals;
+            }
+            int depth = layout.locals - locals_count;
+            ASSERT(depth >= 0, 1, "Stack underflow at offset 0x%.8x", ip - file->code_ptr);
+            max_depth = std::max(max_depth, depth);
+
+            std::vector<const char *> successors;
+            reader.read_inst<SuccessorsFunctor>(ip, file->code_ptr, next, &successors);
+            for (const char *s : successors) {
+                // calls and closures have their entries as successors
+                if (s != next && (*ip == Opcode_Call || *ip == Opcode_Closure)) {
+                    continue;
+                }
+                auto [it, inserted] = heights.emplace(s - file->code_ptr, depth);
+                ASSERT(it->second == depth, 1, "Stack depth differs on paths to offset 0x%.8x", s - file->code_ptr);
+                if (inserted) {
+                    q.push({s, layout});
+                }
+            }
+        }
+        for (int jump : jumps) {
+            targets[jump] = 1;
+        }
+    }
+};
+
+template <unsigned char opcode, typename... Args>
+inline void RegisterFunctor<opcode, Args...>::operator()(Args...) {
+    FAIL(1, "Opcode %d can not be translated to registers", opcode);
+}
+
+#define REGISTER_FUNCTOR(opcode, ...)                                     \
+    template <>                                                           \
+    inline void RegisterFunctor<opcode, ##__VA_ARGS__>::operator()
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Begin), int, int)(int args_count, int locals_count) {
+    compiler->begin(args_count, locals_count);
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_CBegin), int, int)(int args_count, int locals_count) {
+    compiler->begin(args_count, locals_count);
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Const), int)(int value) {
+    int r = compiler->push();
+    compiler->emit_result(RInst{.op = ROp_Const, .a = r, .imm = (size_t)BOX(value)});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_String), const char *)(const char *literal) {
+    int r = compiler->push();
+    compiler->emit_result(RInst{.op = ROp_String, .a = r, .ptr = literal});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_SExp), const char *, int)(const char *tag, int n) {
+    compiler->materialize_top(n);
+    int r = compiler->base(n);
+    for (int i = 0; i < n; i++) {
+        compiler->pop();
+    }
+    compiler->push();
+    compiler->emit(RInst{.op = ROp_SExp, .sub = compiler->is_scoped(), .a = r, .b = n, .ptr = tag});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_StI))() {
+    // the address may point to a local read by pending operands
+    compiler->materialize_all();
+    int v = compiler->pop();
+    int addr = compiler->pop();
+    int r = compiler->push();
+    compiler->emit(RInst{.op = ROp_StoreInd, .a = r, .b = addr, .c = v});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_StA))() {
+    // as for StI, the target may be an address of a local given by LdA
+    compiler->materialize_all();
+    int r = compiler->base(3);
+    for (int i = 0; i < 3; i++) {
+        compiler->pop();
+    }
+    compiler->push();
+    compiler->emit(RInst{.op = ROp_StoreElem, .a = r});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Jmp), int)(int target) {
+    compiler->materialize_all();
+    compiler->emit_jump(RInst{.op = ROp_Jmp}, target);
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_CJmpZ), int)(int target) {
+    int condition = compiler->pop();
+    compiler->materialize_all();
+    compiler->emit_jump(RInst{.op = ROp_JmpZ, .b = condition}, target);
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_CJmpNZ), int)(int target) {
+    int condition = compiler->pop();
+    compiler->materialize_all();
+    compiler->emit_jump(RInst{.op = ROp_JmpNZ, .b = condition}, target);
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_End))() {
+    compiler->emit(RInst{.op = ROp_Ret, .a = compiler->pop()});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Ret))() {
+    compiler->emit(RInst{.op = ROp_Ret, .a = compiler->pop()});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Drop))() {
+    compiler->drop();
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Dup))() {
+    int src = compiler->top();
+    if (src < compiler->function.locals) {
+        compiler->push_local(src);
+    } else {
+        int r = compiler->push();
+        compiler->emit_result(RInst{.op = ROp_Move, .a = r, .b = src});
+    }
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Swap))() {
+    compiler->materialize_top(2);
+    int r = compiler->base(2);
+    compiler->emit(RInst{.op = ROp_Swap, .a = r, .b = r + 1});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Elem))() {
+    int i = compiler->pop();
+    int p = compiler->pop();
+    int r = compiler->push();
+    compiler->emit_result(RInst{.op = ROp_Elem, .a = r, .b = p, .c = i});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Closure), int, CaptureList)(int entry, CaptureList captured) {
+    // captured locals are read from their own slots
+    int r = compiler->push();
+    compiler->emit_result(RInst{
+        .op = ROp_Closure,
+        .a = r,
+        .b = entry,
+        .c = captured.size(),
+        .ptr = captured.data(),
+    });
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_CallC), const char *, int)(const char *, int args_count) {
+    compiler->materialize_all();
+    int r = compiler->base(args_count + 1);
+    for (int i = 0; i <= args_count; i++) {
+        compiler->pop();
+    }
+    compiler->push();
+    compiler->emit(RInst{.op = ROp_CallC, .sub = compiler->is_tail_call(), .a = r, .b = args_count});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Call), const char *, int, int)(const char *, int target, int args_count) {
+    compiler->materialize_all();
+    int r = compiler->base(args_count);
+    for (int i = 0; i < args_count; i++) {
+        compiler->pop();
+    }
+    compiler->push();
+    compiler->emit(RInst{
+        .op = ROp_Call,
+        .sub = compiler->is_tail_call(),
+        .a = r,
+        .b = args_count,
+        .c = compiler->function_index(target),
+    });
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Tag), const char *, int)(const char *tag, int n) {
+    int x = compiler->pop();
+    int r = compiler->push();
+    compiler->emit_result(RInst{.op = ROp_Tag, .a = r, .b = x, .c = n, .ptr = tag});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Array), int)(int n) {
+    int x = compiler->pop();
+    int r = compiler->push();
+    compiler->emit_result(RInst{.op = ROp_ArrayPatt, .a = r, .b = x, .c = n});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Fail), int, int)(int line, int col) {
+    compiler->emit(RInst{.op = ROp_Fail, .a = compiler->pop(), .b = line, .c = col});
+}
+
+REGISTER_FUNCTOR(SINGLE(Opcode_Line), int)(int) {}
+
+REGISTER_FUNCTOR(COMPOSED(HOpcode_Stop, 0))() {
+    compiler->emit(RInst{.op = ROp_Stop});
+}
+
+REGISTER_FUNCTOR(COMPOSED(HOpcode_LCall, LCall_Lread))() {
+    int r = compiler->push();
+    compiler->emit_result(RInst{.op = ROp_LCall, .sub = LCall_Lread, .a = r});
+}
+
+REGISTER_FUNCTOR(COMPOSED(HOpcode_LCall, LCall_Barray), int)(int n) {
+    compiler->materialize_top(n);
+    int r = compiler->base(n);
+    for (int i = 0; i < n; i++) {
+        compiler->pop();
+    }
+    compiler->push();
+    compiler->emit(RInst{.op = ROp_Array, .a = r, .b = n});
+}
+
+#undef REGISTER_FUNCTOR
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_LCall && (opcode & 0x0F) != LCall_Lread && (opcode & 0x0F) != LCall_Barray)
+struct RegisterFunctor<opcode> {
+    FunctionCompiler *compiler;
+    inline void operator()() {
+        int x = compiler->pop();
+        int r = compiler->push();
+        compiler->emit_result(RInst{.op = ROp_LCall, .sub = opcode & 0x0F, .a = r, .b = x});
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_Binop)
+struct RegisterFunctor<opcode> {
+    FunctionCompiler *compiler;
+    inline void operator()() {
+        int rhv = compiler->pop();
+        int lhv = compiler->pop();
+        int r = compiler->push();
+        compiler->emit_result(RInst{.op = (ROpcode)(ROp_Binop + (opcode & 0x0F)), .a = r, .b = lhv, .c = rhv});
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_Patt)
+struct RegisterFunctor<opcode> {
+    FunctionCompiler *compiler;
+    inline void operator()() {
+        int x = compiler->pop();
+        int y = (opcode & 0x0F) == Pattern_String ? compiler->pop() : -1;
+        int r = compiler->push();
+        compiler->emit_result(RInst{.op = ROp_Patt, .sub = opcode & 0x0F, .a = r, .b = x, .c = y});
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_Ld)
+struct RegisterFunctor<opcode, int> {
+    FunctionCompiler *compiler;
+    inline void operator()(int index) {
+        if ((opcode & 0x0F) == Location_Local && index < compiler->function.locals) {
+            compiler->push_local(index);
+            return;
+        }
+        int r = compiler->push();
+        compiler->emit_result(RInst{.op = ROp_Load, .sub = opcode & 0x0F, .a = r, .b = index});
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_LdA)
+struct RegisterFunctor<opcode, int> {
+    FunctionCompiler *compiler;
+    inline void operator()(int index) {
+        int r = compiler->push();
+        compiler->push();
+        compiler->emit(RInst{.op = ROp_LoadAddr, .sub = opcode & 0x0F, .a = r, .b = index});
+    }
+};
+
+template <unsigned char opcode>
+    requires((opcode >> 4) == HOpcode_St || (opcode >> 4) == HOpcode_StDrop)
+struct RegisterFunctor<opcode, int> {
+    FunctionCompiler *compiler;
+    inline void operator()(int index) {
+        if ((opcode & 0x0F) == Location_Local && index < compiler->function.locals) {
+            compiler->store_local(index);
+        } else {
+            compiler->emit(RInst{.op = ROp_Store, .sub = opcode & 0x0F, .a = compiler->top(), .b = index});
+        }
+        if ((opcode >> 4) == HOpcode_StDrop) {
+            compiler->drop();
+        }
+    }
+};
+
+} // namespace
+
+RegisterCode compile_registers(const bytefile *file, const std::vector<const char *> &functions,
+                               const std::vector<bool> &tail_calls, const std::vector<bool> *scoped_sexps) {
+    RegisterCode code;
+    std::vector<const char *> begins = functions;
+    std::sort(begins.begin(), begins.end());
+
+    code.index.assign(get_code_size(file), -1);
+    for (size_t i = 0; i < begins.size(); i++) {
+        code.index[begins[i] - file->code_ptr] = i;
+    }
+    for (const char *begin : begins) {
+        code.functions.push_back(FunctionCompiler(file, &code, tail_calls, scoped_sexps).compile(begin));
+    }
+    return code;
+}
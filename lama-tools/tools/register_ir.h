@@ -0,0 +1,79 @@
+#ifndef REGISTER_IR_H
+#define REGISTER_IR_H
+
+#include "bytefile.h"
+#include "opcode.h"
+
+#include <vector>
+
+/*
+ * Register form of verified bytecode. Register `r` of a function is the frame slot
+ * of L(r) for r below the number of locals; above them, register `locals + d` holds
+ * the operand at depth `d`, which is known statically for each instruction.
+ * Registers live in the frame on the virtual stack, so the GC scans them
+ * and nothing has to be spilled around allocations.
+ *
+ * Loads of locals are not copied into registers until their value is needed there
+ * (at a jump target, a call, or when the local is overwritten); stores into a local
+ * of the value computed right before write it in place.
+ */
+enum ROpcode : unsigned char {
+    ROp_Begin,     /* Frame of `a` registers, `b` of them are locals, for `c` arguments */
+    ROp_Const,     /* R(a) = imm */
+    ROp_String,    /* R(a) = literal ptr */
+    ROp_Move,      /* R(a) = R(b) */
+    ROp_Load,      /* R(a) = location `sub`(b) */
+    ROp_Store,     /* location `sub`(b) = R(a) */
+    ROp_LoadAddr,  /* R(a) = R(a + 1) = address of location `sub`(b) */
+    ROp_StoreInd,  /* *R(b) = R(c), R(a) = R(c) */
+    ROp_StoreElem, /* R(a) = Bsta(R(a + 2), R(a + 1), R(a)) */
+    ROp_Elem,      /* R(a) = Belem(R(b), R(c)) */
+    ROp_Swap,      /* R(a) <-> R(b) */
+    ROp_Jmp,       /* Go `a` instructions forward (backward if negative) */
+    ROp_JmpZ,      /* Jmp if R(b) is zero */
+    ROp_JmpNZ,     /* Jmp if R(b) is not zero */
+    ROp_Call,      /* Function c with `b` arguments from R(a), the result goes to R(a); sub marks a tail call */
+    ROp_CallC,     /* Closure R(a) with `b` arguments from R(a + 1), the result goes to R(a); sub marks a tail call */
+    ROp_Ret,       /* Return R(a) */
+    ROp_SExp,      /* R(a) = s-expression tagged ptr of `b` fields from R(a); sub marks a scoped allocation */
+    ROp_Array,     /* R(a) = array of `b` elements from R(a) */
+    ROp_Closure,   /* R(a) = closure of entry b capturing `c` locations listed at ptr, as in CaptureList */
+    ROp_Tag,       /* R(a) = Btag(R(b), hash of ptr, BOX(c)) */
+    ROp_ArrayPatt, /* R(a) = Barray_patt(R(b), BOX(c)) */
+    ROp_Patt,      /* R(a) = pattern `sub` of R(b), and of R(c) for Pattern_String */
+    ROp_LCall,     /* R(a) = LCall `sub` of R(b) */
+    ROp_Fail,      /* Match failure of R(a) at line b, column c */
+    ROp_Stop,
+    ROp_Binop,     /* R(a) = R(b) op R(c), the binop code is added to the opcode */
+};
+
+struct RInst {
+    ROpcode op;
+    unsigned char sub;
+    int a, b, c;
+    union {
+        size_t imm;
+        const char *ptr;
+    };
+};
+
+struct RFunction {
+    const char *begin;
+    int locals;
+    int frame_size; /* Locals and the deepest operand stack */
+    std::vector<RInst> code;
+};
+
+struct RegisterCode {
+    std::vector<RFunction> functions;
+    std::vector<int> index; /* Function by offset of its Begin, -1 elsewhere */
+};
+
+/*
+ * Translates verified functions (with `tail_calls` from the verifier and `scoped_sexps`
+ * from escape analysis, may be nullptr). Calls and closures refer to functions by index in the result.
+ */
+RegisterCode compile_registers(const bytefile *file, const std::vector<const char *> &functions,
+                               const std::vector<bool> &tail_calls, const std::vector<bool> *scoped_sexps);
+
+#endif // REGISTER_IR_H
@@ -0,0 +1,129 @@
+#include "stack_map.h"
+#include "bytefile.h"
+#include "functors/default.h"
+#include "functors/stack_map.h"
+#include "functors/successors.h"
+#include "inst_reader.h"
+#include "opcode.h"
+
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+/**
+ * Merges `incoming` into `state`, slots of different kinds become Slot_Value.
+ * Returns whether `state` has changed.
+ */
+static inline bool join(SlotState &state, const SlotState &incoming) {
+    bool changed = false;
+    auto join_slots = [&](std::vector<SlotKind> &slots, const std::vector<SlotKind> &other) {
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i] != other[i] && slots[i] != Slot_Value) {
+                slots[i] = Slot_Value;
+                changed = true;
+            }
+        }
+    };
+    join_slots(state.stack, incoming.stack);
+    join_slots(state.locals, incoming.locals);
+    return changed;
+}
+
+/* Instructions which may run the collector, their operands are still on the stack meanwhile */
+static inline bool is_allocation(unsigned char opcode) {
+    return opcode == Opcode_String || opcode == Opcode_SExp || opcode == Opcode_Closure ||
+           opcode == COMPOSED(HOpcode_LCall, LCall_Lstring) || opcode == COMPOSED(HOpcode_LCall, LCall_Barray);
+}
+
+/* Locals and `operands` slots from the bottom of the operand stack */
+static inline StackMap make_map(const SlotState &state, size_t operands) {
+    StackMap map;
+    map.reserve(state.locals.size() + operands);
+    for (SlotKind kind : state.locals) {
+        map.push_back(kind == Slot_Value);
+    }
+    for (size_t i = 0; i < operands; i++) {
+        map.push_back(state.stack[i] == Slot_Value);
+    }
+    return map;
+}
+
+static inline void analyze_function(const bytefile *file, const char *begin, StackMaps *maps) {
+    InstReader reader(file);
+
+    const char *end = begin;
+    std::vector<bool> address_taken;
+    while (*end != Opcode_End) {
+        unsigned char x = *end;
+        if (x == COMPOSED(HOpcode_LdA, Location_Local)) {
+            int index = *(const int *)(end + 1);
+            if (index >= (int)address_taken.size()) {
+                address_taken.resize(index + 1, false);
+            }
+            address_taken[index] = true;
+        } else if (x == Opcode_Begin || x == Opcode_CBegin) {
+            int locals_count = *(const int *)(end + 1 + sizeof(int));
+            address_taken.resize(std::max((int)address_taken.size(), locals_count), false);
+        }
+        end = reader.read_inst<DefaultFunctor>(end);
+    }
+
+    std::unordered_map<const char *, SlotState> states;
+    std::queue<const char *> q;
+    states[begin] = SlotState{};
+    q.push(begin);
+
+    while (!q.empty()) {
+        const char *ip = q.front();
+        q.pop();
+
+        SlotState state = states[ip];
+        const char *next = reader.read_inst<SlotKindFunctor>(ip, &state, &address_taken);
+
+        std::vector<const char *> successors;
+        reader.read_inst<SuccessorsFunctor>(ip, file->code_ptr, next, &successors);
+        for (const char *s : successors) {
+            if (s < begin || s > end) {
+                continue;
+            }
+            auto it = states.find(s);
+            if (it == states.end()) {
+                states[s] = state;
+                q.push(s);
+                continue;
+            }
+            if (it->second.stack.size() != state.stack.size() || it->second.locals.size() != state.locals.size()) {
+                // inconsistent stack layout: slots of this function cannot be told apart
+                return;
+            }
+            if (join(it->second, state)) {
+                q.push(s);
+            }
+        }
+    }
+
+    for (const auto &[ip, state] : states) {
+        unsigned char opcode = *ip;
+        if (is_allocation(opcode)) {
+            maps->allocations[ip - file->code_ptr] = make_map(state, state.stack.size());
+        } else if (opcode == Opcode_Call || opcode == Opcode_CallC) {
+            // arguments (and the closure) belong to the frame of the callee
+            int callee_slots = opcode == Opcode_Call ? *(const int *)(ip + 1 + sizeof(int))
+                                                     : *(const int *)(ip + 1) + 1;
+            const char *return_ip = reader.read_inst<DefaultFunctor>(ip);
+            maps->calls[return_ip - file->code_ptr] = make_map(state, state.stack.size() - callee_slots);
+        }
+    }
+}
+
+} // namespace
+
+StackMaps compute_stack_maps(const bytefile *file, const std::vector<const char *> &functions) {
+    StackMaps maps;
+    for (const char *begin : functions) {
+        analyze_function(file, begin, &maps);
+    }
+    return maps;
+}
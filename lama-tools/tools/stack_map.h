@@ -0,0 +1,27 @@
+#ifndef STACK_MAP_H
+#define STACK_MAP_H
+
+#include "bytefile.h"
+
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Slots of a frame which may hold pointers at points where the collector may run:
+ * a flag for each local, then for each operand from the bottom of the operand stack.
+ * Unboxed integers and addresses pushed by LdA are not pointers.
+ */
+using StackMap = std::vector<bool>;
+
+struct StackMaps {
+    std::unordered_map<int, StackMap> allocations; /* By offset of an allocating instruction, slots before it */
+    std::unordered_map<int, StackMap> calls;       /* By offset a call returns to, slots below its arguments */
+};
+
+/*
+ * Computes stack maps of verified functions. A function with an inconsistent stack
+ * layout at some join point gets no maps, so its frames are scanned conservatively.
+ */
+StackMaps compute_stack_maps(const bytefile *file, const std::vector<const char *> &functions);
+
+#endif // STACK_MAP_H
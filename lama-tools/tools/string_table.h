@@ -0,0 +1,29 @@
+#ifndef STRING_TABLE_H
+#define STRING_TABLE_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * A string table being built for a new file. Strings are added by content,
+ * so equal strings (and shared suffixes of source tables) are stored once.
+ */
+class StringTable {
+public:
+    /* Returns the position of the string in the table */
+    int add(const char *s) {
+        auto [it, inserted] = index.emplace(s, strings.size());
+        if (inserted) {
+            strings.insert(strings.end(), s, s + it->first.size() + 1);
+        }
+        return it->second;
+    }
+
+    std::vector<char> strings;
+
+private:
+    std::unordered_map<std::string, int> index;
+};
+
+#endif // STRING_TABLE_H
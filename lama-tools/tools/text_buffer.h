@@ -0,0 +1,76 @@
+#ifndef TEXT_BUFFER_H
+#define TEXT_BUFFER_H
+
+#include <ostream>
+#include <stdio.h>
+#include <string>
+
+/*
+ * Append-only text with hand-rolled number formatting, for outputs too large
+ * to go through iostreams. It is written out with a single call.
+ */
+class TextBuffer {
+public:
+    explicit TextBuffer(size_t capacity = 0) {
+        text.reserve(capacity);
+    }
+
+    inline void put(char c) {
+        text.push_back(c);
+    }
+
+    inline void put(const char *s) {
+        text.append(s);
+    }
+
+    inline void put_dec(int value) {
+        unsigned magnitude = value;
+        if (value < 0) {
+            put('-');
+            magnitude = 0u - magnitude;
+        }
+        char digits[10];
+        int n = 0;
+        do {
+            digits[n++] = '0' + magnitude % 10;
+            magnitude /= 10;
+        } while (magnitude != 0);
+        while (n > 0) {
+            put(digits[--n]);
+        }
+    }
+
+    /* Lowercase digits, padded with `fill` up to `width` characters as std::setw does */
+    inline void put_hex(unsigned value, int width = 0, char fill = ' ') {
+        static constexpr char alphabet[] = "0123456789abcdef";
+        char digits[8];
+        int n = 0;
+        do {
+            digits[n++] = alphabet[value & 0xF];
+            value >>= 4;
+        } while (value != 0);
+        for (int i = n; i < width; i++) {
+            put(fill);
+        }
+        while (n > 0) {
+            put(digits[--n]);
+        }
+    }
+
+    inline size_t size() const {
+        return text.size();
+    }
+
+    inline void write(FILE *out) const {
+        fwrite(text.data(), 1, text.size(), out);
+    }
+
+    inline void write(std::ostream &out) const {
+        out.write(text.data(), text.size());
+    }
+
+private:
+    std::string text;
+};
+
+#endif // TEXT_BUFFER_H
@@ -30,6 +30,7 @@ static inline int verify_function(const bytefile *file, const char *begin, int c
     StackLayout layout{
         .globals = file->global_area_size,
         .locals = 0,
+        .frame_locals = 0,
         .args = 0,
         .captured = captured,
         .jumps = &jumps,
@@ -94,9 +95,9 @@ struct GetCallOffset {
 };
 
 template <>
-struct GetCallOffset<Opcode_Call, char *, int, int> {
+struct GetCallOffset<Opcode_Call, const char *, int, int> {
     int *offset;
-    void operator()(char *, int call_offset, int) {
+    void operator()(const char *, int call_offset, int) {
         *offset = call_offset;
     }
 };
@@ -109,6 +110,7 @@ static inline void verify_calls(
     StackLayout layout{
         .globals = file->global_area_size,
         .locals = 0,
+        .frame_locals = 0,
         .args = 0,
         .captured = 0,
         .jumps = &jumps,
@@ -182,12 +184,12 @@ struct PushCallOffset<Opcode_Call, const char *, int, int> {
 };
 
 template <>
-struct PushCallOffset<Opcode_Closure, int, std::vector<LocationEntry>> {
+struct PushCallOffset<Opcode_Closure, int, CaptureList> {
     std::vector<const char *> *begins;
     std::vector<ClosureEntry> *cbegins;
     const char *code_ptr;
 
-    void operator()(int offset, const std::vector<LocationEntry> &capture) {
+    void operator()(int offset, CaptureList capture) {
         const char *begin = code_ptr + offset;
         if (*begin != Opcode_CBegin && *begin != Opcode_Begin) {
             FAIL(1, "Closure offset 0x%.8x points to opcode %d, %d or %d expected",
@@ -197,9 +199,24 @@ struct PushCallOffset<Opcode_Closure, int, std::vector<LocationEntry>> {
     }
 };
 
+/*
+ * Whether the result of a call returning to `ip` is returned right away,
+ * possibly after unconditional jumps. Jumps are verified already.
+ */
+static inline bool is_tail_position(const bytefile *file, const char *ip) {
+    // a longer chain of jumps is a loop
+    for (int jumps = 0; *ip == Opcode_Jmp && jumps < get_code_size(file); jumps++) {
+        ip = file->code_ptr + *(const int *)(ip + 1);
+    }
+    return *ip == Opcode_End || *ip == Opcode_Ret;
+}
+
 } // namespace
 
-void verify_reachable_instructions(const bytefile *file, const std::vector<const char *> &entrypoints) {
+VerificationInfo verify_reachable_instructions(const bytefile *file, const std::vector<const char *> &entrypoints) {
+    VerificationInfo info{
+        .has_aggregate_stores = false,
+    };
     std::queue<const char *> q;
     std::vector<bool> visited(get_code_size(file));
     std::vector<const char *> begins;
@@ -216,6 +233,10 @@ void verify_reachable_instructions(const bytefile *file, const std::vector<const
         const char *ip = q.front();
         q.pop();
 
+        if (*ip == Opcode_StA) {
+            info.has_aggregate_stores = true;
+        }
+
         std::vector<const char *> successors;
         const char *next = reader.read_inst<PushCallOffset>(ip, &begins, &cbegins, file->code_ptr);
         reader.read_inst<SuccessorsFunctor>(ip, file->code_ptr, next, &successors);
@@ -241,4 +262,17 @@ void verify_reachable_instructions(const bytefile *file, const std::vector<const
     for (const ClosureEntry &cl : cbegins) {
         verify_calls(file, cl.offset, min_args_count);
     }
+
+    for (auto &[begin, _] : min_args_count) {
+        info.functions.push_back((const char *)begin);
+    }
+
+    info.tail_calls.assign(visited.size(), false);
+    for (size_t offset = 0; offset < visited.size(); offset++) {
+        const char *ip = file->code_ptr + offset;
+        if (visited[offset] && (*ip == Opcode_Call || *ip == Opcode_CallC)) {
+            info.tail_calls[offset] = is_tail_position(file, reader.read_inst<DefaultFunctor>(ip));
+        }
+    }
+    return info;
 }
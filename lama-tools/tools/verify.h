@@ -3,6 +3,13 @@
 
 #include "bytefile.h"
 
-void verify_reachable_instructions(const bytefile *file, const std::vector<const char *> &entrypoints);
+/* Facts about reachable code collected during verification */
+struct VerificationInfo {
+    bool has_aggregate_stores;             /* Whether some reachable instruction stores into an array or a string */
+    std::vector<const char *> functions;   /* Beginnings of all reachable functions and closures */
+    std::vector<bool> tail_calls;          /* By code offset: whether the Call or CallC there returns its result right away */
+};
+
+VerificationInfo verify_reachable_instructions(const bytefile *file, const std::vector<const char *> &entrypoints);
 
 #endif // VERIFY_H